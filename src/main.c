@@ -71,10 +71,18 @@ static void cleanup()
             shutdown(g_listen_socket, 2);  /* 2: RDWR stop */
             SOCKET_CLOSE(g_listen_socket);
         }
+#ifndef _WIN32
+        if (g_unix_socket != INVALID_SOCKET) {
+            SOCKET_CLOSE(g_unix_socket);
+            unlink(g_conf->unix_socket);
+        }
+        if (g_udp_socket != INVALID_SOCKET)
+            SOCKET_CLOSE(g_udp_socket);
+#endif
 
         if (action == ACT_START) {
             if (g_queue != NULL) {
-                que_finalize(g_queue);
+                dq_finalize(g_queue);
                 TRACE("%s terminated.\n", "event queue");
             }
         }
@@ -113,6 +121,8 @@ static int startup()
 {
     /* グローバル変数の初期化 */
     g_listen_socket = INVALID_SOCKET;
+    g_unix_socket = INVALID_SOCKET;
+    g_udp_socket = INVALID_SOCKET;
 
     /* 割り込み処理用のクリティカルセクション初期化 */
     CS_INIT(&shutdown_lock);
@@ -131,7 +141,7 @@ static int startup()
     logout_initialize(g_conf->output_file);
 
     if (action == ACT_START) {
-        g_queue = que_initialize();
+        g_queue = dq_initialize(DISPATCH_QUEUE_SIZE);
         if (g_queue == NULL)
             return -1;
         TRACE("%s initialized.\n", "event queue");
@@ -188,8 +198,20 @@ static int parse_config()
     g_conf->port_no = DEFAULT_PORT;
     g_conf->backlog = DEFAULT_BACKLOG;
     g_conf->worker_threads = DEFAULT_WORKER_THREADS;
+    g_conf->reactors = DEFAULT_REACTORS;
+    g_conf->dispatch_quantum = DEFAULT_DISPATCH_QUANTUM;
+    g_conf->max_connections = DEFAULT_MAX_CONNECTIONS;
+    g_conf->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    g_conf->zerocopy_size = DEFAULT_ZEROCOPY_SIZE;
+    g_conf->udp_port = DEFAULT_UDP_PORT;
+    g_conf->udp_threads = DEFAULT_UDP_THREADS;
+    strcpy(g_conf->udp_bind, DEFAULT_UDP_BIND);
     g_conf->nio_bucket_num = DEFAULT_BUCKET_NUM;
     g_conf->nio_mmap_size = MMAP_AUTO_SIZE;
+    g_conf->cache_size = DEFAULT_CACHE_SIZE;
+    g_conf->bloom_keys = DEFAULT_BLOOM_KEYS;
+    g_conf->expire_rate = DEFAULT_EXPIRE_RATE;
+    g_conf->append_chunks = DEFAULT_APPEND_CHUNKS;
 
     /* コンフィグファイル名がパラメータで指定されていない場合は
        デフォルトのファイル名を使用します。*/
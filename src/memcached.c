@@ -29,6 +29,8 @@
  * <<memcachedプロトコル仕様書>>
  * http://code.sixapart.com/svn/memcached/trunk/server/doc/protocol.txt
  *
+ * バイナリプロトコルは memcached_binary.c で実装しています。
+ *
  * データは最大1MBまでに制限されています。
  * キー長は250バイトまでに制限されています。
  *
@@ -84,7 +86,17 @@
  *
  *    <コマンド> <key> <value>
  *
- * 各種ステータスを表示する stats コマンドには対応していません。
+ * 有効期限の変更を行うコマンド(touch)と、有効期限を変更して取得する
+ * コマンド(gat,gats)は以下のような文法となります。
+ * 値を送信せずにデータのヘッダーの<exptime>のみを更新します。
+ * gat, gats の応答は get, gets と同じ形式です。
+ *
+ *    touch <key> <exptime> [noreply]
+ *    gat <exptime> <key[ key1 key2 ...]>
+ *    gats <exptime> <key[ key1 key2 ...]>
+ *
+ * 各種ステータスを表示する stats コマンドはサーバーの統計情報を
+ * "STAT <name> <value>" の形式で返します。
  *
  * 終了 quit コマンドで接続が遮断されます。
  *
@@ -132,6 +144,7 @@
 #endif
 
 #include "nio_server.h"
+#include <ctype.h>
 
 #define CMD_SET         1   /* データの保存(キーが存在している場合は置換) */
 #define CMD_ADD         2   /* データの保存(キーが既に存在しない場合のみ) */
@@ -148,6 +161,10 @@
 #define CMD_STATS       13  /* 各種ステータスを表示 */
 #define CMD_VERSION     14  /* バージョンを表示 */
 #define CMD_VERBOSITY   15  /* 動作確認 */
+#define CMD_TOUCH       16  /* 有効期限の変更 */
+#define CMD_GAT         17  /* 有効期限を変更して取得 */
+#define CMD_GATS        18  /* 有効期限を変更して取得(バージョン付き) */
+#define CMD_META        20  /* メタコマンド(mg, ms, md, ma, mn) */
 #define CMD_QUIT        30  /* 終了(コネクション切断) */
 #define CMD_STATUS      100 /* ステータス確認 */
 #define CMD_SHUTDOWN    110 /* 終了(シャットダウン) */
@@ -157,26 +174,6 @@
 
 #define VERSION_STR PROGRAM_VERSION
 
-#define DATABLOCK_HEADER_SIZE   (sizeof(uchar)+sizeof(uint)+sizeof(uint))
-
-#define MAX_MEMCACHED_KEYSIZE   250
-#define MAX_MEMCACHED_DATASIZE  (1*1024*1024+DATABLOCK_HEADER_SIZE)   /* 1MB + data block header */
-
-#define CHECK_NONE      0
-#define CHECK_ADD       1
-#define CHECK_REPLACE   2
-
-#define UPDATE_APPEND   1
-#define UPDATE_PREPEND  2
-
-#define MODE_INCR       1
-#define MODE_DECR       2
-
-#define STORE_STORED     0
-#define STORE_NOT_STORED -1
-#define STORE_EXISTS     -2
-#define STORE_NOT_FOUND  -3
-
 #define LINE_DELIMITER  "\r\n"
 
 #define DATA_COMPRESS_Z     0x01
@@ -185,11 +182,19 @@
 #define STAT_CLOSE     0x02
 #define STAT_SHUTDOWN  0x04
 
-#ifdef WIN32
-static HANDLE memcached_queue_cond;
+/* 存在判定フィルタへの登録から書き込みまでと flush_all を排他するロック */
+#ifdef _WIN32
+static SRWLOCK flush_lock = SRWLOCK_INIT;
+#define FLUSH_SHARED_LOCK()     AcquireSRWLockShared(&flush_lock)
+#define FLUSH_SHARED_UNLOCK()   ReleaseSRWLockShared(&flush_lock)
+#define FLUSH_LOCK()            AcquireSRWLockExclusive(&flush_lock)
+#define FLUSH_UNLOCK()          ReleaseSRWLockExclusive(&flush_lock)
 #else
-static pthread_mutex_t memcached_queue_mutex;
-static pthread_cond_t memcached_queue_cond;
+static pthread_rwlock_t flush_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define FLUSH_SHARED_LOCK()     pthread_rwlock_rdlock(&flush_lock)
+#define FLUSH_SHARED_UNLOCK()   pthread_rwlock_unlock(&flush_lock)
+#define FLUSH_LOCK()            pthread_rwlock_wrlock(&flush_lock)
+#define FLUSH_UNLOCK()          pthread_rwlock_unlock(&flush_lock)
 #endif
 
 static int open_database()
@@ -226,146 +231,353 @@ static int open_database()
             return -1;
         }
     }
+
+    /* キーの存在判定フィルタを作成します。*/
+    if (g_conf->bloom_keys > 0) {
+        if (bloom_initialize(g_conf->nio_db, g_conf->bloom_keys) < 0) {
+            nio_close(g_conf->nio_db);
+            nio_finalize(g_conf->nio_db);
+            return -1;
+        }
+    }
+
+    /* ホットオブジェクトキャッシュの初期化 */
+    if (g_conf->cache_size > 0) {
+        if (cache_initialize(g_conf->cache_size) < 0) {
+            if (g_conf->bloom_keys > 0)
+                bloom_finalize();
+            nio_close(g_conf->nio_db);
+            nio_finalize(g_conf->nio_db);
+            return -1;
+        }
+    }
     return 0;
 }
 
 static void close_database()
 {
+    if (g_conf->cache_size > 0)
+        cache_finalize();
+    if (g_conf->bloom_keys > 0)
+        bloom_finalize();
     if (g_conf->nio_db) {
         nio_close(g_conf->nio_db);
         nio_finalize(g_conf->nio_db);
     }
 }
 
-static int parse_command(const char* str)
-{
-    if (stricmp(str, "set") == 0)
-        return CMD_SET;
-    if (stricmp(str, "add") == 0)
-        return CMD_ADD;
-    if (stricmp(str, "replace") == 0)
-        return CMD_REPLACE;
-    if (stricmp(str, "append") == 0)
-        return CMD_APPEND;
-    if (stricmp(str, "prepend") == 0)
-        return CMD_PREPEND;
-    if (stricmp(str, "cas") == 0)
-        return CMD_CAS;
-    if (stricmp(str, "get") == 0)
-        return CMD_GET;
-    if (stricmp(str, "gets") == 0)
-        return CMD_GETS;
-    if (stricmp(str, "delete") == 0)
-        return CMD_DELETE;
-    if (stricmp(str, "incr") == 0)
-        return CMD_INCR;
-    if (stricmp(str, "decr") == 0)
-        return CMD_DECR;
-    if (stricmp(str, "stats") == 0)
-        return CMD_STATS;
-    if (stricmp(str, "version") == 0)
-        return CMD_VERSION;
-    if (stricmp(str, "verbosity") == 0)
-        return CMD_VERBOSITY;
-    if (stricmp(str, "flush_all") == 0)
-        return CMD_FLUSH_ALL;
-    if (stricmp(str, "quit") == 0)
-        return CMD_QUIT;
-
-    if (strcmp(str, SHUTDOWN_CMD) == 0)
-        return CMD_SHUTDOWN;
-    if (strcmp(str, STATUS_CMD) == 0)
-        return CMD_STATUS;
-
-    if (stricmp(str, "bget") == 0)
-        return CMD_BGET;
-    if (stricmp(str, "bset") == 0)
-        return CMD_BSET;
-    if (stricmp(str, "bkeys") == 0)
-        return CMD_BKEYS;
+/* コマンド名とコマンドの対応表 */
+static struct {
+    const char* name;
+    int cmd;
+    int icase;              /* 大文字小文字を区別しない */
+} command_table[] = {
+    { "set",        CMD_SET,        1 },
+    { "add",        CMD_ADD,        1 },
+    { "replace",    CMD_REPLACE,    1 },
+    { "append",     CMD_APPEND,     1 },
+    { "prepend",    CMD_PREPEND,    1 },
+    { "cas",        CMD_CAS,        1 },
+    { "get",        CMD_GET,        1 },
+    { "gets",       CMD_GETS,       1 },
+    { "delete",     CMD_DELETE,     1 },
+    { "incr",       CMD_INCR,       1 },
+    { "decr",       CMD_DECR,       1 },
+    { "stats",      CMD_STATS,      1 },
+    { "version",    CMD_VERSION,    1 },
+    { "verbosity",  CMD_VERBOSITY,  1 },
+    { "flush_all",  CMD_FLUSH_ALL,  1 },
+    { "quit",       CMD_QUIT,       1 },
+    { "touch",      CMD_TOUCH,      1 },
+    { "gat",        CMD_GAT,        1 },
+    { "gats",       CMD_GATS,       1 },
+    { "mg",         CMD_META,       0 },
+    { "ms",         CMD_META,       0 },
+    { "md",         CMD_META,       0 },
+    { "ma",         CMD_META,       0 },
+    { "mn",         CMD_META,       0 },
+    { SHUTDOWN_CMD, CMD_SHUTDOWN,   0 },
+    { STATUS_CMD,   CMD_STATUS,     0 },
+    { "bget",       CMD_BGET,       1 },
+    { "bset",       CMD_BSET,       1 },
+    { "bkeys",      CMD_BKEYS,      1 }
+};
+
+/*
+ * コマンド名の長さと先頭の２バイトから command_table の位置を求める
+ * ハッシュ表です。値は command_table の添字 + 1 で、0 は空きです。
+ * 現在のコマンドは衝突しないため１回の比較で決まります。
+ */
+#define COMMAND_HASH_SIZE   128
+
+static uchar command_hash[COMMAND_HASH_SIZE];
+
+static uint command_hash_value(const char* s, int len)
+{
+    uint c0 = (uchar)s[0] | 0x20;
+    uint c1 = (len > 1)? ((uchar)s[1] | 0x20) : 0;
+
+    return (c0 + c1 * 3 + (uint)len * 8) & (COMMAND_HASH_SIZE - 1);
+}
+
+static void command_initialize()
+{
+    int i;
 
+    memset(command_hash, 0, sizeof(command_hash));
+    for (i = 0; i < (int)(sizeof(command_table) / sizeof(command_table[0])); i++) {
+        const char* name = command_table[i].name;
+        uint h = command_hash_value(name, strlen(name));
+
+        /* 衝突した場合は次の空きを使用します。*/
+        while (command_hash[h])
+            h = (h + 1) & (COMMAND_HASH_SIZE - 1);
+        command_hash[h] = (uchar)(i + 1);
+    }
+}
+
+/*
+ * len バイトのコマンド名からコマンドを求めます。
+ * コマンド名は NULL終端されている必要はありません。
+ *
+ * 戻り値
+ *  CMD_XXX
+ *  コマンドが存在しない場合は -1
+ */
+static int lookup_command(const char* s, int len)
+{
+    uint h;
+
+    if (len < 1)
+        return -1;
+    h = command_hash_value(s, len);
+    while (command_hash[h]) {
+        int index = command_hash[h] - 1;
+        const char* name = command_table[index].name;
+        int i;
+
+        for (i = 0; i < len && name[i]; i++) {
+            char c = s[i];
+
+            if (command_table[index].icase && c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            if (c != name[i])
+                break;
+        }
+        if (i == len && name[i] == '\0')
+            return command_table[index].cmd;
+        h = (h + 1) & (COMMAND_HASH_SIZE - 1);
+    }
     return -1;
 }
 
-static int cmd_error(SOCKET socket)
+static int parse_command(const struct token_t* token)
+{
+    return lookup_command(token->value, token->length);
+}
+
+/*
+ * NULL終端されたコマンド行を空白で分割して tokens に設定します。
+ * 各トークンはコマンド行の中で NULL終端されるため、メモリの確保や
+ * コピーは行いません(コマンド行の内容は変更されます)。
+ *
+ * line: コマンド行
+ * tokens: トークンが設定される配列
+ * max_tokens: tokens の要素数
+ * rest: max_tokens を超えたトークンがある場合はその先頭が、
+ *       ない場合は NULL が設定されます。
+ *
+ * 戻り値
+ *  トークン数
+ */
+int tokenize(char* line, struct token_t* tokens, int max_tokens, char** rest)
+{
+    char* p = line;
+    int n = 0;
+
+    *rest = NULL;
+    while (*p) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        if (n >= max_tokens) {
+            *rest = p;
+            break;
+        }
+        tokens[n].value = p;
+        while (*p && *p != ' ')
+            p++;
+        tokens[n].length = (int)(p - tokens[n].value);
+        n++;
+        if (*p)
+            *p++ = '\0';
+    }
+    return n;
+}
+
+/*
+ * 数字のみで構成された len バイトの文字列を符号なし64bit整数に変換します。
+ * 桁あふれする場合はエラーになります。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー
+ */
+int token_uint64(const char* s, int len, uint64* n)
+{
+    uint64 v = 0;
+    int i;
+
+    if (len < 1)
+        return -1;
+    for (i = 0; i < len; i++) {
+        uint d = (uchar)s[i] - '0';
+
+        if (d > 9)
+            return -1;
+        if (v > (((uint64)-1) - d) / 10)
+            return -1;  /* overflow */
+        v = v * 10 + d;
+    }
+    *n = v;
+    return 0;
+}
+
+/*
+ * 数字のみで構成された len バイトの文字列を符号なし32bit整数に変換します。
+ */
+int token_uint(const char* s, int len, uint* n)
+{
+    uint64 v;
+
+    if (token_uint64(s, len, &v) < 0 || v > 0xffffffffU)
+        return -1;
+    *n = (uint)v;
+    return 0;
+}
+
+/*
+ * 数字のみで構成された len バイトの文字列を 0 以上の int に変換します。
+ */
+int token_int(const char* s, int len, int* n)
+{
+    uint64 v;
+
+    if (token_uint64(s, len, &v) < 0 || v > 0x7fffffff)
+        return -1;
+    *n = (int)v;
+    return 0;
+}
+
+static int cmd_error(struct conn_t* conn)
 {
     char* buf = "ERROR\r\n";
 
-    if (send_data(socket, buf, strlen(buf)) < 0) {
+    if (conn_send(conn, buf, strlen(buf)) < 0) {
         err_write("memcached: cmd_error() send failed.");
         return -1;
     }
     return 0;
 }
 
-static int client_error(SOCKET socket, const char* err_msg)
+static int client_error(struct conn_t* conn, const char* err_msg)
 {
     char buf[1024];
 
     snprintf(buf, sizeof(buf), "ERROR %s\r\n", err_msg);
-    if (send_data(socket, buf, strlen(buf)) < 0) {
+    if (conn_send(conn, buf, strlen(buf)) < 0) {
         err_write("memcached: client_error() error.");
         return -1;
     }
     return 0;
 }
 
-static int server_error(SOCKET socket, const char* err_msg)
+static int server_error(struct conn_t* conn, const char* err_msg)
 {
     char buf[1024];
 
     snprintf(buf, sizeof(buf), "SERVER_ERROR %s\r\n", err_msg);
-    if (send_data(socket, buf, strlen(buf)) < 0) {
+    if (conn_send(conn, buf, strlen(buf)) < 0) {
         err_write("memcached: server_error() error.");
         return -1;
     }
     return 0;
 }
 
-static int noreply(int n, const char** p)
+static int noreply(int n, const struct token_t* tokens)
 {
     if (n > 1)
-        return (stricmp(p[n-1], "noreply") == 0);
+        return (tokens[n-1].length == 7 && stricmp(tokens[n-1].value, "noreply") == 0);
     return 0;
 }
 
-static int store_args_check(SOCKET socket, int cn, const char** cl, int args)
+/*
+ * 受信済みの <data block> を読み捨てます。
+ * command_size() は <bytes> が正しい場合に <data block> まで受信してから
+ * コマンドを処理するため、エラー時に読み捨てないと値がコマンドとして
+ * 処理されてしまいます。
+ */
+static void skip_datablock(struct conn_t* conn, int n, const struct token_t* tokens)
+{
+    int bytes;
+
+    if (n < 5)
+        return;
+    if (token_int(tokens[4].value, tokens[4].length, &bytes) < 0 ||
+        bytes > MAX_MEMCACHED_DATASIZE)
+        return;     /* <data block> は受信されていません。*/
+    if (conn_nptr(conn, bytes + (int)strlen(LINE_DELIMITER)) == NULL) {
+        conn->rpos += conn->rlen;
+        conn->rlen = 0;
+    }
+}
+
+/*
+ * ストレージコマンドのコマンドラインのエラー応答を送信します。
+ */
+static int store_error(struct conn_t* conn, int n, const struct token_t* tokens)
+{
+    char* buf = "CLIENT_ERROR bad command line format\r\n";
+
+    skip_datablock(conn, n, tokens);
+    if (! noreply(n, tokens)) {
+        if (conn_send(conn, buf, strlen(buf)) < 0)
+            err_write("memcached: store_error() send failed.");
+    }
+    return -1;
+}
+
+static int store_args_check(struct conn_t* conn, int n, const struct token_t* tokens, int args)
 {
-    if (cn < args) {
-        if (! noreply(cn, cl)) {
+    if (n < args) {
+        skip_datablock(conn, n, tokens);
+        if (! noreply(n, tokens)) {
             char msg[256];
 
             snprintf(msg, sizeof(msg), "illegal command line.");
-            client_error(socket, msg);
+            client_error(conn, msg);
         }
         return -1;
     }
     return 0;
 }
 
-static int store_size_check(SOCKET socket, const char* key, int bytes, int noreply_flag)
+static int store_size_check(struct conn_t* conn, int bytes, int noreply_flag)
 {
     char msg[256];
 
-    if (strlen(key) > MAX_MEMCACHED_KEYSIZE) {
-        if (! noreply_flag) {
-            snprintf(msg, sizeof(msg), "key size too long %d <= %d",
-                     (int)strlen(key), MAX_MEMCACHED_KEYSIZE);
-            client_error(socket, msg);
-        }
-        return -1;
-    }
     if (bytes < 0) {
         if (! noreply_flag) {
             snprintf(msg, sizeof(msg), "illegal bytes %d", bytes);
-            client_error(socket, msg);
+            client_error(conn, msg);
         }
         return -1;
     }
     if (bytes > MAX_MEMCACHED_DATASIZE) {
         if (! noreply_flag) {
             snprintf(msg, sizeof(msg), "data too long %d <= 1MB", bytes);
-            client_error(socket, msg);
+            client_error(conn, msg);
         }
         return -1;
     }
@@ -375,63 +587,67 @@ static int store_size_check(SOCKET socket, const char* key, int bytes, int norep
 static int check_expier(uint exptime, const char* key, int keysize)
 {
     if (exptime > 0) {
-        if (exptime < system_seconds()) {
-            /* 生存期間を過ぎているため削除します。 */
-            nio_delete(g_conf->nio_db, key, keysize);
+        if (exptime < current_seconds()) {
+            uint dexptime;
+            int bytes;
+
+            /* 生存期間を過ぎているため削除します。
+               読み込んだ後に上書きされている場合は削除しません。*/
+            memcached_expire(key, keysize, &dexptime, &bytes);
             return 1;
         }
     }
     return 0;
 }
 
-static void dust_recv_buffer(struct sock_buf_t* sb)
+static void dust_recv_buffer(struct conn_t* conn)
 {
-    int end_flag = 0;
-
-    while (! end_flag) {
-        char buf[BUF_SIZE];
+    int len;
 
-        if (! sockbuf_wait_data(sb, RCV_TIMEOUT_NOWAIT))
-            break;  /* empty */
-        if (sockbuf_gets(sb, buf, sizeof(buf), LINE_DELIMITER, 0, &end_flag) < 1)
-            break;
+    /* 行末(CRLF)までを読み捨てます。*/
+    if (conn_line(conn, conn->rlen, &len) == NULL) {
+        /* 行末がない場合はすべて読み捨てます。*/
+        conn->rpos += conn->rlen;
+        conn->rlen = 0;
     }
 }
 
-static int datablock_recv(struct sock_buf_t* sb, int cn, const char** cl, char* buf, int bytes)
+/*
+ * <data block> を受信バッファからコピーせずに取り出します。
+ *
+ * 戻り値
+ *  受信バッファ内の <data block> の先頭のポインタ
+ *  エラーの場合は NULL(エラー応答は送信済み)
+ */
+static char* datablock_recv(struct conn_t* conn, int n, const struct token_t* tokens, int bytes)
 {
-    int bufsize;
-    int len;
-    int line_flag;
-    int data_err = 0;
-
-    /* bufsize: (bytes + strlen(CRLF) + NULL terminate) */
-    bufsize = bytes  + strlen(LINE_DELIMITER) + 1;
-    len = sockbuf_gets(sb, buf, bufsize, LINE_DELIMITER, 0, &line_flag);
-    if (len < 1)
-        return -1;
-    if (! line_flag) {
-        /* 行末(CRLF)まで読み捨てます。*/
-        dust_recv_buffer(sb);
-        data_err = 1;
-        err_write("datablock_recv() not found <CRLF> socket=%d, len=%d", sb->socket, len);
+    int len = conn->rlen;
+    char* data;
+
+    /* <data block> は <bytes> のデータと CRLF で構成されます。*/
+    data = conn_nptr(conn, bytes);
+    if (data != NULL) {
+        if (conn->rlen >= (int)strlen(LINE_DELIMITER) &&
+            memcmp(conn->rbuf + conn->rpos, LINE_DELIMITER, strlen(LINE_DELIMITER)) == 0) {
+            conn->rpos += strlen(LINE_DELIMITER);
+            conn->rlen -= strlen(LINE_DELIMITER);
+            return data;
+        }
+        err_write("datablock_recv() not found <CRLF> socket=%d, len=%d", conn->socket, bytes);
     }
-    if (len != bytes)
-        data_err = 1;
 
-    if (data_err) {
-        if (! noreply(cn, cl)) {
-            char msg[256];
+    /* 行末(CRLF)まで読み捨てます。*/
+    dust_recv_buffer(conn);
+    if (! noreply(n, tokens)) {
+        char msg[256];
 
-            snprintf(msg, sizeof(msg), "<data block> size error, socket=%d, req bytes=%d, recv len=%d", sb->socket, bytes, len);
-            client_error(sb->socket, msg);
-        }
-        return -1;
+        snprintf(msg, sizeof(msg), "<data block> size error, socket=%d, req bytes=%d, recv len=%d", conn->socket, bytes, len);
+        client_error(conn, msg);
     }
-    return 0;
+    return NULL;
 }
 
-static int store_response(SOCKET socket, int result)
+static int store_response(struct conn_t* conn, int result)
 {
     char* reply_str;
 
@@ -445,14 +661,14 @@ static int store_response(SOCKET socket, int result)
     else
         reply_str = "NOT_STORED\r\n";
 
-    if (send_data(socket, reply_str, strlen(reply_str)) < 0) {
+    if (conn_send(conn, reply_str, strlen(reply_str)) < 0) {
         err_write("memcached: store_response() send error.");
         return -1;
     }
     return 0;
 }
 
-static void set_data_header(char* buf, uint flags, uint exptime)
+void set_data_header(char* buf, uint flags, uint exptime)
 {
     uchar size = DATABLOCK_HEADER_SIZE - sizeof(uchar);
 
@@ -461,7 +677,7 @@ static void set_data_header(char* buf, uint flags, uint exptime)
     memcpy(&buf[sizeof(uchar)+sizeof(uint)], &exptime, sizeof(uint));
 }
 
-static void get_data_header(const char* buf, uint* flags, uint* exptime)
+void get_data_header(const char* buf, uint* flags, uint* exptime)
 {
     uchar size;
 
@@ -472,238 +688,788 @@ static void get_data_header(const char* buf, uint* flags, uint* exptime)
         memcpy(exptime, &buf[sizeof(uchar)+sizeof(uint)], sizeof(uint));
 }
 
-static int set(struct sock_buf_t* sb,
-               int cn,
-               const char** cl,
-               int args,
-               int cas_flag,
-               int check_mode)
+/*
+ * 受信バッファ内の値(data)の直前にヘッダーを書き込んで、値をコピーせずに
+ * ヘッダーを含むデータブロックを作成します。
+ * 直前の領域は処理済みのコマンドで、上書きされる内容は save に退避されて
+ * memcached_datablock_release() で元に戻されます。
+ * 上書きされる範囲にキーがある場合があるため、保存に使用するキーは
+ * 事前にコピーしておく必要があります。
+ * 直前に領域がない場合のみ領域を確保して値をコピーします。
+ *
+ * save: DATABLOCK_HEADER_SIZE バイトの退避領域
+ *
+ * 戻り値
+ *  データブロック(DATABLOCK_HEADER_SIZE + bytes)
+ *  メモリが不足している場合は NULL
+ */
+char* memcached_datablock(struct conn_t* conn, char* data, int bytes,
+                          uint flags, uint exptime, char* save)
 {
-    int result = 0;
-    char* key;
-    char* flags_s;
-    char* exptime_s;
-    char* bytes_s;
-    uint flags;
-    uint exptime;
-    int bytes;
-    int64 cas = 0;
-    int bufsize;
     char* buf;
 
-    if (store_args_check(sb->socket, cn, cl, args) < 0)
-        return -1;
+    if (data - conn->rbuf >= (int)DATABLOCK_HEADER_SIZE) {
+        buf = data - DATABLOCK_HEADER_SIZE;
+        memcpy(save, buf, DATABLOCK_HEADER_SIZE);
+    } else {
+        buf = (char*)malloc(DATABLOCK_HEADER_SIZE + bytes);
+        if (buf == NULL)
+            return NULL;
+        memcpy(&buf[DATABLOCK_HEADER_SIZE], data, bytes);
+    }
+    set_data_header(buf, flags, exptime);
+    return buf;
+}
 
-    key = trim((char*)cl[1]);
+void memcached_datablock_release(char* buf, char* data, const char* save)
+{
+    if (buf == data - DATABLOCK_HEADER_SIZE)
+        memcpy(buf, save, DATABLOCK_HEADER_SIZE);
+    else
+        free(buf);
+}
 
-    flags_s = trim((char*)cl[2]);
-    if (! isdigitstr(flags_s))
-        return -1;
-    flags = (uint)atoi(flags_s);
+/*
+ * 以下はテキストプロトコル、メタコマンド(memcached_meta.c)と
+ * バイナリプロトコル(memcached_binary.c)で共通のデータベース操作です。
+ * キーは NULL終端されている必要はありません。
+ */
 
-    exptime_s = trim((char*)cl[3]);
-    if (! isdigitstr(exptime_s))
-        return -1;
-    exptime = (uint)atoi(exptime_s);
-    if (exptime > 0)
-        exptime += system_seconds();
+/*
+ * キーがデータベースに存在する可能性があるかを判定します。
+ * nio.bloom_keys が指定されていない場合は常に真です。
+ */
+static int maybe_exists(const char* key, int keysize)
+{
+    return (g_conf->bloom_keys < 1 || bloom_maybe(key, keysize));
+}
 
-    bytes_s = trim((char*)cl[4]);
-    if (! isdigitstr(bytes_s))
-        return -1;
-    bytes = atoi(bytes_s);
+/*
+ * データベースへの書き込みを開始します。
+ * 存在判定フィルタを使用する場合は、登録と書き込みの間にフィルタが
+ * flush_all でクリアされないように write_end() まで共有ロックを保持します。
+ * キーのロック(key_lock)は先に取得する必要があります。
+ */
+static void write_begin()
+{
+    if (g_conf->bloom_keys > 0)
+        FLUSH_SHARED_LOCK();
+}
 
-    if (cas_flag) {
-        char* cas_s;
+static void write_end()
+{
+    if (g_conf->bloom_keys > 0)
+        FLUSH_SHARED_UNLOCK();
+}
 
-        cas_s = trim((char*)cl[5]);
-        if (! isdigitstr(cas_s))
-            return -1;
-        cas = atoi64(cas_s);
+/*
+ * 新しいキーを存在判定フィルタに登録します。
+ * 上書きで登録を重ねるとカウンタが減らなくなるため、データベースに
+ * ないキーだけを登録します。key_lock() と write_begin() の後、
+ * データベースに書き込む前に呼び出します。
+ */
+static void register_key(const char* key, int keysize)
+{
+    char* dbuf;
+    int dsize;
+
+    if (g_conf->bloom_keys < 1)
+        return;
+    if (bloom_maybe(key, keysize)) {
+        dbuf = nio_aget(g_conf->nio_db, key, keysize, &dsize);
+        if (dbuf) {
+            nio_free(g_conf->nio_db, dbuf);
+            return;
+        }
     }
-    if (store_size_check(sb->socket, key, bytes, noreply(cn, cl)) < 0)
-        return -1;
+    bloom_add(key, keysize);
+}
 
-    /* data block を socket から取得します。*/
-    bufsize = DATABLOCK_HEADER_SIZE + bytes;
-    buf = (char*)malloc(bufsize + strlen(LINE_DELIMITER) + 1);
-    if (buf == NULL) {
-        err_write("memcached: set() no memory.");
-        return -1;
+/*
+ * 分割されたデータのセグメント(nio_chunk.c)のキーかを判定します。
+ * セグメントはクライアントのコマンドでは参照・更新できません。
+ */
+static int reserved_key(const char* key, int keysize)
+{
+    return (keysize >= CHUNK_KEY_PREFIX_SIZE &&
+            memcmp(key, CHUNK_KEY_PREFIX, CHUNK_KEY_PREFIX_SIZE) == 0);
+}
+
+/*
+ * データベースを更新したキーをキャッシュから外します。
+ */
+static void invalidate(const char* key, int keysize)
+{
+    if (g_conf->cache_size > 0)
+        cache_remove(key, keysize);
+}
+
+/*
+ * キーのデータをデータベースから読み込みます。
+ * 分割されたデータ(nio_chunk.c)の場合はセグメントを連結して返します。
+ * 取得したデータは free_data() で解放します。
+ */
+static char* read_data(const char* key, int keysize, int* dsize, int64* cas)
+{
+    int retry;
+
+    /* 読み込み中にセグメントが書き直された場合は読み直します。*/
+    for (retry = 0; retry < 3; retry++) {
+        char* dbuf;
+        char* buf;
+
+        dbuf = nio_agets(g_conf->nio_db, key, keysize, dsize, cas);
+        if (dbuf == NULL || ! (dbuf[0] & DATA_HEADER_CHUNKED))
+            return dbuf;
+        buf = chunk_load(dbuf, *dsize, dsize);
+        nio_free(g_conf->nio_db, dbuf);
+        if (buf)
+            return buf;
     }
-    set_data_header(buf, flags, exptime);
-    if (datablock_recv(sb, cn, cl, &buf[DATABLOCK_HEADER_SIZE], bytes) < 0) {
-        free(buf);
-        return -1;
+    return NULL;
+}
+
+static void free_data(char* dbuf)
+{
+    if (dbuf[0] & DATA_HEADER_ALLOCATED)
+        free(dbuf);
+    else
+        nio_free(g_conf->nio_db, dbuf);
+}
+
+/*
+ * キーの読み込みから上書き・削除までを chunk_lock() で排他します。
+ * 分割データのセグメントの一覧と、存在判定フィルタのキーの登録・取り消しが
+ * 同じキーの他の更新と前後しないようにします。
+ * 期限切れデータの削除(memcached_expire)は有効期限の確認から削除までを
+ * ロックするため、書き込みもロックして確認の後の上書きが削除されない
+ * ようにします。
+ */
+static int key_locking()
+{
+    return (g_conf->append_chunks > 0 || g_conf->bloom_keys > 0 ||
+            g_conf->expire_rate > 0);
+}
+
+static void key_lock(const char* key, int keysize)
+{
+    if (key_locking())
+        chunk_lock(key, keysize);
+}
+
+static void key_unlock(const char* key, int keysize)
+{
+    if (key_locking())
+        chunk_unlock(key, keysize);
+}
+
+/*
+ * 上書きまたは削除するキーが分割されたデータの場合はキーのレコードを
+ * 返します。データベースを更新した後に drop_segments() で古い
+ * セグメントを削除します。
+ * その間に追記や圧縮でセグメントが追加されないように、
+ * drop_segments() までキーをロックします。
+ */
+static char* chunk_head(const char* key, int keysize, int* hsize)
+{
+    char* head;
+
+    key_lock(key, keysize);
+    if (g_conf->append_chunks < 1)
+        return NULL;
+    head = nio_aget(g_conf->nio_db, key, keysize, hsize);
+    if (head && ! (head[0] & DATA_HEADER_CHUNKED)) {
+        nio_free(g_conf->nio_db, head);
+        return NULL;
     }
-    if (check_mode != CHECK_NONE) {
-        char* dbuf;
-        int dsize = 0;
+    return head;
+}
 
-        dbuf = nio_aget(g_conf->nio_db, key, strlen(key), &dsize);
-        if (dbuf) {
-            uint dexptime;
+static void drop_segments(const char* key, int keysize, char* head, int hsize, int result)
+{
+    if (head) {
+        if (result == 0)
+            chunk_remove(head, hsize);
+        nio_free(g_conf->nio_db, head);
+    }
+    key_unlock(key, keysize);
+}
 
-            memcpy(&dexptime, &dbuf[sizeof(uint)], sizeof(uint));
-            if (check_expier(dexptime, key, strlen(key)))
-                dsize = 0;
-            nio_free(g_conf->nio_db, dbuf);
-        }
+/*
+ * キーのレコードを削除して存在判定フィルタとキャッシュから外します。
+ * chunk_head() でキーをロックしてから呼び出します。
+ */
+static int delete_key(const char* key, int keysize)
+{
+    int result;
 
-        if (check_mode == CHECK_ADD) {
-            if (dsize >= 0) {
-                /* すでにキーが存在していたらエラー */
-                if (! noreply(cn, cl))
-                    store_response(sb->socket, STORE_EXISTS);
-                free(buf);
-                return -1;
-            }
-        } else if (check_mode == CHECK_REPLACE) {
-            if (dsize < 0) {
-                /* キーが存在していないとエラー */
-                if (! noreply(cn, cl))
-                    store_response(sb->socket, STORE_NOT_FOUND);
-                free(buf);
-                return -1;
+    write_begin();
+    result = nio_delete(g_conf->nio_db, key, keysize);
+    if (result == 0 && g_conf->bloom_keys > 0)
+        bloom_remove(key, keysize);
+    write_end();
+    invalidate(key, keysize);
+    return result;
+}
+
+/*
+ * キーのデータを取得します。
+ * 有効期限を過ぎたデータは削除されて NULL が返されます。
+ * nio.cache_size が指定されている場合はキャッシュから取得して、
+ * キャッシュにない場合はデータベースから読み込んでキャッシュに追加します。
+ *
+ * bytes: <data block> のサイズが設定されます。
+ * flags: <flags> が設定されます。
+ * cas: <cas unique> が設定されます。
+ *
+ * 戻り値
+ *  データベースのデータ(<data block> は DATABLOCK_HEADER_SIZE の位置から)
+ *  呼び出し元で memcached_release() する必要があります。
+ *  存在しない場合は NULL
+ */
+char* memcached_get(const char* key, int keysize, int* bytes, uint* flags, int64* cas)
+{
+    char* dbuf = NULL;
+    int dsize;
+    uint exptime;
+    uint gen = 0;
+
+    if (reserved_key(key, keysize) || ! maybe_exists(key, keysize))
+        return NULL;
+    if (g_conf->cache_size > 0)
+        dbuf = cache_get(key, keysize, &dsize, cas, &gen);
+    if (dbuf == NULL) {
+        dbuf = read_data(key, keysize, &dsize, cas);
+        if (dbuf == NULL)
+            return NULL;
+
+        if (dsize < (int)DATABLOCK_HEADER_SIZE || dsize > MAX_MEMCACHED_DATASIZE) {
+            free_data(dbuf);
+            return NULL;
+        }
+        if (g_conf->cache_size > 0) {
+            char* nbuf = dbuf;
+
+            /* キャッシュの項目にコピーして返します。*/
+            dbuf = cache_add(key, keysize, nbuf, dsize, *cas, gen);
+            free_data(nbuf);
+            if (dbuf == NULL) {
+                err_write("memcached: memcached_get() no memory.");
+                return NULL;
             }
         }
     }
 
-    /* データベースへ出力 */
-    if (cas_flag)
-        result = nio_puts(g_conf->nio_db, key, strlen(key), buf, bufsize, cas);
+    get_data_header(dbuf, flags, &exptime);
+    if (check_expier(exptime, key, keysize)) {
+        memcached_release(dbuf);
+        return NULL;
+    }
+    *bytes = dsize - DATABLOCK_HEADER_SIZE;
+    return dbuf;
+}
+
+/*
+ * memcached_get() で取得したデータを解放します。
+ * conn_send_ref() で送信したデータの解放にも使用します。
+ */
+void memcached_release(void* dbuf)
+{
+    if (g_conf->cache_size > 0)
+        cache_release(dbuf);
     else
-        result = nio_put(g_conf->nio_db, key, strlen(key), buf, bufsize);
+        free_data((char*)dbuf);
+}
+
+/*
+ * 有効期限を過ぎたキーを削除します。期限切れデータの掃除(nio_expire.c)で
+ * 使用します。
+ *
+ * exptime: データベースのキーの有効期限が設定されます
+ *          (無期限またはキーがない場合は 0)。
+ * bytes: 削除したデータ(キーを含む)のサイズが設定されます。
+ *
+ * 戻り値
+ *  1: 削除した
+ *  0: 削除していない
+ */
+int memcached_expire(const char* key, int keysize, uint* exptime, int* bytes)
+{
+    char* dbuf;
+    int dsize;
+    char* head;
+    int hsize;
+    int result = -1;
 
-    if (! noreply(cn, cl))
-        store_response(sb->socket, result);
+    *exptime = 0;
+    *bytes = 0;
+    if (reserved_key(key, keysize) || ! maybe_exists(key, keysize))
+        return 0;
 
-    free(buf);
+    /* 確認から削除までの間に上書きされないようにキーをロックします。*/
+    head = chunk_head(key, keysize, &hsize);
+    dbuf = nio_aget(g_conf->nio_db, key, keysize, &dsize);
+    if (dbuf) {
+        if (dsize >= (int)DATABLOCK_HEADER_SIZE)
+            get_data_header(dbuf, NULL, exptime);
+        nio_free(g_conf->nio_db, dbuf);
+        if (*exptime > 0 && *exptime < (uint)current_seconds())
+            result = delete_key(key, keysize);
+    }
+    drop_segments(key, keysize, head, hsize, result);
+    if (result != 0)
+        return 0;
+    *bytes = dsize + keysize;
+    return 1;
+}
+
+/*
+ * キーのデータを削除します。
+ *
+ * 戻り値
+ *  0: 成功
+ *  キーが存在しない場合は 0 以外
+ */
+int memcached_delete(const char* key, int keysize)
+{
+    int result;
+    char* head;
+    int hsize;
+
+    if (reserved_key(key, keysize))
+        return -1;
+    head = chunk_head(key, keysize, &hsize);
+    result = delete_key(key, keysize);
+    drop_segments(key, keysize, head, hsize, result);
     return result;
 }
 
-static int update(struct sock_buf_t* sb, int cn, const char** cl, int mode)
+static int key_exists(const char* key, int keysize)
 {
-    int result = 0;
-    char* key;
-    char* bytes_s;
-    int bytes;
+    char* dbuf;
+    int dsize;
+    uint exptime;
+
+    if (! maybe_exists(key, keysize))
+        return 0;
+    dbuf = nio_aget(g_conf->nio_db, key, keysize, &dsize);
+    if (dbuf == NULL)
+        return 0;
+    get_data_header(dbuf, NULL, &exptime);
+    nio_free(g_conf->nio_db, dbuf);
+    return ! check_expier(exptime, key, keysize);
+}
+
+/*
+ * ヘッダーを含むデータブロックを保存します。
+ *
+ * cas_flag: 真の場合は cas で楽観的排他制御を行います。
+ * check_mode: CHECK_ADD はキーが存在しない場合、
+ *             CHECK_REPLACE はキーが存在する場合のみ保存します。
+ *
+ * 戻り値
+ *  STORE_XXX
+ */
+int memcached_store(const char* key, int keysize, const char* buf, int bufsize,
+                    int cas_flag, int64 cas, int check_mode)
+{
+    int result;
+    uint exptime;
+    char* head;
+    int hsize;
+
+    if (reserved_key(key, keysize))
+        return STORE_NOT_STORED;
+    if (check_mode == CHECK_ADD) {
+        /* すでにキーが存在していたらエラー */
+        if (key_exists(key, keysize))
+            return STORE_EXISTS;
+    } else if (check_mode == CHECK_REPLACE) {
+        /* キーが存在していないとエラー */
+        if (! key_exists(key, keysize))
+            return STORE_NOT_FOUND;
+    }
+
+    head = chunk_head(key, keysize, &hsize);
+    write_begin();
+    register_key(key, keysize);
+    if (cas_flag)
+        result = nio_puts(g_conf->nio_db, key, keysize, buf, bufsize, cas);
+    else
+        result = nio_put(g_conf->nio_db, key, keysize, buf, bufsize);
+    write_end();
+    invalidate(key, keysize);
+    drop_segments(key, keysize, head, hsize, result);
+
+    /* 有効期限を過ぎたら削除されるように登録します。*/
+    get_data_header(buf, NULL, &exptime);
+    if (result == STORE_STORED && exptime > 0 && g_conf->expire_rate > 0)
+        expire_add(key, keysize, exptime);
+    return result;
+}
+
+/*
+ * 既存のデータの後方(UPDATE_APPEND)または前方(UPDATE_PREPEND)に
+ * データを追加します。<flags> と <exptime> は変更されません。
+ * nio.append_chunks が指定されている場合、CHUNK_MIN_SIZE 以上のデータは
+ * 追加するデータをセグメントとして保存します(nio_chunk.c)。
+ *
+ * 戻り値
+ *  STORE_XXX
+ */
+int memcached_update(const char* key, int keysize, const char* data, int bytes, int mode)
+{
+    int result;
     int64 cas;
-    char* buf;
     int dsize;
+    int size;
     char* dbuf;
     uint dexptime;
     char* tbuf;
 
-    if (store_args_check(sb->socket, cn, cl, 5) < 0)
-        return -1;
+    /* キーの存在チェック */
+    if (reserved_key(key, keysize) || ! maybe_exists(key, keysize))
+        return STORE_NOT_FOUND;
+    dbuf = nio_agets(g_conf->nio_db, key, keysize, &dsize, &cas);
+    if (dbuf == NULL)
+        return STORE_NOT_FOUND;
 
-    key = trim((char*)cl[1]);
+    /* データサイズのチェック */
+    if (dbuf[0] & DATA_HEADER_CHUNKED)
+        size = DATABLOCK_HEADER_SIZE + chunk_bytes(dbuf);
+    else
+        size = dsize;
+    if (size + bytes > MAX_MEMCACHED_DATASIZE) {
+        nio_free(g_conf->nio_db, dbuf);
+        return STORE_TOO_LARGE;
+    }
 
-    bytes_s = trim((char*)cl[4]);
-    if (! isdigitstr(bytes_s))
-        return -1;
-    bytes = atoi(bytes_s);
+    get_data_header(dbuf, NULL, &dexptime);
+    if (check_expier(dexptime, key, keysize)) {
+        nio_free(g_conf->nio_db, dbuf);
+        return STORE_NOT_FOUND;
+    }
 
-    if (store_size_check(sb->socket, key, bytes, noreply(cn, cl)) < 0)
-        return -1;
+    if ((dbuf[0] & DATA_HEADER_CHUNKED) ||
+        (g_conf->append_chunks > 0 && dsize >= CHUNK_MIN_SIZE)) {
+        /* 追加するデータだけを書き込みます。*/
+        key_lock(key, keysize);
+        write_begin();
+        result = chunk_update(key, keysize, dbuf, dsize, cas, data, bytes, mode);
+        write_end();
+        key_unlock(key, keysize);
+        nio_free(g_conf->nio_db, dbuf);
+        invalidate(key, keysize);
+        return result;
+    }
 
-    /* data block を socket から取得します。*/
-    buf = (char*)malloc(bytes + strlen(LINE_DELIMITER) + 1);
-    if (buf == NULL) {
+    /* 編集用のバッファを確保して、既存の値と追加する値を
+       それぞれ最終的な位置に１回でコピーします。*/
+    tbuf = (char*)malloc(dsize + bytes);
+    if (tbuf == NULL) {
         err_write("memcached: update() no memory.");
-        return -1;
-    }
-    if (datablock_recv(sb, cn, cl, buf, bytes) < 0) {
-        free(buf);
-        return -1;
+        nio_free(g_conf->nio_db, dbuf);
+        return STORE_NO_MEMORY;
+    }
+    if (mode == UPDATE_PREPEND) {
+        memcpy(tbuf, dbuf, DATABLOCK_HEADER_SIZE);
+        memcpy(&tbuf[DATABLOCK_HEADER_SIZE], data, bytes);
+        memcpy(&tbuf[DATABLOCK_HEADER_SIZE+bytes],
+               &dbuf[DATABLOCK_HEADER_SIZE],
+               dsize-DATABLOCK_HEADER_SIZE);
+    } else {
+        memcpy(tbuf, dbuf, dsize);
+        memcpy(tbuf+dsize, data, bytes);
     }
+    nio_free(g_conf->nio_db, dbuf);
 
-    /* キーの存在チェック */
-    dbuf = nio_agets(g_conf->nio_db, key, strlen(key), &dsize, &cas);
-    if (dbuf == NULL) {
-        if (! noreply(cn, cl))
-            store_response(sb->socket, STORE_NOT_FOUND);
-        free(buf);
-        return -1;
-    }
+    /* データベースへ出力 */
+    key_lock(key, keysize);
+    write_begin();
+    result = nio_puts(g_conf->nio_db, key, keysize, tbuf, dsize + bytes, cas);
+    write_end();
+    key_unlock(key, keysize);
+    free(tbuf);
+    invalidate(key, keysize);
+    return result;
+}
 
-    /* データサイズのチェック */
-    if (store_size_check(sb->socket, key, dsize-sizeof(uint)+bytes, noreply(cn, cl)) < 0) {
+/*
+ * 64ビットの値に加算(MODE_INCR)または減算(MODE_DECR)します。
+ *
+ * val: 更新後の値が設定されます。
+ *
+ * 戻り値
+ *  STORE_STORED: 成功
+ *  STORE_NOT_FOUND: キーが存在しない
+ *  STORE_BAD_VALUE: 値が64ビットの数値ではない
+ *  STORE_EXISTS: 他のスレッドが同時に更新した
+ */
+int memcached_incr(const char* key, int keysize, int mode, uint64 delta, uint64* val)
+{
+    int result;
+    int dsize;
+    char* dbuf;
+    uint exptime;
+    int64 cas;
+
+    if (reserved_key(key, keysize) || ! maybe_exists(key, keysize))
+        return STORE_NOT_FOUND;
+    dbuf = nio_agets(g_conf->nio_db, key, keysize, &dsize, &cas);
+    if (dbuf == NULL)
+        return STORE_NOT_FOUND;
+
+    if (dsize != (DATABLOCK_HEADER_SIZE + sizeof(uint64)) || (dbuf[0] & DATA_HEADER_CHUNKED)) {
         nio_free(g_conf->nio_db, dbuf);
-        free(buf);
-        return -1;
+        return STORE_BAD_VALUE;
     }
 
-    get_data_header(dbuf, NULL, &dexptime);
-    if (check_expier(dexptime, key, strlen(key))) {
-        if (! noreply(cn, cl))
-            store_response(sb->socket, STORE_NOT_FOUND);
+    get_data_header(dbuf, NULL, &exptime);
+    if (check_expier(exptime, key, keysize)) {
         nio_free(g_conf->nio_db, dbuf);
-        free(buf);
-        return -1;
+        return STORE_NOT_FOUND;
     }
+    memcpy(val, &dbuf[DATABLOCK_HEADER_SIZE], sizeof(uint64));
 
-    /* 編集用のバッファを確保します。*/
-    tbuf = (char*)malloc(dsize + bytes);
-    if (tbuf == NULL) {
-        err_write("memcached: update() no memory.");
+    if (mode == MODE_INCR)
+        *val += delta;
+    else if (mode == MODE_DECR)
+        *val = (*val > delta)? *val - delta : 0;  /* 0 より小さくはなりません */
+    memcpy(&dbuf[DATABLOCK_HEADER_SIZE], val, sizeof(uint64));
+
+    /* データベースへ書き出します。*/
+    key_lock(key, keysize);
+    write_begin();
+    result = nio_puts(g_conf->nio_db, key, keysize, dbuf, dsize, cas);
+    write_end();
+    key_unlock(key, keysize);
+    nio_free(g_conf->nio_db, dbuf);
+    invalidate(key, keysize);
+    return result;
+}
+
+/*
+ * データの有効期限を変更します。値と <flags> は変更されません。
+ * 有効期限が同じ場合は書き込みを行いません。
+ *
+ * exptime: 新しい有効期限(0 は無期限)
+ *
+ * 戻り値
+ *  STORE_XXX
+ */
+int memcached_touch(const char* key, int keysize, uint exptime)
+{
+    int result = STORE_NOT_FOUND;
+    int retry;
+
+    if (reserved_key(key, keysize) || ! maybe_exists(key, keysize))
+        return STORE_NOT_FOUND;
+
+    /* 他のスレッドと同時に更新した場合は再実行します。*/
+    for (retry = 0; retry < 3; retry++) {
+        char* dbuf;
+        int dsize;
+        int64 cas;
+        uint flags;
+        uint dexptime;
+        char head_byte;
+
+        dbuf = nio_agets(g_conf->nio_db, key, keysize, &dsize, &cas);
+        if (dbuf == NULL)
+            return STORE_NOT_FOUND;
+        if (dsize < (int)DATABLOCK_HEADER_SIZE) {
+            nio_free(g_conf->nio_db, dbuf);
+            return STORE_NOT_FOUND;
+        }
+        get_data_header(dbuf, &flags, &dexptime);
+        if (check_expier(dexptime, key, keysize)) {
+            nio_free(g_conf->nio_db, dbuf);
+            return STORE_NOT_FOUND;
+        }
+        if (dexptime == exptime) {
+            nio_free(g_conf->nio_db, dbuf);
+            return STORE_STORED;
+        }
+        /* 先頭バイト(分割されたデータの指定)は変更しません。*/
+        head_byte = dbuf[0];
+        set_data_header(dbuf, flags, exptime);
+        dbuf[0] = head_byte;
+        key_lock(key, keysize);
+        write_begin();
+        result = nio_puts(g_conf->nio_db, key, keysize, dbuf, dsize, cas);
+        write_end();
+        key_unlock(key, keysize);
         nio_free(g_conf->nio_db, dbuf);
-        free(buf);
+        invalidate(key, keysize);
+        if (result == STORE_STORED && exptime > 0 && g_conf->expire_rate > 0)
+            expire_add(key, keysize, exptime);
+        if (result != STORE_EXISTS)
+            break;
+    }
+    return result;
+}
+
+/*
+ * 全件のデータを削除します。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー
+ */
+int memcached_flush()
+{
+    int result = 0;
+
+    /* データベースファイルを一旦クローズして
+       新規作成することで全データを削除します。*/
+    if (g_conf->expire_rate > 0)
+        expire_pause();
+    /* 存在判定フィルタのクリアと再作成の間は書き込みを待たせます。*/
+    if (g_conf->bloom_keys > 0)
+        FLUSH_LOCK();
+    nio_close(g_conf->nio_db);
+    if (g_conf->cache_size > 0)
+        cache_clear();
+    if (g_conf->bloom_keys > 0)
+        bloom_clear();
+    if (nio_create(g_conf->nio_db, g_conf->nio_path) < 0) {
+        err_write("memcached: flush_all_command() nio_create() error file=%s", g_conf->nio_path);
+        result = -1;
+    }
+    if (g_conf->bloom_keys > 0)
+        FLUSH_UNLOCK();
+    if (g_conf->expire_rate > 0)
+        expire_resume();
+    return result;
+}
+
+static int set(struct conn_t* conn,
+               int n,
+               struct token_t* tokens,
+               int args,
+               int cas_flag,
+               int check_mode)
+{
+    int result = 0;
+    char* key;
+    int keysize;
+    uint flags;
+    uint exptime;
+    int bytes;
+    int64 cas = 0;
+    int noreply_flag;
+    char* data;
+    char* buf;
+    char keybuf[MAX_MEMCACHED_KEYSIZE];
+    char save[DATABLOCK_HEADER_SIZE];
+
+    if (store_args_check(conn, n, tokens, args) < 0)
         return -1;
+
+    key = tokens[1].value;
+    keysize = tokens[1].length;
+
+    if (token_uint(tokens[2].value, tokens[2].length, &flags) < 0)
+        return store_error(conn, n, tokens);
+    if (token_uint(tokens[3].value, tokens[3].length, &exptime) < 0)
+        return store_error(conn, n, tokens);
+    if (exptime > 0)
+        exptime += current_seconds();
+    if (token_int(tokens[4].value, tokens[4].length, &bytes) < 0)
+        return store_error(conn, n, tokens);
+    if (cas_flag) {
+        if (token_uint64(tokens[5].value, tokens[5].length, (uint64*)&cas) < 0)
+            return store_error(conn, n, tokens);
     }
-    memcpy(tbuf, dbuf, dsize);
-    nio_free(g_conf->nio_db, dbuf);
+    if (keysize > MAX_MEMCACHED_KEYSIZE)
+        return store_error(conn, n, tokens);
+    noreply_flag = noreply(n, tokens);
+    if (store_size_check(conn, bytes, noreply_flag) < 0)
+        return -1;
 
-    /* バッファを編集します。*/
-    if (mode == UPDATE_APPEND) {
-        memcpy(tbuf+dsize, buf, bytes);
-    } else if (mode == UPDATE_PREPEND) {
-        memmove(&tbuf[DATABLOCK_HEADER_SIZE+bytes],
-                &tbuf[DATABLOCK_HEADER_SIZE],
-                dsize-DATABLOCK_HEADER_SIZE);
-        memcpy(&tbuf[DATABLOCK_HEADER_SIZE], buf, bytes);
-    } else {
-        if (! noreply(cn, cl))
-            server_error(sb->socket, "internal update mode error.");
-        free(tbuf);
-        free(buf);
+    /* data block は受信バッファにあるものをそのまま使用します。*/
+    data = datablock_recv(conn, n, tokens, bytes);
+    if (data == NULL)
+        return -1;
+
+    /* キーはヘッダーで上書きされる場合があるためコピーします。*/
+    memcpy(keybuf, key, keysize);
+    buf = memcached_datablock(conn, data, bytes, flags, exptime, save);
+    if (buf == NULL) {
+        err_write("memcached: set() no memory.");
+        if (! noreply_flag)
+            server_error(conn, "no memory.");
         return -1;
     }
 
     /* データベースへ出力 */
-    result = nio_puts(g_conf->nio_db, key, strlen(key), tbuf, dsize + bytes, cas);
+    result = memcached_store(keybuf, keysize, buf, DATABLOCK_HEADER_SIZE + bytes,
+                             cas_flag, cas, check_mode);
+    memcached_datablock_release(buf, data, save);
 
-    if (! noreply(cn, cl))
-        store_response(sb->socket, result);
+    if (! noreply_flag)
+        store_response(conn, result);
+    return result;
+}
 
-    free(tbuf);
-    free(buf);
+static int update(struct conn_t* conn, int n, struct token_t* tokens, int mode)
+{
+    int result = 0;
+    int bytes;
+    char* data;
+
+    if (store_args_check(conn, n, tokens, 5) < 0)
+        return -1;
+
+    if (token_int(tokens[4].value, tokens[4].length, &bytes) < 0)
+        return store_error(conn, n, tokens);
+    if (tokens[1].length > MAX_MEMCACHED_KEYSIZE)
+        return store_error(conn, n, tokens);
+
+    if (store_size_check(conn, bytes, noreply(n, tokens)) < 0)
+        return -1;
+
+    /* data block は受信バッファにあるものをそのまま使用します。*/
+    data = datablock_recv(conn, n, tokens, bytes);
+    if (data == NULL)
+        return -1;
+
+    /* データベースへ出力 */
+    result = memcached_update(tokens[1].value, tokens[1].length, data, bytes, mode);
+
+    if (! noreply(n, tokens)) {
+        if (result == STORE_TOO_LARGE)
+            client_error(conn, "data too long <= 1MB");
+        else if (result == STORE_NO_MEMORY)
+            server_error(conn, "no memory.");
+        else
+            store_response(conn, result);
+    }
     return result;
 }
 
 /* set <key> <flags> <exptime> <bytes> [noreply]
  * <data block>
  */
-static int set_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int set_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
-    return set(sb, cn, cl, 5, 0, CHECK_NONE);
+    return set(conn, n, tokens, 5, 0, CHECK_NONE);
 }
 
 /* add <key> <flags> <exptime> <bytes> [noreply]
  * <data block>
  */
-static int add_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int add_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
-    return set(sb, cn, cl, 5, 0, CHECK_ADD);
+    return set(conn, n, tokens, 5, 0, CHECK_ADD);
 }
 
 /* replace <key> <flags> <exptime> <bytes> [noreply]
  * <data block>
  */
-static int replace_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int replace_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
-    return set(sb, cn, cl, 5, 0, CHECK_REPLACE);
+    return set(conn, n, tokens, 5, 0, CHECK_REPLACE);
 }
 
 /* append <key> <flags> <exptime> <bytes> [noreply]
@@ -711,9 +1477,9 @@ static int replace_command(struct sock_buf_t* sb, int cn, const char** cl)
  *
  * ignore <flags> and <exptime>
  */
-static int append_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int append_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
-    return update(sb, cn, cl, UPDATE_APPEND);
+    return update(conn, n, tokens, UPDATE_APPEND);
 }
 
 /* prepend <key> <flags> <exptime> <bytes> [noreply]
@@ -721,94 +1487,117 @@ static int append_command(struct sock_buf_t* sb, int cn, const char** cl)
  *
  * ignore <flags> and <exptime>
  */
-static int prepend_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int prepend_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
-    return update(sb, cn, cl, UPDATE_PREPEND);
+    return update(conn, n, tokens, UPDATE_PREPEND);
 }
 
 /* cas <key> <flags> <exptime> <bytes> <cas unqiue> [noreply]
  * <data block>
  */
-static int cas_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int cas_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
-    return set(sb, cn, cl, 6, 1, CHECK_NONE);
+    return set(conn, n, tokens, 6, 1, CHECK_NONE);
 }
 
-static int get_element(const char* key, int cas_flag, struct membuf_t* mb)
+/*
+ * キーのデータを応答に追加します。
+ * conn が NULL でない場合は値をコピーせずに conn の送信待ちに追加します。
+ * conn が NULL の場合(UDP)は mb に追加します。
+ */
+static int get_element(const char* key, int keysize, int cas_flag,
+                       struct conn_t* conn, struct membuf_t* mb)
 {
-    int dsize;
     char* dbuf;
     int64 cas;
     uint flags;
-    uint exptime;
     int bytes;
     char value_buf[128+MAX_MEMCACHED_KEYSIZE];
+    int len;
 
-    dbuf = nio_agets(g_conf->nio_db, key, strlen(key), &dsize, &cas);
-    if (dbuf == NULL)
-        return 0;
-
-    if (dsize > MAX_MEMCACHED_DATASIZE) {
-        nio_free(g_conf->nio_db, dbuf);
+    if (keysize > MAX_MEMCACHED_KEYSIZE)
         return 0;
-    }
-
-    get_data_header(dbuf, &flags, &exptime);
-    if (check_expier(exptime, key, strlen(key))) {
-        nio_free(g_conf->nio_db, dbuf);
+    dbuf = memcached_get(key, keysize, &bytes, &flags, &cas);
+    if (dbuf == NULL)
         return 0;
-    }
-    bytes = dsize - DATABLOCK_HEADER_SIZE;
 
     /* 応答データの編集 */
     if (cas_flag)
-        snprintf(value_buf, sizeof(value_buf), "VALUE %s %u %d %lld\r\n", key, flags, bytes, cas);
+        len = snprintf(value_buf, sizeof(value_buf), "VALUE %s %u %d %lld\r\n", key, flags, bytes, cas);
     else
-        snprintf(value_buf, sizeof(value_buf), "VALUE %s %u %d\r\n", key, flags, bytes);
+        len = snprintf(value_buf, sizeof(value_buf), "VALUE %s %u %d\r\n", key, flags, bytes);
 
-    mb_append(mb, value_buf, strlen(value_buf));
+    if (conn) {
+        if (conn_send(conn, value_buf, len) < 0) {
+            memcached_release(dbuf);
+            return -1;
+        }
+        /* dbuf は送信後に解放されます。*/
+        if (conn_send_ref(conn, &dbuf[DATABLOCK_HEADER_SIZE], bytes, memcached_release, dbuf) < 0)
+            return -1;
+        return (conn_send(conn, "\r\n", sizeof("\r\n")-1) < 0)? -1 : 0;
+    }
+
+    mb_append(mb, value_buf, len);
     mb_append(mb, &dbuf[DATABLOCK_HEADER_SIZE], bytes);
     mb_append(mb, "\r\n", sizeof("\r\n")-1);
 
-    nio_free(g_conf->nio_db, dbuf);
+    memcached_release(dbuf);
     return 0;
 }
 
-static int get(struct sock_buf_t* sb, int cn, const char** cl, int cas_flag)
+/*
+ * tokens[start] 以降のキーのデータを conn の送信待ち(conn が NULL の場合は mb)に
+ * 追加します。
+ * MAX_TOKENS に収まらなかったキー(rest)は tokens を再利用して
+ * 続けて分割します。tokens は MAX_TOKENS の大きさが必要です。
+ *
+ * exptime: NULL でない場合は取得する前に有効期限を変更します。
+ */
+static int get_elements(struct token_t* tokens,
+                        int n,
+                        int start,
+                        char* rest,
+                        int cas_flag,
+                        const uint* exptime,
+                        struct conn_t* conn,
+                        struct membuf_t* mb)
 {
-    char** keys;
-    struct membuf_t* mb;
     char* end_str = "END\r\n";
+    int i;
 
-    if (cn < 2)
-        return client_error(sb->socket, "illegal command line.");
-
-    mb = mb_alloc(1024);
-    if (mb == NULL) {
-        err_write("memcached: get() no memory.");
-        return server_error(sb->socket, "no memory.");
-    }
-
-    keys = (char**)&cl[1];
-    while (*keys) {
-        if (get_element(trim(*keys), cas_flag, mb) < 0) {
-            mb_free(mb);
-            return server_error(sb->socket, "no memory.");
+    while (1) {
+        for (i = start; i < n; i++) {
+            if (exptime) {
+                /* 値は書き換えずにヘッダーの<exptime>のみ更新します。*/
+                memcached_touch(tokens[i].value, tokens[i].length, *exptime);
+            }
+            if (get_element(tokens[i].value, tokens[i].length, cas_flag, conn, mb) < 0)
+                return -1;
         }
-        keys++;
+        if (rest == NULL)
+            break;
+        n = tokenize(rest, tokens, MAX_TOKENS, &rest);
+        start = 0;
     }
 
     /* "END\r\n" の追加 */
+    if (conn)
+        return (conn_send(conn, end_str, strlen(end_str)) < 0)? -1 : 0;
     mb_append(mb, end_str, strlen(end_str));
+    return 0;
+}
 
-    /* データの送信 */
-    if (send_data(sb->socket, mb->buf, mb->size) < 0) {
+static int get(struct conn_t* conn, int n, struct token_t* tokens, char* rest, int cas_flag)
+{
+    if (n < 2)
+        return client_error(conn, "illegal command line.");
+
+    /* 応答は送信待ちに直接追加します。*/
+    if (get_elements(tokens, n, 1, rest, cas_flag, NULL, conn, NULL) < 0) {
         err_write("memcached: get_command() response error.");
-        mb_free(mb);
         return -1;
     }
-
-    mb_free(mb);
     return 0;
 }
 
@@ -818,9 +1607,9 @@ static int get(struct sock_buf_t* sb, int cn, const char** cl, int cas_flag)
  * ...
  * END
  */
-static int get_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int get_command(struct conn_t* conn, int n, struct token_t* tokens, char* rest)
 {
-    return get(sb, cn, cl, 0);
+    return get(conn, n, tokens, rest, 0);
 }
 
 /* gets <key[ key1 key2 ...]>
@@ -829,44 +1618,132 @@ static int get_command(struct sock_buf_t* sb, int cn, const char** cl)
  * ...
  * END
  */
-static int gets_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int gets_command(struct conn_t* conn, int n, struct token_t* tokens, char* rest)
 {
-    return get(sb, cn, cl, 1);
+    return get(conn, n, tokens, rest, 1);
 }
 
-/* delete <key> [<time>] [noreply]
+static int gat(struct conn_t* conn, int n, struct token_t* tokens, char* rest, int cas_flag)
+{
+    uint exptime;
+
+    if (n < 3)
+        return client_error(conn, "illegal command line.");
+
+    if (token_uint(tokens[1].value, tokens[1].length, &exptime) < 0)
+        return client_error(conn, "illegal exptime.");
+    if (exptime > 0)
+        exptime += current_seconds();
+
+    if (get_elements(tokens, n, 2, rest, cas_flag, &exptime, conn, NULL) < 0) {
+        err_write("memcached: gat_command() response error.");
+        return -1;
+    }
+    return 0;
+}
+
+/* gat <exptime> <key[ key1 key2 ...]>
+ * VALUE <key> <flags> <bytes>
+ * <data block>
+ * ...
+ * END
  */
-static int delete_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int gat_command(struct conn_t* conn, int n, struct token_t* tokens, char* rest)
+{
+    return gat(conn, n, tokens, rest, 0);
+}
+
+/* gats <exptime> <key[ key1 key2 ...]>
+ * VALUE <key> <flags> <bytes> <cas unique>
+ * <data block>
+ * ...
+ * END
+ */
+static int gats_command(struct conn_t* conn, int n, struct token_t* tokens, char* rest)
+{
+    return gat(conn, n, tokens, rest, 1);
+}
+
+/*
+ * コマンドの引数の数とキーの長さをチェックします。
+ * エラーの場合は noreply が指定されていなければエラー応答を送信します。
+ */
+static int key_args_check(struct conn_t* conn, int n, struct token_t* tokens, int args)
 {
-    char* key;
-    int result;
     char msg[256];
 
-    if (cn < 2) {
-        if (! noreply(cn, cl)) {
+    if (n < args) {
+        if (! noreply(n, tokens)) {
             snprintf(msg, sizeof(msg), "illegal command line.");
-            return client_error(sb->socket, msg);
+            client_error(conn, msg);
         }
         return -1;
     }
-    key = trim((char*)cl[1]);
-    if (strlen(key) > MAX_MEMCACHED_KEYSIZE) {
-        if (! noreply(cn, cl)) {
+    if (tokens[1].length > MAX_MEMCACHED_KEYSIZE) {
+        if (! noreply(n, tokens)) {
             snprintf(msg, sizeof(msg), "key size too long %d <= %d",
-                     (int)strlen(key), MAX_MEMCACHED_KEYSIZE);
-            return client_error(sb->socket, msg);
+                     tokens[1].length, MAX_MEMCACHED_KEYSIZE);
+            client_error(conn, msg);
         }
         return -1;
     }
+    return 0;
+}
+
+/* touch <key> <exptime> [noreply]
+ */
+static int touch_command(struct conn_t* conn, int n, struct token_t* tokens)
+{
+    uint exptime;
+    int result;
+
+    if (key_args_check(conn, n, tokens, 3) < 0)
+        return -1;
+    if (token_uint(tokens[2].value, tokens[2].length, &exptime) < 0) {
+        if (! noreply(n, tokens))
+            return client_error(conn, "illegal exptime.");
+        return -1;
+    }
+    if (exptime > 0)
+        exptime += current_seconds();
+
+    result = memcached_touch(tokens[1].value, tokens[1].length, exptime);
+
+    if (! noreply(n, tokens)) {
+        char* reply_str;
+
+        /* 応答データ */
+        if (result == STORE_STORED)
+            reply_str = "TOUCHED\r\n";
+        else if (result == STORE_NOT_FOUND)
+            reply_str = "NOT_FOUND\r\n";
+        else
+            reply_str = "SERVER_ERROR touch failed.\r\n";
+        if (conn_send(conn, reply_str, strlen(reply_str)) < 0) {
+            err_write("memcached: touch_command() response error.");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* delete <key> [<time>] [noreply]
+ */
+static int delete_command(struct conn_t* conn, int n, struct token_t* tokens)
+{
+    int result;
+
+    if (key_args_check(conn, n, tokens, 2) < 0)
+        return -1;
 
-    result = nio_delete(g_conf->nio_db, key, strlen(key));
+    result = memcached_delete(tokens[1].value, tokens[1].length);
 
-    if (! noreply(cn, cl)) {
+    if (! noreply(n, tokens)) {
         char* reply_str;
 
         /* 応答データ */
         reply_str = (result == 0)? "DELETED\r\n" : "NOT_FOUND\r\n";
-        if (send_data(sb->socket, reply_str, strlen(reply_str)) < 0) {
+        if (conn_send(conn, reply_str, strlen(reply_str)) < 0) {
             err_write("memcached: delete_command() response error.");
             return -1;
         }
@@ -876,93 +1753,49 @@ static int delete_command(struct sock_buf_t* sb, int cn, const char** cl)
 
 /* flush_all
  */
-static int flush_all_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int flush_all_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
-    int result = 0;
+    int result;
     char* reply_str;
 
-    /* データベースファイルを一旦クローズして
-       新規作成することで全データを削除します。*/
-    nio_close(g_conf->nio_db);
-    if (nio_create(g_conf->nio_db, g_conf->nio_path) < 0) {
-        err_write("memcached: flush_all_command() nio_create() error file=%s", g_conf->nio_path);
-        result = -1;
-    }
+    result = memcached_flush();
 
     /* 応答データ */
     reply_str = (result == 0)? "DELETED\r\n" : "ERROR\r\n";
-    if (send_data(sb->socket, reply_str, strlen(reply_str)) < 0) {
+    if (conn_send(conn, reply_str, strlen(reply_str)) < 0) {
         err_write("memcached: flush_all_command() response error.");
         return -1;
     }
     return 0;
 }
 
-static int incr(struct sock_buf_t* sb, int cn, const char** cl, int mode)
+static int incr(struct conn_t* conn, int n, struct token_t* tokens, int mode)
 {
-    char* key;
     int result = 0;
     char msg[256];
-    int dsize;
-    char* dbuf;
-    uint flags;
-    uint exptime;
-    uint64 val;
-    uint64 incr;
-    int64 cas;
+    uint64 delta;
+    uint64 val = 0;
 
-    if (cn < 3) {
-        if (! noreply(cn, cl)) {
-            snprintf(msg, sizeof(msg), "illegal command line.");
-            return client_error(sb->socket, msg);
-        }
+    if (key_args_check(conn, n, tokens, 3) < 0)
         return -1;
-    }
-    key = trim((char*)cl[1]);
-    if (strlen(key) > MAX_MEMCACHED_KEYSIZE) {
-        if (! noreply(cn, cl)) {
-            snprintf(msg, sizeof(msg), "key size too long %d <= %d",
-                     (int)strlen(key), MAX_MEMCACHED_KEYSIZE);
-            return client_error(sb->socket, msg);
+    if (token_uint64(tokens[2].value, tokens[2].length, &delta) < 0) {
+        if (! noreply(n, tokens)) {
+            snprintf(msg, sizeof(msg), "invalid numeric delta argument.");
+            return client_error(conn, msg);
         }
         return -1;
     }
 
-    dbuf = nio_agets(g_conf->nio_db, key, strlen(key), &dsize, &cas);
-    if (dbuf == NULL) {
-        result = -1;
-        goto reply;
-    }
-
-    if (dsize != (DATABLOCK_HEADER_SIZE + sizeof(uint64))) {
-        nio_free(g_conf->nio_db, dbuf);
-        if (! noreply(cn, cl)) {
+    result = memcached_incr(tokens[1].value, tokens[1].length, mode, delta, &val);
+    if (result == STORE_BAD_VALUE) {
+        if (! noreply(n, tokens)) {
             snprintf(msg, sizeof(msg), "data type error.");
-            return client_error(sb->socket, msg);
+            return client_error(conn, msg);
         }
         return -1;
     }
 
-    get_data_header(dbuf, &flags, &exptime);
-    if (check_expier(exptime, key, strlen(key))) {
-        result = -1;
-        goto reply;
-    }
-    memcpy(&val, &dbuf[DATABLOCK_HEADER_SIZE], sizeof(uint64));
-
-    incr = (uint64)atoi64(cl[2]);
-    if (mode == MODE_INCR)
-        val += incr;
-    else if (mode == MODE_DECR)
-        val -= incr;
-    memcpy(&dbuf[DATABLOCK_HEADER_SIZE], &val, sizeof(uint64));
-
-    /* データベースへ書き出します。*/
-    result = nio_puts(g_conf->nio_db, key, strlen(key), dbuf, dsize, cas);
-
-reply:
-    nio_free(g_conf->nio_db, dbuf);
-    if (! noreply(cn, cl)) {
+    if (! noreply(n, tokens)) {
         char valbuf[64];
         char* reply_str;
 
@@ -973,7 +1806,7 @@ reply:
         } else {
             reply_str = "NOT_FOUND\r\n";
         }
-        if (send_data(sb->socket, reply_str, strlen(reply_str)) < 0) {
+        if (conn_send(conn, reply_str, strlen(reply_str)) < 0) {
             err_write("memcached: incr_command() response error.");
             return -1;
         }
@@ -983,40 +1816,129 @@ reply:
 
 /* incr <key> <value> [noreply]
  */
-static int incr_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int incr_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
-    return incr(sb, cn, cl, MODE_INCR);
+    return incr(conn, n, tokens, MODE_INCR);
 }
 
 /* decr <key> <value> [noreply]
  */
-static int decr_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int decr_command(struct conn_t* conn, int n, struct token_t* tokens)
+{
+    return incr(conn, n, tokens, MODE_DECR);
+}
+
+static void add_stat(struct membuf_t* mb, const char* name, int64 value)
 {
-    return incr(sb, cn, cl, MODE_DECR);
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "STAT %s %lld\r\n", name, value);
+    mb_append(mb, buf, strlen(buf));
 }
 
 /* stats
+ * STAT <name> <value>
+ * ...
+ * END
  */
-static int stats_command(struct sock_buf_t* sb)
+static int stats_command(struct conn_t* conn)
 {
+    struct membuf_t* mb;
+    int result = 0;
+
+    mb = mb_alloc(1024);
+    if (mb == NULL) {
+        err_write("memcached: stats_command() no memory.");
+        return server_error(conn, "no memory.");
+    }
+
+    memcached_stats(mb);
+    mb_append(mb, "END\r\n", strlen("END\r\n"));
+
     /* 応答データ */
-    if (send_data(sb->socket, "\r\n", strlen("\r\n")) < 0) {
+    if (conn_send(conn, mb->buf, mb->size) < 0) {
         err_write("memcached: stats send error.");
-        return -1;
+        result = -1;
     }
-    return 0;
+    mb_free(mb);
+    return result;
+}
+
+/*
+ * 統計情報を "STAT <name> <value>\r\n" の形式で追加します。
+ * 最後の "END" は含まれません。
+ */
+void memcached_stats(struct membuf_t* mb)
+{
+    char buf[256];
+    int64 overflows, drops;
+    int qlen, qmax;
+
+    add_stat(mb, "pid", (int64)getpid());
+    add_stat(mb, "time", (int64)current_seconds());
+    snprintf(buf, sizeof(buf), "STAT version %s\r\n", VERSION_STR);
+    mb_append(mb, buf, strlen(buf));
+    add_stat(mb, "threads", (int64)((g_conf->reactors > 0)? g_conf->reactors : g_conf->worker_threads));
+
+    /* コネクション */
+    add_stat(mb, "curr_connections", g_stats.curr_connections);
+    add_stat(mb, "total_connections", g_stats.total_connections);
+    add_stat(mb, "accept_errors", g_stats.accept_errors);
+    add_stat(mb, "accept_batch_max", g_stats.accept_batch_max);
+    add_stat(mb, "dispatch_yields", g_stats.dispatch_yields);
+    add_stat(mb, "rejected_connections", g_stats.rejected_connections);
+    add_stat(mb, "idle_closed", g_stats.idle_closed);
+    if (g_conf->udp_port > 0) {
+        add_stat(mb, "udp_requests", g_stats.udp_requests);
+        add_stat(mb, "udp_errors", g_stats.udp_errors);
+    }
+    if (g_conf->cache_size > 0) {
+        struct cache_stats_t cs;
+
+        cache_stats(&cs);
+        add_stat(mb, "cache_hits", cs.hits);
+        add_stat(mb, "cache_misses", cs.misses);
+        add_stat(mb, "cache_items", cs.items);
+        add_stat(mb, "cache_bytes", cs.bytes);
+        add_stat(mb, "cache_evictions", cs.evictions);
+        add_stat(mb, "cache_rejects", cs.rejects);
+    }
+    if (g_conf->bloom_keys > 0)
+        add_stat(mb, "bloom_bytes", bloom_size());
+    if (g_conf->expire_rate > 0) {
+        add_stat(mb, "expired_reclaimed", g_stats.expired_reclaimed);
+        add_stat(mb, "expired_reclaimed_bytes", g_stats.expired_reclaimed_bytes);
+        add_stat(mb, "expire_index_items", g_stats.expire_index_items);
+    }
+    if (g_conf->append_chunks > 0) {
+        add_stat(mb, "chunk_appends", g_stats.chunk_appends);
+        add_stat(mb, "chunk_compactions", g_stats.chunk_compactions);
+    }
+    if (g_conf->zerocopy_size > 0) {
+        add_stat(mb, "zerocopy_sends", g_stats.zerocopy_sends);
+        add_stat(mb, "zerocopy_copied", g_stats.zerocopy_copied);
+    }
+    if (g_conf->reactors < 1)
+        add_stat(mb, "dispatch_queue_depth", dq_depth(g_queue));
+
+    /* listenキュー */
+    listen_stats(&overflows, &drops, &qlen, &qmax);
+    add_stat(mb, "listen_overflows", overflows);
+    add_stat(mb, "listen_drops", drops);
+    add_stat(mb, "listen_queue_len", (int64)qlen);
+    add_stat(mb, "listen_queue_max", (int64)qmax);
 }
 
 /* version
  */
-static int version_command(struct sock_buf_t* sb)
+static int version_command(struct conn_t* conn)
 {
     char verstr[256];
 
     snprintf(verstr, sizeof(verstr), "%s\r\n", VERSION_STR);
 
     /* 応答データ */
-    if (send_data(sb->socket, verstr, strlen(verstr)) < 0) {
+    if (conn_send(conn, verstr, strlen(verstr)) < 0) {
         err_write("memcached: version send error.");
         return -1;
     }
@@ -1025,10 +1947,10 @@ static int version_command(struct sock_buf_t* sb)
 
 /* verbosity
  */
-static int verbosity_command(struct sock_buf_t* sb)
+static int verbosity_command(struct conn_t* conn)
 {
     /* 応答データ */
-    if (send_data(sb->socket, "OK\r\n", strlen("OK\r\n")) < 0) {
+    if (conn_send(conn, "OK\r\n", strlen("OK\r\n")) < 0) {
         err_write("memcached: verbosity send error.");
         return -1;
     }
@@ -1037,7 +1959,7 @@ static int verbosity_command(struct sock_buf_t* sb)
 
 /* bget <key>
  */
-static int bget_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int bget_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
     char* key;
     char mark = 'V';
@@ -1048,12 +1970,16 @@ static int bget_command(struct sock_buf_t* sb, int cn, const char** cl)
     unsigned char stat = 0;
     struct membuf_t* mb;
     int result = 0;
+    char head_byte;
 
-    if (cn < 2)
+    if (n < 2)
         return -1;
 
-    key = (char*)cl[1];
-    dbuf = nio_agets(g_conf->nio_db, key, strlen(key), &dsize, &cas);
+    key = tokens[1].value;
+    if (reserved_key(key, tokens[1].length))
+        return 1;
+    /* 分割されたデータはセグメントを連結して送信します。*/
+    dbuf = read_data(key, tokens[1].length, &dsize, &cas);
     if (dbuf == NULL) {
         if (dsize == -1) {
             /* not found */
@@ -1062,10 +1988,14 @@ static int bget_command(struct sock_buf_t* sb, int cn, const char** cl)
         return -1;
     }
     if (dsize > MAX_MEMCACHED_DATASIZE) {
-        nio_free(g_conf->nio_db, dbuf);
+        free_data(dbuf);
         return -1;
     }
 
+    /* 連結したデータの印は送信しません。*/
+    head_byte = dbuf[0];
+    dbuf[0] &= ~DATA_HEADER_ALLOCATED;
+
     size = dsize;
     if (dsize > 255) {
         char* zbuf;
@@ -1084,7 +2014,8 @@ static int bget_command(struct sock_buf_t* sb, int cn, const char** cl)
     mb = mb_alloc(size+256);
     if (mb == NULL) {
         err_write("memcached: bget() no memory.");
-        nio_free(g_conf->nio_db, dbuf);
+        dbuf[0] = head_byte;
+        free_data(dbuf);
         return -1;
     }
 
@@ -1095,18 +2026,19 @@ static int bget_command(struct sock_buf_t* sb, int cn, const char** cl)
     mb_append(mb, dbuf, size);
 
     /* データの送信 */
-    if (send_data(sb->socket, mb->buf, mb->size) < 0) {
+    if (conn_send(conn, mb->buf, mb->size) < 0) {
         result = -1;
         err_write("memcached: bget_command() send error.");
     }
     mb_free(mb);
-    nio_free(g_conf->nio_db, dbuf);
+    dbuf[0] = head_byte;
+    free_data(dbuf);
     return result;
 }
 
 /* bset <key>
  */
-static int bset_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int bset_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
     char* key;
     int status;
@@ -1117,33 +2049,32 @@ static int bset_command(struct sock_buf_t* sb, int cn, const char** cl)
     int result;
     char* resp_str = "OK";
 
-    if (cn < 2)
+    if (n < 2)
         return -1;
 
-    key = (char*)cl[1];
+    key = tokens[1].value;
 
-    /* サーバーからの受信データを最大3秒待ちます。*/
-    if (! sockbuf_wait_data(sb, 3000)) {
-        /* サーバーからの応答がない。*/
-        err_write("memcached: bset_command() time out recv data key=%s.", key);
+    /* <datablock> は memcached_ready() で受信済みです。*/
+    if (conn->rlen < 1) {
+        err_write("memcached: bset_command() no recv data key=%s.", key);
         return -1;
     }
 
     /* <size>を受信します。*/
-    size = sockbuf_int(sb, &status);
+    size = conn_int(conn, &status);
     if (size < 1 || status != 0) {
         err_write("memcached: bset_command() recv size error key=%s.", key);
         return -1;
     }
 
     /* <stat>を受信します。*/
-    if (sockbuf_nchar(sb, (char*)&stat, sizeof(char)) != sizeof(char)) {
+    if (conn_nchar(conn, (char*)&stat, sizeof(char)) != sizeof(char)) {
         err_write("memcached: bset_command() recv stat error key=%s.", key);
         return -1;
     }
 
     /* <cas>を受信します。*/
-    cas = sockbuf_int64(sb, &status);
+    cas = conn_int64(conn, &status);
     if (cas < 1 || status != 0) {
         err_write("memcached: bset_command() recv cas error key=%s.", key);
         return -1;
@@ -1157,7 +2088,7 @@ static int bset_command(struct sock_buf_t* sb, int cn, const char** cl)
     }
 
     /* データを受信します。*/
-    if (sockbuf_nchar(sb, buf, size) != size) {
+    if (conn_nchar(conn, buf, size) != size) {
         free(buf);
         err_write("memcached: bset_command() recv data error key=%s size=%d.", key, size);
         return -1;
@@ -1184,7 +2115,19 @@ static int bset_command(struct sock_buf_t* sb, int cn, const char** cl)
 
     /* データを更新します。
        バージョンを管理する cas も更新されます。*/
-    result = nio_bset(g_conf->nio_db, key, strlen(key), buf, size, cas);
+    key_lock(key, tokens[1].length);
+    write_begin();
+    register_key(key, tokens[1].length);
+    result = nio_bset(g_conf->nio_db, key, tokens[1].length, buf, size, cas);
+    write_end();
+    key_unlock(key, tokens[1].length);
+    invalidate(key, tokens[1].length);
+    if (result == 0 && size >= (int)DATABLOCK_HEADER_SIZE && g_conf->expire_rate > 0) {
+        uint exptime;
+
+        get_data_header(buf, NULL, &exptime);
+        expire_add(key, tokens[1].length, exptime);
+    }
     if (result < 0)
         err_write("memcached: bset_command() nio_bset error key=%s.", key);
     free(buf);
@@ -1192,22 +2135,22 @@ static int bset_command(struct sock_buf_t* sb, int cn, const char** cl)
     /* 応答データの送信 */
     if (result < 0)
         resp_str = "ER";
-    if (send_data(sb->socket, resp_str, strlen(resp_str)) < 0)
+    if (conn_send(conn, resp_str, strlen(resp_str)) < 0)
         err_write("memcached: bset_command() send error.");
     return result;
 }
 
-static int send_key(SOCKET socket, const char* key, int keysize)
+static int send_key(struct conn_t* conn, const char* key, int keysize)
 {
     unsigned char ksize;
 
     ksize = (unsigned char)keysize;
-    if (send_data(socket, &ksize, sizeof(ksize)) < 0) {
+    if (conn_send(conn, &ksize, sizeof(ksize)) < 0) {
         err_write("memcached: send_key() keysize=%d send error.", keysize);
         return -1;
     }
     if (keysize > 0) {
-        if (send_data(socket, key, keysize) < 0) {
+        if (conn_send(conn, key, keysize) < 0) {
             err_write("memcached: send_key() key=%s send error.", key);
             return -1;
         }
@@ -1217,12 +2160,12 @@ static int send_key(SOCKET socket, const char* key, int keysize)
 
 /* bkeys
  */
-static int bkeys_command(struct sock_buf_t* sb, int cn, const char** cl)
+static int bkeys_command(struct conn_t* conn, int n, struct token_t* tokens)
 {
     int result = 0;
     struct nio_cursor_t* cur;
 
-    if (cn > 1)
+    if (n > 1)
         return -1;
 
     cur = nio_cursor_open(g_conf->nio_db);
@@ -1243,13 +2186,16 @@ static int bkeys_command(struct sock_buf_t* sb, int cn, const char** cl)
         }
         key[keysize] = '\0';
 
-        /* キーを送信します。*/
-        result = send_key(sb->socket, key, keysize);
-        if (result < 0)
-            break;
+        /* 分割されたデータのセグメントは送信しません(bget で連結されます)。*/
+        if (! reserved_key(key, keysize)) {
+            /* キーを送信します。*/
+            result = send_key(conn, key, keysize);
+            if (result < 0)
+                break;
+        }
         if (nio_cursor_next(cur) != 0) {
             /* 終了 */
-            result = send_key(sb->socket, NULL, 0);
+            result = send_key(conn, NULL, 0);
             break;
         }
     }
@@ -1257,105 +2203,94 @@ static int bkeys_command(struct sock_buf_t* sb, int cn, const char** cl)
     return result;
 }
 
-static int cmdline_recv(struct sock_buf_t* sb, char* buf, int size, int* line_flag)
-{
-    int len;
-
-    len = sockbuf_gets(sb, buf, size, LINE_DELIMITER, 0, line_flag);
-    if (len < 1)
-        return len;
-    if (! *line_flag) {
-        /* 行末(CRLF)までを読み捨てます。*/
-        dust_recv_buffer(sb);
-        return 0;
-    }
-    return len;
-}
-
-static unsigned do_command(struct sock_buf_t* sb, struct in_addr addr)
+static unsigned do_command(struct conn_t* conn)
 {
     unsigned stat = 0;
     int result = 0;
     int len;
-    char buf[BUF_SIZE];
-    int line_flag;
-    char** clp;
-    int cc;
+    char* line;
+    struct token_t tokens[MAX_TOKENS];
+    char* rest;
+    int n;
     int cmd;
 
-    /* コマンド行を受信します。*/
-    len = cmdline_recv(sb, buf, sizeof(buf), &line_flag);
-    if (len < 0)
+    if (conn->rlen < 1)
         return STAT_FIN|STAT_CLOSE;    /* FIN受信 */
-    if (len == 0) {
-        if (line_flag)
-            return 0;    /* 空文字受信 */
-        return STAT_FIN|STAT_CLOSE;    /* FIN受信 */
-    }
-    if (! line_flag) {
-        cmd_error(sb->socket);
-        return 0;
-    }
-    TRACE("request command: %s ...", buf);
 
-    clp = split(buf, ' ');
-    if (clp == NULL) {
-        cmd_error(sb->socket);
-        return 0;
-    }
-    cc = list_count((const char**)clp);
-    if (cc <= 0) {
-        list_free(clp);
-        cmd_error(sb->socket);
+    /* コマンド行は受信バッファの中で処理します。*/
+    line = conn_line(conn, BUF_SIZE, &len);
+    if (line == NULL)
+        return STAT_FIN|STAT_CLOSE;    /* 行が長すぎる */
+    if (len == 0)
+        return 0;    /* 空文字受信 */
+    TRACE("request command: %s ...", line);
+
+    n = tokenize(line, tokens, MAX_TOKENS, &rest);
+    if (n <= 0) {
+        cmd_error(conn);
         return 0;
     }
 
-    cmd = parse_command(trim(clp[0]));
+    cmd = parse_command(&tokens[0]);
     switch (cmd) {
         case CMD_SET:
-            result = set_command(sb, cc, (const char**)clp);
+            result = set_command(conn, n, tokens);
             break;
         case CMD_ADD:
-            result = add_command(sb, cc, (const char**)clp);
+            result = add_command(conn, n, tokens);
             break;
         case CMD_REPLACE:
-            result = replace_command(sb, cc, (const char**)clp);
+            result = replace_command(conn, n, tokens);
             break;
         case CMD_APPEND:
-            result = append_command(sb, cc, (const char**)clp);
+            result = append_command(conn, n, tokens);
             break;
         case CMD_PREPEND:
-            result = prepend_command(sb, cc, (const char**)clp);
+            result = prepend_command(conn, n, tokens);
             break;
         case CMD_CAS:
-            result = cas_command(sb, cc, (const char**)clp);
+            result = cas_command(conn, n, tokens);
             break;
         case CMD_GET:
-            result = get_command(sb, cc, (const char**)clp);
+            result = get_command(conn, n, tokens, rest);
             break;
         case CMD_GETS:
-            result = gets_command(sb, cc, (const char**)clp);
+            result = gets_command(conn, n, tokens, rest);
             break;
         case CMD_DELETE:
-            result = delete_command(sb, cc, (const char**)clp);
+            result = delete_command(conn, n, tokens);
             break;
         case CMD_FLUSH_ALL:
-            result = flush_all_command(sb, cc, (const char**)clp);
+            result = flush_all_command(conn, n, tokens);
             break;
         case CMD_INCR:
-            result = incr_command(sb, cc, (const char**)clp);
+            result = incr_command(conn, n, tokens);
             break;
         case CMD_DECR:
-            result = decr_command(sb, cc, (const char**)clp);
+            result = decr_command(conn, n, tokens);
             break;
         case CMD_STATS:
-            result = stats_command(sb);
+            result = stats_command(conn);
             break;
         case CMD_VERSION:
-            result = version_command(sb);
+            result = version_command(conn);
             break;
         case CMD_VERBOSITY:
-            result = verbosity_command(sb);
+            result = verbosity_command(conn);
+            break;
+        case CMD_TOUCH:
+            result = touch_command(conn, n, tokens);
+            break;
+        case CMD_GAT:
+            result = gat_command(conn, n, tokens, rest);
+            break;
+        case CMD_GATS:
+            result = gats_command(conn, n, tokens, rest);
+            break;
+        case CMD_META:
+            result = meta_command(conn, n, tokens);
+            if (result == META_CLOSE)
+                stat |= STAT_CLOSE;
             break;
         case CMD_QUIT:
             stat = STAT_CLOSE;
@@ -1364,8 +2299,9 @@ static unsigned do_command(struct sock_buf_t* sb, struct in_addr addr)
         case CMD_STATUS: {
             char ip_addr[256];
 
-            mt_inet_ntoa(addr, ip_addr);
-            if (strcmp(ip_addr, "127.0.0.1") == 0) {
+            /* ローカルからの接続のみ受け付けます。*/
+            mt_inet_ntoa(conn->addr, ip_addr);
+            if (conn->local || strcmp(ip_addr, "127.0.0.1") == 0) {
                 char sendbuf[256];
 
                 if (cmd == CMD_SHUTDOWN) {
@@ -1374,41 +2310,40 @@ static unsigned do_command(struct sock_buf_t* sb, struct in_addr addr)
                 } else {
                     strcpy(sendbuf, "running.\r\n");
                 }
-                if (send_data(sb->socket, sendbuf, strlen(sendbuf)) < 0)
+                if (conn_send(conn, sendbuf, strlen(sendbuf)) < 0)
                     result = -1;
             } else {
-                if (cmd_error(sb->socket) < 0)
+                if (cmd_error(conn) < 0)
                     result = -1;
             }
             stat |= STAT_CLOSE;
             break;
         }
         case CMD_BGET:
-            result = bget_command(sb, cc, (const char**)clp);
+            result = bget_command(conn, n, tokens);
             if (result != 0) {
                 char emark;
 
                 /* 'n' was not found, 'e' is error */
                 emark = (result == 1)? 'n' : 'e';
-                if (send_data(sb->socket, &emark, sizeof(emark)) < 0)
+                if (conn_send(conn, &emark, sizeof(emark)) < 0)
                     err_write("memcached: bget_command() send error.");
             }
             break;
         case CMD_BSET:
-            result = bset_command(sb, cc, (const char**)clp);
+            result = bset_command(conn, n, tokens);
             break;
         case CMD_BKEYS:
-            result = bkeys_command(sb, cc, (const char**)clp);
+            result = bkeys_command(conn, n, tokens);
             if (result != 0)
-                send_key(sb->socket, NULL, 0);
+                send_key(conn, NULL, 0);
             break;
         default:
             /* エラー応答データ */
-            if (cmd_error(sb->socket) < 0)
+            if (cmd_error(conn) < 0)
                 result = -1;
             break;
     }
-    list_free(clp);
     TRACE(" result=%d done.\n", result);
     return stat;
 }
@@ -1418,6 +2353,11 @@ static void break_signal()
     SOCKET c_socket;
     const char dummy = 0x30;
 
+    if (g_conf->reactors > 0) {
+        /* リアクター方式では各リアクターの待機を解除します。*/
+        reactor_wakeup();
+        return;
+    }
     c_socket = sock_connect_server("127.0.0.1", g_conf->port_no);
     if (c_socket == INVALID_SOCKET) {
         err_write("break_signal: can't open socket: %s", strerror(errno));
@@ -1427,114 +2367,225 @@ static void break_signal()
     SOCKET_CLOSE(c_socket);
 }
 
-static struct sock_buf_t* socket_buffer(SOCKET socket)
+/*
+ * ソケットに到着しているコマンドを処理します。
+ * 到着しているデータを受信して、揃っているコマンドを繰り返し処理します。
+ * 途中までしか到着していないコマンドは受信バッファに残して
+ * 次の受信で続きを処理するため、データの到着を待つことはありません。
+ * 応答データは処理の最後にまとめて送信されます。
+ *
+ * 処理するコマンド数は nio.dispatch_quantum までで、残りのコマンドは
+ * 呼び出し元が他のコネクションの後で再度処理する必要があります。
+ *
+ * conn: コネクション情報
+ *
+ * 戻り値
+ *  1: 割り当てを使い切った(処理できるコマンドが残っている)
+ *  0: 処理が終了した(コネクションは継続)
+ * -1: コネクションをクローズした
+ */
+int memcached_process(struct conn_t* conn)
 {
-    struct sock_buf_t* sb;
-    char sockkey[16];
+    unsigned stat = 0;
+    int count = 0;
+    int yield = 0;
 
-    snprintf(sockkey, sizeof(sockkey), "%d", socket);
-    sb = (struct sock_buf_t*)hash_get(g_sockbuf_hash, sockkey);
-    if (sb == NULL) {
-        err_write("socket_buffer: not found hash key=%d", socket);
-        return NULL;
+    conn->last_time = current_seconds();
+
+    /* io_uring のコネクションは受信済みです。*/
+    if (conn->io_mode != CONN_IO_URING) {
+        if (conn_recv(conn) < 0)
+            stat = STAT_FIN|STAT_CLOSE;    /* FIN受信 */
     }
-    if (sb->socket != socket) {
-        err_write("socket_buffer: illegal socket %d -> %d", socket, sb->socket);
-        return NULL;
+
+    while (memcached_ready(conn)) {
+        unsigned cstat;
+
+        if (g_conf->dispatch_quantum > 0 && count >= g_conf->dispatch_quantum) {
+            /* 割り当てを使い切ったため他のコネクションに譲ります。*/
+            ATOMIC_ADD(g_stats.dispatch_yields, 1);
+            yield = 1;
+            break;
+        }
+        count++;
+
+        /* コマンドを受信して処理します。*/
+        /* 'quit'コマンドが入力されると STAT_CLOSE が真になります。*/
+        /* 'shutdown'コマンドが入力されると STAT_SHUTDOWN と
+            STAT_CLOSE が真になります。*/
+        if (conn->protocol == CONN_PROTO_BINARY)
+            cstat = (binary_command(conn) < 0)? STAT_CLOSE : 0;
+        else
+            cstat = do_command(conn);
+        stat |= cstat;
+        if (cstat & STAT_CLOSE)
+            break;
     }
-    return sb;
-}
 
-static void socket_cleanup(struct sock_buf_t* sb)
-{
-    char sockkey[16];
+    /* 処理したコマンドの応答データをまとめて送信します。*/
+    /* 送信できない場合はコネクションをクローズします。*/
+    if (conn_flush(conn) < 0)
+        stat |= STAT_CLOSE;
 
-    sock_event_delete(g_sock_event, sb->socket);
+    if (stat & STAT_CLOSE) {
+        if (g_trace_mode) {
+            char ip_addr[256];
 
-    shutdown(sb->socket, 2);  /* 2: RDWR stop */
-    SOCKET_CLOSE(sb->socket);
+            mt_inet_ntoa(conn->addr, ip_addr);
+            TRACE("disconnect to %s, socket=%d, done.\n", ip_addr, conn->socket);
+        }
+        /* ソケットをクローズします。*/
+        conn_close(conn);
+    } else {
+        /* 大きなデータで拡張したバッファを縮小します。*/
+        conn_shrink(conn);
+    }
 
-    snprintf(sockkey, sizeof(sockkey), "%d", sb->socket);
-    if (hash_delete(g_sockbuf_hash, sockkey) < 0)
-        err_write("socket_cleanup: hash_delete fail, key=%s", sockkey);
-    sockbuf_free(sb);
+    if (stat & STAT_SHUTDOWN) {
+        g_shutdown_flag = 1;
+        break_signal();
+    }
+    if (stat & STAT_CLOSE)
+        return -1;
+    return yield;
 }
 
-static void memcached_thread(void* argv)
+/*
+ * 受信データの先頭のコマンドに必要なサイズを求めます。
+ * 行末がない場合は現在のサイズ + 1 を返します。
+ */
+static int command_size(const char* p, int n)
 {
-    /* argv unuse */
-    struct thread_args_t* th_args;
-    SOCKET socket;
-    struct in_addr addr;
-    struct sock_buf_t* sb;
-    int stat;
-    int end_flag;
+    const char* eol;
+    const char* tok[5];
+    int tc = 0;
+    int cmdlen;
+    int cmd;
+    int linelen;
+    int i;
 
-    while (! g_shutdown_flag) {
-#ifndef WIN32
-        pthread_mutex_lock(&memcached_queue_mutex);
-#endif
-        /* キューにデータが入るまで待機します。*/
-        while (que_empty(g_queue)) {
-#ifdef WIN32
-            WaitForSingleObject(memcached_queue_cond, INFINITE);
-#else
-            pthread_cond_wait(&memcached_queue_cond, &memcached_queue_mutex);
-#endif
+    eol = find_crlf(p, n);
+    if (eol == NULL)
+        return (n >= BUF_SIZE)? n : n + 1;
+    linelen = (int)(eol - p) + 2;
+
+    /* 先頭から５つのトークンの位置を求めます。*/
+    i = 0;
+    while (tc < 5) {
+        while (&p[i] < eol && p[i] == ' ')
+            i++;
+        if (&p[i] >= eol)
+            break;
+        tok[tc++] = &p[i];
+        while (&p[i] < eol && p[i] != ' ')
+            i++;
+    }
+    if (tc < 1)
+        return linelen;
+
+    /* コマンド名 */
+    for (cmdlen = 0; &tok[0][cmdlen] < eol && tok[0][cmdlen] != ' '; cmdlen++)
+        ;
+    cmd = lookup_command(tok[0], cmdlen);
+
+    if (cmd == CMD_SET || cmd == CMD_ADD || cmd == CMD_REPLACE ||
+        cmd == CMD_APPEND || cmd == CMD_PREPEND || cmd == CMD_CAS ||
+        (cmd == CMD_META && tok[0][1] == 's')) {
+        int64 bytes = 0;
+        int64 max_bytes;
+        const char* bp;
+        int bytes_index;
+
+        /* ms <key> <datalen> <flags>* */
+        bytes_index = (cmd == CMD_META)? 2 : 4;
+        max_bytes = (cmd == CMD_META)? MAX_META_DATALEN : MAX_MEMCACHED_DATASIZE;
+        if (tc <= bytes_index)
+            return linelen;     /* 引数エラー */
+        for (bp = tok[bytes_index]; bp < eol && *bp != ' '; bp++) {
+            if (! isdigit((unsigned char)*bp))
+                return linelen;     /* <bytes>エラー */
+            bytes = bytes * 10 + (*bp - '0');
+            if (bytes > max_bytes)
+                return linelen;     /* サイズエラー */
         }
-#ifndef WIN32
-        pthread_mutex_unlock(&memcached_queue_mutex);
-#endif
+        return linelen + (int)bytes + (int)strlen(LINE_DELIMITER);
+    }
+    if (cmd == CMD_BSET) {
+        int size;
 
-        /* キューからデータを取り出します。*/
-        th_args = (struct thread_args_t*)que_pop(g_queue);
-        if (th_args == NULL)
-            continue;
+        /* <size>(4) <stat>(1) <cas>(8) <data>(size) */
+        if (n < linelen + (int)sizeof(int))
+            return linelen + (int)sizeof(int);
+        memcpy(&size, p + linelen, sizeof(int));
+        if (size < 1 || size > MAX_MEMCACHED_DATASIZE)
+            return linelen;     /* サイズエラー */
+        return linelen + (int)(sizeof(int)+sizeof(char)+sizeof(int64)) + size;
+    }
+    return linelen;
+}
 
-        socket = th_args->socket;
-        addr = th_args->sockaddr.sin_addr;
+/*
+ * 受信バッファに１コマンド分のデータが揃っているか調べます。
+ *
+ * 保存系コマンドは <bytes> から <data block> までを、
+ * bset は <datablock> のサイズ部分から全体の長さを求めます。
+ * 揃っていない場合は必要なサイズを conn->need に保存して、
+ * それまでは解析を行いません。
+ * 行末が見つからないまま BUF_SIZE を超えた場合は、
+ * エラー処理のために揃っているとみなします。
+ *
+ * 戻り値
+ *  1: 揃っている
+ *  0: 揃っていない
+ */
+int memcached_ready(struct conn_t* conn)
+{
+    int need;
 
-        sb = socket_buffer(socket);
-        if (sb == NULL)
-            continue;
+    if (conn->rlen < 1 || conn->rlen < conn->need)
+        return 0;
+    if (conn->protocol == CONN_PROTO_NONE) {
+        /* 最初のバイトでプロトコルを判定します。*/
+        if ((uchar)conn->rbuf[conn->rpos] == PROTOCOL_BINARY_REQ)
+            conn->protocol = CONN_PROTO_BINARY;
+        else
+            conn->protocol = CONN_PROTO_TEXT;
+    }
+    if (conn->protocol == CONN_PROTO_BINARY)
+        need = binary_command_size(conn->rbuf + conn->rpos, conn->rlen);
+    else
+        need = command_size(conn->rbuf + conn->rpos, conn->rlen);
+    if (conn->rlen < need) {
+        conn->need = need;
+        return 0;
+    }
+    conn->need = 0;
+    return 1;
+}
 
-        do {
-            end_flag = 0;
-            /* コマンドを受信して処理します。*/
-            /* 'quit'コマンドが入力されると STAT_CLOSE が真になります。*/
-            /* 'shutdown'コマンドが入力されると STAT_SHUTDOWN と
-                STAT_CLOSE が真になります。*/
-            stat = do_command(sb, addr);
-
-            if (stat & STAT_CLOSE) {
-                /* ソケットをクローズします。*/
-                if (g_trace_mode) {
-                    char ip_addr[256];
-
-                    mt_inet_ntoa(addr, ip_addr);
-                    TRACE("disconnect to %s, socket=%d, done.\n", ip_addr, sb->socket);
-                }
-                /* ソケットをクローズします。*/
-                socket_cleanup(sb);
-                end_flag = 1;
-            }
 
-            if (! end_flag) {
-                if (sb->cur_size < 1)
-                    end_flag = 1;
-            }
-        } while (! end_flag);
+static void memcached_thread(void* argv)
+{
+    /* argv unuse */
+    struct conn_t* conn;
+    uint gen;
+    int result;
 
-        if (! (stat & STAT_CLOSE)) {
-            /* コマンド処理が終了したのでイベント通知を有効にします。*/
-            sock_event_enable(g_sock_event, sb->socket);
-        }
-        /* パラメータ領域の解放 */
-        free(th_args);
+    while (! g_shutdown_flag) {
+        /* キューからデータを取り出します。
+           キューにデータが入るまで待機します。*/
+        conn = dq_pop(g_queue, &gen);
+        if (conn->socket == INVALID_SOCKET || conn->gen != gen)
+            continue;
 
-        if (stat & STAT_SHUTDOWN) {
-            g_shutdown_flag = 1;
-            break_signal();
+        result = memcached_process(conn);
+        if (result > 0) {
+            /* 他のリクエストの後に再度キューイングします。
+               イベント通知は無効のままです。*/
+            memcached_request(conn);
+        } else if (result == 0) {
+            /* コマンド処理が終了したのでイベント通知を有効にします。*/
+            sock_event_enable(conn->sock_event, conn->socket);
         }
     }
 
@@ -1544,34 +2595,71 @@ static void memcached_thread(void* argv)
 #endif
 }
 
-int memcached_request(SOCKET socket, struct sockaddr_in sockaddr)
+/*
+ * UDP で受信したコマンド行を処理して応答データを mb に追加します。
+ * UDP では get と gets のみに対応しています。
+ * 小さな要求で大きな応答を送らせないように、キーが max_keys を超える
+ * 要求と応答が max_reply バイトを超える要求はエラーを応答します。
+ *
+ * cmdline: 改行を取り除いたコマンド行(内容は変更されます)
+ * mb: 応答データを追加するバッファ
+ * max_keys: 要求できるキーの最大数
+ * max_reply: 応答データの最大サイズ
+ *
+ * 戻り値
+ *  0: 成功
+ *  1: 制限を超えた(エラーを応答する)
+ * -1: エラー
+ */
+int memcached_udp_command(char* cmdline, struct membuf_t* mb, int max_keys, int max_reply)
 {
-    struct thread_args_t* th_args;
+    struct token_t tokens[MAX_TOKENS];
+    char* rest;
+    int n;
+    int cmd;
+    int i;
 
-    /* スレッドへ渡す情報を作成します */
-    th_args = (struct thread_args_t*)malloc(sizeof(struct thread_args_t));
-    if (th_args == NULL) {
-        err_log(sockaddr.sin_addr, "no memory.");
-        SOCKET_CLOSE(socket);
+    n = tokenize(cmdline, tokens, MAX_TOKENS, &rest);
+    if (n < 2) {
+        mb_append(mb, "ERROR\r\n", sizeof("ERROR\r\n")-1);
         return 0;
     }
-    th_args->socket = socket;
-    th_args->sockaddr = sockaddr;
 
-    /* リクエストされた情報をキューイング(push)します。*/
-    que_push(g_queue, th_args);
+    cmd = parse_command(&tokens[0]);
+    if (cmd != CMD_GET && cmd != CMD_GETS) {
+        char* msg = "SERVER_ERROR only get and gets are supported over UDP\r\n";
 
-    /* キューイングされたことをスレッドへ通知します。*/
-#ifdef WIN32
-    SetEvent(memcached_queue_cond);
-#else
-    pthread_mutex_lock(&memcached_queue_mutex);
-    pthread_cond_signal(&memcached_queue_cond);
-    pthread_mutex_unlock(&memcached_queue_mutex);
-#endif
+        mb_append(mb, msg, strlen(msg));
+        return 0;
+    }
+    if (rest != NULL || n - 1 > max_keys) {
+        char* msg = "CLIENT_ERROR too many keys over UDP\r\n";
+
+        mb_append(mb, msg, strlen(msg));
+        return 1;
+    }
+    for (i = 1; i < n; i++) {
+        if (get_element(tokens[i].value, tokens[i].length, (cmd == CMD_GETS), NULL, mb) < 0)
+            return -1;
+        if (mb->size > max_reply) {
+            char* msg = "SERVER_ERROR response too large for UDP\r\n";
+
+            mb->size = 0;
+            mb_append(mb, msg, strlen(msg));
+            return 1;
+        }
+    }
+    mb_append(mb, "END\r\n", sizeof("END\r\n")-1);
     return 0;
 }
 
+int memcached_request(struct conn_t* conn)
+{
+    /* リクエストされたコネクションをキューイング(push)します。
+       待機しているスレッドへの通知もキューで行います。*/
+    return dq_push(g_queue, conn, conn->gen);
+}
+
 int memcached_worker_open()
 {
     int i;
@@ -1601,45 +2689,71 @@ int memcached_open()
     struct sockaddr_in sockaddr;
     char ip_addr[256];
 
+    /* コマンドの検索表を作成します。*/
+    command_initialize();
+
     /* データベースをオープンします。*/
     if (open_database() < 0)
         return -1;
 
-    /* セッション・リレー リスニングソケットの作成 */
-    g_listen_socket = sock_listen(INADDR_ANY,
-                                  g_conf->port_no,
-                                  g_conf->backlog,
-                                  &sockaddr);
-    if (g_listen_socket == INVALID_SOCKET) {
-        close_database();
-        return -1;  /* error */
-    }
-
     /* 自分自身の IPアドレスを取得します。*/
     sock_local_addr(ip_addr);
 
-    /* スターティングメッセージの表示 */
-    TRACE("%s port: %d on %s listening ... %d threads\n",
-        PROGRAM_NAME, g_conf->port_no, ip_addr, g_conf->worker_threads);
+    if (g_conf->reactors > 0) {
+        /* リアクター方式では各リアクターが listenソケットを作成します。*/
+        TRACE("%s port: %d on %s listening ... %d reactors\n",
+            PROGRAM_NAME, g_conf->port_no, ip_addr, g_conf->reactors);
+    } else {
+        /* セッション・リレー リスニングソケットの作成 */
+        g_listen_socket = sock_listen(INADDR_ANY,
+                                      g_conf->port_no,
+                                      g_conf->backlog,
+                                      &sockaddr);
+        if (g_listen_socket == INVALID_SOCKET) {
+            close_database();
+            return -1;  /* error */
+        }
+
+        /* スターティングメッセージの表示 */
+        TRACE("%s port: %d on %s listening ... %d threads\n",
+            PROGRAM_NAME, g_conf->port_no, ip_addr, g_conf->worker_threads);
+    }
 
-    /* キューイング制御の初期化 */
-#ifdef WIN32
-    memcached_queue_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
-#else
-    pthread_mutex_init(&memcached_queue_mutex, NULL);
-    pthread_cond_init(&memcached_queue_cond, NULL);
-#endif
+    if (g_conf->unix_socket[0]) {
+        /* Unix ドメインソケットの listenソケットを作成します。*/
+        g_unix_socket = unix_listen(g_conf->unix_socket, g_conf->backlog);
+        if (g_unix_socket == INVALID_SOCKET) {
+            close_database();
+            return -1;
+        }
+        TRACE("%s unix socket: %s listening ...\n", PROGRAM_NAME, g_conf->unix_socket);
+    }
+
+    if (g_conf->udp_port > 0) {
+        /* UDP のソケットを作成します。*/
+        g_udp_socket = udp_listen(g_conf->udp_bind, g_conf->udp_port);
+        if (g_udp_socket == INVALID_SOCKET) {
+            close_database();
+            return -1;
+        }
+        TRACE("%s udp port: %s:%d listening ... %d threads\n",
+            PROGRAM_NAME, g_conf->udp_bind, g_conf->udp_port, g_conf->udp_threads);
+    }
+
+    /* 追記用の分割データの圧縮スレッドを開始します。*/
+    chunk_open();
+
+    /* 期限切れデータを削除するスレッドを開始します。
+       開始できない場合も読み込み時の削除は行われます。*/
+    if (g_conf->expire_rate > 0)
+        expire_open();
     return 0;
 }
 
 void memcached_close()
 {
+    if (g_conf->expire_rate > 0)
+        expire_close();
+    chunk_close();
     close_database();
-
-#ifdef WIN32
-    CloseHandle(memcached_queue_cond);
-#else
-    pthread_cond_destroy(&memcached_queue_cond);
-    pthread_mutex_destroy(&memcached_queue_mutex);
-#endif
 }
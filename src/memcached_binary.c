@@ -0,0 +1,669 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * memcached バイナリプロトコルを実装したものです。
+ *
+ * <<memcachedバイナリプロトコル仕様書>>
+ * https://github.com/memcached/memcached/wiki/BinaryProtocolRevamped
+ *
+ * コネクションの最初のバイトがリクエストのマジック(0x80)の場合に
+ * バイナリプロトコルとして処理します(memcached_ready())。
+ * データベースの操作はテキストプロトコルと共通の関数を使用するため、
+ * 保存されるデータの形式は同じです。
+ *
+ * [パケット]
+ * +------+------+--------+------+
+ * |header|extras|  key   |value |
+ * +------+------+--------+------+
+ *  header は 24バイトで数値はすべてネットワークバイトオーダーです。
+ *
+ *  +-----+------+--------+------+--------+--------------+
+ *  |magic|opcode|keylen  |extlen|datatype|vbucket/status|
+ *  | (1) | (1)  |  (2)   | (1)  |  (1)   |     (2)      |
+ *  +-----+------+--------+------+--------+--------------+
+ *  |bodylen(4)  |opaque(4)      |cas(8)                 |
+ *  +------------+---------------+-----------------------+
+ *
+ * パケットは memcached_ready() で全体が受信されているため、
+ * 受信バッファのデータを直接参照して処理します。
+ *
+ * 'Q' の付くコマンド(getq, getkq, setq など)は成功した場合
+ * (get 系は見つからなかった場合)に応答を返しません。
+ * 複数のキーの取得や大量の保存をまとめて送信する場合に使用されます。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nio_server.h"
+
+#define BIN_HEADER_SIZE     24
+#define BIN_RES_MAGIC       0x81
+#define BIN_BODY_MAX        (MAX_MEMCACHED_DATASIZE + MAX_MEMCACHED_KEYSIZE + 32)
+
+/* opcode */
+#define BIN_CMD_GET         0x00
+#define BIN_CMD_SET         0x01
+#define BIN_CMD_ADD         0x02
+#define BIN_CMD_REPLACE     0x03
+#define BIN_CMD_DELETE      0x04
+#define BIN_CMD_INCREMENT   0x05
+#define BIN_CMD_DECREMENT   0x06
+#define BIN_CMD_QUIT        0x07
+#define BIN_CMD_FLUSH       0x08
+#define BIN_CMD_GETQ        0x09
+#define BIN_CMD_NOOP        0x0a
+#define BIN_CMD_VERSION     0x0b
+#define BIN_CMD_GETK        0x0c
+#define BIN_CMD_GETKQ       0x0d
+#define BIN_CMD_APPEND      0x0e
+#define BIN_CMD_PREPEND     0x0f
+#define BIN_CMD_STAT        0x10
+#define BIN_CMD_SETQ        0x11
+#define BIN_CMD_ADDQ        0x12
+#define BIN_CMD_REPLACEQ    0x13
+#define BIN_CMD_DELETEQ     0x14
+#define BIN_CMD_INCREMENTQ  0x15
+#define BIN_CMD_DECREMENTQ  0x16
+#define BIN_CMD_QUITQ       0x17
+#define BIN_CMD_FLUSHQ      0x18
+#define BIN_CMD_APPENDQ     0x19
+#define BIN_CMD_PREPENDQ    0x1a
+#define BIN_CMD_TOUCH       0x1c
+#define BIN_CMD_GAT         0x1d
+#define BIN_CMD_GATQ        0x1e
+#define BIN_CMD_GATK        0x23
+#define BIN_CMD_GATKQ       0x24
+
+/* status */
+#define BIN_STATUS_SUCCESS          0x0000
+#define BIN_STATUS_KEY_ENOENT       0x0001
+#define BIN_STATUS_KEY_EEXISTS      0x0002
+#define BIN_STATUS_E2BIG            0x0003
+#define BIN_STATUS_EINVAL           0x0004
+#define BIN_STATUS_NOT_STORED       0x0005
+#define BIN_STATUS_DELTA_BADVAL     0x0006
+#define BIN_STATUS_UNKNOWN_COMMAND  0x0081
+#define BIN_STATUS_ENOMEM           0x0082
+
+/* リクエストヘッダー */
+struct bin_header_t {
+    uchar magic;
+    uchar opcode;
+    ushort keylen;
+    uchar extlen;
+    uchar datatype;
+    ushort vbucket;
+    uint bodylen;
+    uint opaque;
+    uint64 cas;
+};
+
+static uint get16(const uchar* p)
+{
+    return ((uint)p[0] << 8) | p[1];
+}
+
+static uint get32(const uchar* p)
+{
+    return ((uint)p[0] << 24) | ((uint)p[1] << 16) | ((uint)p[2] << 8) | p[3];
+}
+
+static uint64 get64(const uchar* p)
+{
+    return ((uint64)get32(p) << 32) | get32(p + 4);
+}
+
+static void put16(uchar* p, uint v)
+{
+    p[0] = (uchar)(v >> 8);
+    p[1] = (uchar)v;
+}
+
+static void put32(uchar* p, uint v)
+{
+    p[0] = (uchar)(v >> 24);
+    p[1] = (uchar)(v >> 16);
+    p[2] = (uchar)(v >> 8);
+    p[3] = (uchar)v;
+}
+
+static void put64(uchar* p, uint64 v)
+{
+    put32(p, (uint)(v >> 32));
+    put32(p + 4, (uint)v);
+}
+
+/*
+ * 受信バッファの先頭のパケットに必要なサイズを求めます。
+ * ヘッダーが揃っていない場合はヘッダーのサイズを返します。
+ * ボディのサイズが上限を超える場合はエラー処理のために
+ * ヘッダーのサイズを返します。
+ */
+int binary_command_size(const char* p, int n)
+{
+    uint bodylen;
+
+    if (n < BIN_HEADER_SIZE)
+        return BIN_HEADER_SIZE;
+    bodylen = get32((const uchar*)p + 8);
+    if (bodylen > BIN_BODY_MAX)
+        return BIN_HEADER_SIZE;
+    return BIN_HEADER_SIZE + (int)bodylen;
+}
+
+/*
+ * 応答パケットを送信します。
+ * ref が NULL でない場合は値(val)をコピーせずに送信して、
+ * 送信後に ref を memcached_release() で解放します。
+ */
+static int bin_response_ref(struct conn_t* conn,
+                            const struct bin_header_t* req,
+                            uint status,
+                            const void* ext, int extlen,
+                            const void* key, int keylen,
+                            const void* val, int vlen,
+                            uint64 cas,
+                            char* ref)
+{
+    uchar hdr[BIN_HEADER_SIZE];
+
+    hdr[0] = BIN_RES_MAGIC;
+    hdr[1] = req->opcode;
+    put16(&hdr[2], keylen);
+    hdr[4] = (uchar)extlen;
+    hdr[5] = 0;
+    put16(&hdr[6], status);
+    put32(&hdr[8], extlen + keylen + vlen);
+    memcpy(&hdr[12], &req->opaque, sizeof(uint));  /* そのまま返します */
+    put64(&hdr[16], cas);
+
+    if (conn_send(conn, hdr, sizeof(hdr)) < 0 ||
+        (extlen > 0 && conn_send(conn, ext, extlen) < 0) ||
+        (keylen > 0 && conn_send(conn, key, keylen) < 0)) {
+        if (ref)
+            memcached_release(ref);
+        return -1;
+    }
+    if (ref)
+        return (conn_send_ref(conn, val, vlen, memcached_release, ref) < 0)? -1 : 0;
+    if (vlen > 0 && conn_send(conn, val, vlen) < 0)
+        return -1;
+    return 0;
+}
+
+static int bin_response(struct conn_t* conn,
+                        const struct bin_header_t* req,
+                        uint status,
+                        const void* ext, int extlen,
+                        const void* key, int keylen,
+                        const void* val, int vlen,
+                        uint64 cas)
+{
+    return bin_response_ref(conn, req, status, ext, extlen, key, keylen,
+                            val, vlen, cas, NULL);
+}
+
+static int bin_error(struct conn_t* conn, const struct bin_header_t* req, uint status)
+{
+    const char* msg;
+
+    switch (status) {
+        case BIN_STATUS_KEY_ENOENT:
+            msg = "Not found";
+            break;
+        case BIN_STATUS_KEY_EEXISTS:
+            msg = "Data exists for key.";
+            break;
+        case BIN_STATUS_E2BIG:
+            msg = "Too large.";
+            break;
+        case BIN_STATUS_EINVAL:
+            msg = "Invalid arguments";
+            break;
+        case BIN_STATUS_NOT_STORED:
+            msg = "Not stored.";
+            break;
+        case BIN_STATUS_DELTA_BADVAL:
+            msg = "Non-numeric server-side value for incr or decr";
+            break;
+        case BIN_STATUS_UNKNOWN_COMMAND:
+            msg = "Unknown command";
+            break;
+        default:
+            msg = "Out of memory";
+            break;
+    }
+    return bin_response(conn, req, status, NULL, 0, NULL, 0, msg, strlen(msg), 0);
+}
+
+static uint store_status(int result)
+{
+    if (result == STORE_STORED)
+        return BIN_STATUS_SUCCESS;
+    if (result == STORE_EXISTS)
+        return BIN_STATUS_KEY_EEXISTS;
+    if (result == STORE_NOT_FOUND)
+        return BIN_STATUS_KEY_ENOENT;
+    if (result == STORE_TOO_LARGE)
+        return BIN_STATUS_E2BIG;
+    if (result == STORE_NO_MEMORY)
+        return BIN_STATUS_ENOMEM;
+    return BIN_STATUS_NOT_STORED;
+}
+
+/* get, getq, getk, getkq
+ * extras(response): <flags>(4)
+ */
+static int get_command(struct conn_t* conn, const struct bin_header_t* req,
+                       const char* key, int quiet, int key_flag)
+{
+    char* dbuf;
+    int bytes;
+    uint flags;
+    int64 cas;
+    uchar ext[4];
+
+    dbuf = memcached_get(key, req->keylen, &bytes, &flags, &cas);
+    if (dbuf == NULL) {
+        if (quiet)
+            return 0;
+        if (key_flag)
+            return bin_response(conn, req, BIN_STATUS_KEY_ENOENT,
+                                NULL, 0, key, req->keylen, NULL, 0, 0);
+        return bin_error(conn, req, BIN_STATUS_KEY_ENOENT);
+    }
+
+    /* 値はコピーせずに送信して、送信後に解放します。*/
+    put32(ext, flags);
+    return bin_response_ref(conn, req, BIN_STATUS_SUCCESS,
+                            ext, sizeof(ext),
+                            key, (key_flag)? req->keylen : 0,
+                            &dbuf[DATABLOCK_HEADER_SIZE], bytes,
+                            (uint64)cas, dbuf);
+}
+
+/* touch
+ * gat, gatq, gatk, gatkq
+ * extras: <exptime>(4)
+ *
+ * 値は書き換えずにヘッダーの<exptime>のみ更新します。
+ * gat 系の応答は get 系と同じです。
+ */
+static int touch_command(struct conn_t* conn, const struct bin_header_t* req,
+                         const uchar* ext, const char* key, int gat_flag,
+                         int quiet, int key_flag)
+{
+    uint exptime;
+    int result;
+
+    if (req->extlen != 4)
+        return bin_error(conn, req, BIN_STATUS_EINVAL);
+
+    exptime = get32(ext);
+    if (exptime > 0)
+        exptime += current_seconds();
+
+    result = memcached_touch(key, req->keylen, exptime);
+    if (gat_flag)
+        return get_command(conn, req, key, quiet, key_flag);
+    if (result != STORE_STORED)
+        return bin_error(conn, req, store_status(result));
+    return bin_response(conn, req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, NULL, 0, 0);
+}
+
+/* set, add, replace (setq, addq, replaceq)
+ * extras: <flags>(4) <exptime>(4)
+ */
+static int set_command(struct conn_t* conn, const struct bin_header_t* req,
+                       const uchar* ext, const char* key,
+                       const char* val, int vlen, int quiet, int check_mode)
+{
+    uint flags;
+    uint exptime;
+    char* buf;
+    int cas_flag;
+    int result;
+    char keybuf[MAX_MEMCACHED_KEYSIZE];
+    char save[DATABLOCK_HEADER_SIZE];
+
+    if (req->extlen != 8)
+        return bin_error(conn, req, BIN_STATUS_EINVAL);
+    if (vlen > MAX_MEMCACHED_DATASIZE - (int)DATABLOCK_HEADER_SIZE)
+        return bin_error(conn, req, BIN_STATUS_E2BIG);
+
+    flags = get32(ext);
+    exptime = get32(ext + 4);
+    if (exptime > 0)
+        exptime += current_seconds();
+
+    /* 値の直前のキーはヘッダーで上書きされるためコピーします。*/
+    memcpy(keybuf, key, req->keylen);
+    buf = memcached_datablock(conn, (char*)val, vlen, flags, exptime, save);
+    if (buf == NULL) {
+        err_write("memcached: binary set() no memory.");
+        return bin_error(conn, req, BIN_STATUS_ENOMEM);
+    }
+
+    /* add には cas は使用しません。*/
+    cas_flag = (req->cas != 0 && check_mode != CHECK_ADD);
+    result = memcached_store(keybuf, req->keylen, buf, DATABLOCK_HEADER_SIZE + vlen,
+                             cas_flag, (int64)req->cas, check_mode);
+    memcached_datablock_release(buf, (char*)val, save);
+
+    if (result == STORE_STORED) {
+        if (quiet)
+            return 0;
+        return bin_response(conn, req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, NULL, 0, 0);
+    }
+    if (result == STORE_EXISTS && check_mode == CHECK_ADD)
+        return bin_error(conn, req, BIN_STATUS_KEY_EEXISTS);
+    return bin_error(conn, req, store_status(result));
+}
+
+/* append, prepend (appendq, prependq)
+ */
+static int update_command(struct conn_t* conn, const struct bin_header_t* req,
+                          const char* key, const char* val, int vlen,
+                          int quiet, int mode)
+{
+    int result;
+
+    if (req->extlen != 0)
+        return bin_error(conn, req, BIN_STATUS_EINVAL);
+
+    result = memcached_update(key, req->keylen, val, vlen, mode);
+    if (result == STORE_STORED) {
+        if (quiet)
+            return 0;
+        return bin_response(conn, req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, NULL, 0, 0);
+    }
+    return bin_error(conn, req, store_status(result));
+}
+
+/* delete, deleteq
+ */
+static int delete_command(struct conn_t* conn, const struct bin_header_t* req,
+                          const char* key, int quiet)
+{
+    if (req->extlen != 0)
+        return bin_error(conn, req, BIN_STATUS_EINVAL);
+
+    if (memcached_delete(key, req->keylen) != 0)
+        return bin_error(conn, req, BIN_STATUS_KEY_ENOENT);
+    if (quiet)
+        return 0;
+    return bin_response(conn, req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, NULL, 0, 0);
+}
+
+/* increment, decrement (incrementq, decrementq)
+ * extras: <delta>(8) <initial>(8) <exptime>(4)
+ *
+ * キーが存在しない場合は <exptime> が 0xffffffff 以外であれば
+ * <initial> の値で作成します。
+ */
+static int incr_command(struct conn_t* conn, const struct bin_header_t* req,
+                        const uchar* ext, const char* key, int quiet, int mode)
+{
+    uint64 delta;
+    uint64 initial;
+    uint exptime;
+    uint64 val = 0;
+    uchar vbuf[8];
+    int result = STORE_NOT_FOUND;
+    int retry;
+
+    if (req->extlen != 20)
+        return bin_error(conn, req, BIN_STATUS_EINVAL);
+
+    delta = get64(ext);
+    initial = get64(ext + 8);
+    exptime = get32(ext + 16);
+
+    /* 他のスレッドと同時に更新した場合は再実行します。*/
+    for (retry = 0; retry < 3; retry++) {
+        result = memcached_incr(key, req->keylen, mode, delta, &val);
+        if (result == STORE_NOT_FOUND && exptime != 0xffffffff) {
+            char buf[DATABLOCK_HEADER_SIZE + sizeof(uint64)];
+
+            set_data_header(buf, 0, (exptime > 0)? exptime + current_seconds() : 0);
+            memcpy(&buf[DATABLOCK_HEADER_SIZE], &initial, sizeof(uint64));
+            result = memcached_store(key, req->keylen, buf, sizeof(buf), 0, 0, CHECK_ADD);
+            val = initial;
+        }
+        if (result != STORE_EXISTS)
+            break;
+    }
+
+    if (result == STORE_BAD_VALUE)
+        return bin_error(conn, req, BIN_STATUS_DELTA_BADVAL);
+    if (result != STORE_STORED)
+        return bin_error(conn, req, store_status(result));
+    if (quiet)
+        return 0;
+    put64(vbuf, val);
+    return bin_response(conn, req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, vbuf, sizeof(vbuf), 0);
+}
+
+/* stat
+ * 統計情報の１項目ごとにキーと値の応答を返し、
+ * 最後にキーと値のない応答を返します。
+ */
+static int stat_command(struct conn_t* conn, const struct bin_header_t* req)
+{
+    struct membuf_t* mb;
+    char* line;
+    char* end;
+    int result = 0;
+
+    mb = mb_alloc(1024);
+    if (mb == NULL) {
+        err_write("memcached: binary stat_command() no memory.");
+        return bin_error(conn, req, BIN_STATUS_ENOMEM);
+    }
+    memcached_stats(mb);
+
+    /* "STAT <name> <value>\r\n" を分解します。*/
+    line = mb->buf;
+    end = mb->buf + mb->size;
+    while (line < end && result == 0) {
+        char* name = line + 5;  /* "STAT " */
+        char* eol;
+        char* sp;
+
+        eol = memchr(line, '\r', end - line);
+        if (eol == NULL)
+            break;
+        sp = memchr(name, ' ', eol - name);
+        if (sp)
+            result = bin_response(conn, req, BIN_STATUS_SUCCESS, NULL, 0,
+                                  name, (int)(sp - name),
+                                  sp + 1, (int)(eol - sp - 1), 0);
+        line = eol + 2;
+    }
+    mb_free(mb);
+    if (result < 0)
+        return -1;
+    return bin_response(conn, req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, NULL, 0, 0);
+}
+
+/*
+ * 受信バッファの先頭のパケットを処理します。
+ * パケット全体は memcached_ready() で受信済みです。
+ *
+ * 戻り値
+ *  0: 処理が終了した(コネクションは継続)
+ * -1: コネクションをクローズする
+ */
+int binary_command(struct conn_t* conn)
+{
+    const uchar* p = (const uchar*)conn->rbuf + conn->rpos;
+    struct bin_header_t req;
+    const uchar* ext;
+    const char* key;
+    const char* val;
+    int vlen;
+    int result = 0;
+
+    req.magic = p[0];
+    req.opcode = p[1];
+    req.keylen = (ushort)get16(p + 2);
+    req.extlen = p[4];
+    req.datatype = p[5];
+    req.vbucket = (ushort)get16(p + 6);
+    req.bodylen = get32(p + 8);
+    memcpy(&req.opaque, p + 12, sizeof(uint));
+    req.cas = get64(p + 16);
+
+    if (req.magic != PROTOCOL_BINARY_REQ) {
+        err_write("memcached: binary_command() illegal magic=0x%02x socket=%d.",
+                  req.magic, conn->socket);
+        return -1;
+    }
+    if (req.bodylen > BIN_BODY_MAX) {
+        /* ボディを読み捨てることができないため切断します。*/
+        bin_error(conn, &req, BIN_STATUS_E2BIG);
+        return -1;
+    }
+
+    /* パケットを受信バッファから取り除きます。
+       次の受信までバッファの内容は変更されません。*/
+    conn->rpos += BIN_HEADER_SIZE + req.bodylen;
+    conn->rlen -= BIN_HEADER_SIZE + req.bodylen;
+
+    ext = p + BIN_HEADER_SIZE;
+    key = (const char*)ext + req.extlen;
+    val = key + req.keylen;
+    vlen = (int)req.bodylen - req.extlen - req.keylen;
+    if (vlen < 0)
+        return bin_error(conn, &req, BIN_STATUS_EINVAL);
+    if (req.keylen > MAX_MEMCACHED_KEYSIZE)
+        return bin_error(conn, &req, BIN_STATUS_EINVAL);
+
+    switch (req.opcode) {
+        case BIN_CMD_GET:
+        case BIN_CMD_GETQ:
+        case BIN_CMD_GETK:
+        case BIN_CMD_GETKQ:
+            if (req.keylen == 0 || req.extlen != 0 || vlen != 0)
+                return bin_error(conn, &req, BIN_STATUS_EINVAL);
+            result = get_command(conn, &req, key,
+                                 (req.opcode == BIN_CMD_GETQ || req.opcode == BIN_CMD_GETKQ),
+                                 (req.opcode == BIN_CMD_GETK || req.opcode == BIN_CMD_GETKQ));
+            break;
+        case BIN_CMD_SET:
+        case BIN_CMD_SETQ:
+        case BIN_CMD_ADD:
+        case BIN_CMD_ADDQ:
+        case BIN_CMD_REPLACE:
+        case BIN_CMD_REPLACEQ: {
+            int check_mode = CHECK_NONE;
+
+            if (req.keylen == 0)
+                return bin_error(conn, &req, BIN_STATUS_EINVAL);
+            if (req.opcode == BIN_CMD_ADD || req.opcode == BIN_CMD_ADDQ)
+                check_mode = CHECK_ADD;
+            else if (req.opcode == BIN_CMD_REPLACE || req.opcode == BIN_CMD_REPLACEQ)
+                check_mode = CHECK_REPLACE;
+            result = set_command(conn, &req, ext, key, val, vlen,
+                                 (req.opcode == BIN_CMD_SETQ ||
+                                  req.opcode == BIN_CMD_ADDQ ||
+                                  req.opcode == BIN_CMD_REPLACEQ),
+                                 check_mode);
+            break;
+        }
+        case BIN_CMD_APPEND:
+        case BIN_CMD_APPENDQ:
+        case BIN_CMD_PREPEND:
+        case BIN_CMD_PREPENDQ:
+            if (req.keylen == 0)
+                return bin_error(conn, &req, BIN_STATUS_EINVAL);
+            result = update_command(conn, &req, key, val, vlen,
+                                    (req.opcode == BIN_CMD_APPENDQ || req.opcode == BIN_CMD_PREPENDQ),
+                                    (req.opcode == BIN_CMD_APPEND || req.opcode == BIN_CMD_APPENDQ)?
+                                    UPDATE_APPEND : UPDATE_PREPEND);
+            break;
+        case BIN_CMD_DELETE:
+        case BIN_CMD_DELETEQ:
+            if (req.keylen == 0 || vlen != 0)
+                return bin_error(conn, &req, BIN_STATUS_EINVAL);
+            result = delete_command(conn, &req, key, (req.opcode == BIN_CMD_DELETEQ));
+            break;
+        case BIN_CMD_INCREMENT:
+        case BIN_CMD_INCREMENTQ:
+        case BIN_CMD_DECREMENT:
+        case BIN_CMD_DECREMENTQ:
+            if (req.keylen == 0 || vlen != 0)
+                return bin_error(conn, &req, BIN_STATUS_EINVAL);
+            result = incr_command(conn, &req, ext, key,
+                                  (req.opcode == BIN_CMD_INCREMENTQ || req.opcode == BIN_CMD_DECREMENTQ),
+                                  (req.opcode == BIN_CMD_INCREMENT || req.opcode == BIN_CMD_INCREMENTQ)?
+                                  MODE_INCR : MODE_DECR);
+            break;
+        case BIN_CMD_TOUCH:
+        case BIN_CMD_GAT:
+        case BIN_CMD_GATQ:
+        case BIN_CMD_GATK:
+        case BIN_CMD_GATKQ:
+            if (req.keylen == 0 || vlen != 0)
+                return bin_error(conn, &req, BIN_STATUS_EINVAL);
+            result = touch_command(conn, &req, ext, key,
+                                   (req.opcode != BIN_CMD_TOUCH),
+                                   (req.opcode == BIN_CMD_GATQ || req.opcode == BIN_CMD_GATKQ),
+                                   (req.opcode == BIN_CMD_GATK || req.opcode == BIN_CMD_GATKQ));
+            break;
+        case BIN_CMD_FLUSH:
+        case BIN_CMD_FLUSHQ:
+            if (req.extlen != 0 && req.extlen != 4)
+                return bin_error(conn, &req, BIN_STATUS_EINVAL);
+            if (memcached_flush() < 0)
+                result = bin_error(conn, &req, BIN_STATUS_NOT_STORED);
+            else if (req.opcode == BIN_CMD_FLUSH)
+                result = bin_response(conn, &req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, NULL, 0, 0);
+            break;
+        case BIN_CMD_NOOP:
+            result = bin_response(conn, &req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, NULL, 0, 0);
+            break;
+        case BIN_CMD_VERSION:
+            result = bin_response(conn, &req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0,
+                                  PROGRAM_VERSION, strlen(PROGRAM_VERSION), 0);
+            break;
+        case BIN_CMD_STAT:
+            result = stat_command(conn, &req);
+            break;
+        case BIN_CMD_QUIT:
+            bin_response(conn, &req, BIN_STATUS_SUCCESS, NULL, 0, NULL, 0, NULL, 0, 0);
+            return -1;
+        case BIN_CMD_QUITQ:
+            return -1;
+        default:
+            result = bin_error(conn, &req, BIN_STATUS_UNKNOWN_COMMAND);
+            break;
+    }
+    if (result < 0)
+        err_write("memcached: binary_command() opcode=0x%02x send error.", req.opcode);
+    return 0;
+}
@@ -0,0 +1,628 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * memcached メタコマンドを実装したものです。
+ *
+ * <<memcachedプロトコル仕様書(Meta Commands)>>
+ * https://github.com/memcached/memcached/blob/master/doc/protocol.txt
+ *
+ * コマンドの後にキーと１文字のフラグを並べて指定します。
+ * フラグには値(トークン)を続けて指定するものがあります。
+ * 応答には要求されたフラグの値のみが返されます。
+ *
+ *    mg <key> <flags>*\r\n                 データの取得
+ *    ms <key> <datalen> <flags>*\r\n       データの保存
+ *    <data block>\r\n
+ *    md <key> <flags>*\r\n                 データの削除
+ *    ma <key> <flags>*\r\n                 値への加算・減算
+ *    mn\r\n                                 "MN\r\n" を返します
+ *
+ * [フラグ]
+ *  v: 値を返す(mg, ma)
+ *  k: キーを返す
+ *  c: <cas unique> を返す
+ *  f: <flags> を返す(mg)
+ *  s: 値のサイズを返す(mg)
+ *  t: 残りの有効期間(秒)を返す。無期限は -1(mg, ma)
+ *  O<token>: 応答にそのまま返す(最大32バイト)
+ *  q: 成功時(mg はキーが存在しない場合)の応答を返さない
+ *  T<ttl>: 有効期間を変更する
+ *  C<cas>: <cas unique> が一致する場合のみ処理する(ms, md)
+ *  F<flags>: <flags> を設定する(ms)
+ *  M<mode>: ms は E(add) A(append) P(prepend) R(replace) S(set)、
+ *           ma は I,+(incr) D,-(decr)
+ *  N<ttl>: キーが存在しない場合に作成する(ma)
+ *  J<initial>: N で作成する場合の初期値(ma)
+ *  D<delta>: 加算・減算する値、デフォルトは 1(ma)
+ *
+ * [応答]
+ *  VA <size> <flags>*\r\n<data>\r\n    値を含む成功
+ *  HD <flags>*\r\n                     値を含まない成功
+ *  EN\r\n                              キーが存在しない(mg)
+ *  NF <flags>*\r\n                     キーが存在しない(md, ma, C指定の ms)
+ *  NS <flags>*\r\n                     保存されなかった
+ *  EX <flags>*\r\n                     <cas unique> が一致しない
+ *
+ * q を指定したコマンドを続けて送信し、最後に mn を送信すると
+ * 応答を１回の受信で確認することができます。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nio_server.h"
+
+#define META_OPAQUE_SIZE    32
+
+/* コマンドごとに指定できるフラグ */
+#define MG_FLAGS    "vkcfstOqT"
+#define MS_FLAGS    "kcOqTCFM"
+#define MD_FLAGS    "kOqC"
+#define MA_FLAGS    "vkctOqTNJDM"
+
+struct meta_flags_t {
+    int value;                  /* v */
+    int quiet;                  /* q */
+    int ttl_flag;               /* T */
+    uint ttl;
+    int cas_flag;               /* C */
+    int64 cas;
+    uint flags;                 /* F */
+    char mode;                  /* M */
+    int vivify_flag;            /* N */
+    uint vivify_ttl;
+    uint64 initial;             /* J */
+    uint64 delta;               /* D */
+};
+
+static int meta_error(struct conn_t* conn, const char* msg)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "CLIENT_ERROR %s\r\n", msg);
+    if (conn_send(conn, buf, strlen(buf)) < 0) {
+        err_write("memcached: meta_error() send error.");
+        return -1;
+    }
+    return -1;
+}
+
+static int meta_server_error(struct conn_t* conn, const char* msg)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "SERVER_ERROR %s\r\n", msg);
+    if (conn_send(conn, buf, strlen(buf)) < 0)
+        err_write("memcached: meta_server_error() send error.");
+    return -1;
+}
+
+static uint ttl_exptime(uint ttl)
+{
+    return (ttl > 0)? ttl + current_seconds() : 0;
+}
+
+/*
+ * フラグを解析します。
+ * allowed にないフラグが指定された場合はエラーになります。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー(エラー応答は送信済み)
+ */
+static int parse_flags(struct conn_t* conn,
+                       int n,
+                       const struct token_t* tokens,
+                       int start,
+                       const char* allowed,
+                       struct meta_flags_t* mf)
+{
+    int i;
+
+    memset(mf, 0, sizeof(struct meta_flags_t));
+    mf->delta = 1;
+
+    for (i = start; i < n; i++) {
+        const char* t = tokens[i].value;
+        int tlen = tokens[i].length;
+        int err = 0;
+
+        if (strchr(allowed, t[0]) == NULL)
+            return meta_error(conn, "invalid flag");
+
+        switch (t[0]) {
+            case 'v':
+                mf->value = 1;
+                break;
+            case 'q':
+                mf->quiet = 1;
+                break;
+            case 'O':
+                if (tlen - 1 > META_OPAQUE_SIZE)
+                    return meta_error(conn, "opaque token too long");
+                break;
+            case 'T':
+                mf->ttl_flag = 1;
+                err = token_uint(t+1, tlen-1, &mf->ttl);
+                break;
+            case 'C':
+                mf->cas_flag = 1;
+                err = token_uint64(t+1, tlen-1, (uint64*)&mf->cas);
+                break;
+            case 'F':
+                err = token_uint(t+1, tlen-1, &mf->flags);
+                break;
+            case 'M':
+                mf->mode = t[1];
+                err = (tlen != 2);
+                break;
+            case 'N':
+                mf->vivify_flag = 1;
+                err = token_uint(t+1, tlen-1, &mf->vivify_ttl);
+                break;
+            case 'J':
+                err = token_uint64(t+1, tlen-1, &mf->initial);
+                break;
+            case 'D':
+                err = token_uint64(t+1, tlen-1, &mf->delta);
+                break;
+            default:
+                /* 応答に値を返すフラグ(k, c, f, s, t) */
+                break;
+        }
+        if (err)
+            return meta_error(conn, "bad token in command line format");
+    }
+    return 0;
+}
+
+/*
+ * 要求された順に応答フラグを編集します。
+ */
+static void ret_flags(char* buf,
+                      int bufsize,
+                      int n,
+                      const struct token_t* tokens,
+                      int start,
+                      const char* key,
+                      int64 cas,
+                      uint flags,
+                      int size,
+                      uint exptime)
+{
+    int i;
+    int len = 0;
+
+    buf[0] = '\0';
+    for (i = start; i < n && len < bufsize; i++) {
+        const char* t = tokens[i].value;
+
+        switch (t[0]) {
+            case 'O':
+                len += snprintf(buf+len, bufsize-len, " %s", t);
+                break;
+            case 'k':
+                len += snprintf(buf+len, bufsize-len, " k%s", key);
+                break;
+            case 'c':
+                len += snprintf(buf+len, bufsize-len, " c%lld", cas);
+                break;
+            case 'f':
+                len += snprintf(buf+len, bufsize-len, " f%u", flags);
+                break;
+            case 's':
+                len += snprintf(buf+len, bufsize-len, " s%d", size);
+                break;
+            case 't': {
+                int ttl = -1;
+
+                if (exptime > 0) {
+                    ttl = (int)(exptime - current_seconds());
+                    if (ttl < 0)
+                        ttl = 0;
+                }
+                len += snprintf(buf+len, bufsize-len, " t%d", ttl);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+static int has_flag(int n, const struct token_t* tokens, int start, char flag)
+{
+    int i;
+
+    for (i = start; i < n; i++) {
+        if (tokens[i].value[0] == flag)
+            return 1;
+    }
+    return 0;
+}
+
+static int send_status(struct conn_t* conn, const char* status, const char* flags_str)
+{
+    char buf[1024];
+
+    snprintf(buf, sizeof(buf), "%s%s\r\n", status, flags_str);
+    if (conn_send(conn, buf, strlen(buf)) < 0) {
+        err_write("memcached: meta send error.");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 値を含む応答を送信します。
+ * ref が NULL でない場合は値をコピーせずに送信して、
+ * 送信後に ref を memcached_release() で解放します。
+ */
+static int send_value(struct conn_t* conn, const char* flags_str, const char* data, int bytes,
+                      char* ref)
+{
+    char buf[1024];
+    int result;
+
+    snprintf(buf, sizeof(buf), "VA %d%s\r\n", bytes, flags_str);
+    if (conn_send(conn, buf, strlen(buf)) < 0) {
+        if (ref)
+            memcached_release(ref);
+        err_write("memcached: meta send error.");
+        return -1;
+    }
+    if (ref)
+        result = conn_send_ref(conn, data, bytes, memcached_release, ref);
+    else
+        result = conn_send(conn, data, bytes);
+    if (result < 0 || conn_send(conn, "\r\n", sizeof("\r\n")-1) < 0) {
+        err_write("memcached: meta send error.");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * キーのデータを取得して <cas unique> と有効期限を求めます。
+ * データは解放されます。
+ */
+static int item_info(const char* key, int keysize, int64* cas, uint* exptime)
+{
+    char* dbuf;
+    int bytes;
+
+    dbuf = memcached_get(key, keysize, &bytes, NULL, cas);
+    if (dbuf == NULL)
+        return -1;
+    get_data_header(dbuf, NULL, exptime);
+    memcached_release(dbuf);
+    return 0;
+}
+
+/* mg <key> <flags>*
+ */
+static int mg_command(struct conn_t* conn,
+                      int n,
+                      struct token_t* tokens,
+                      const char* key,
+                      int keysize)
+{
+    struct meta_flags_t mf;
+    char* dbuf;
+    int bytes;
+    uint flags;
+    uint exptime;
+    int64 cas;
+    char fbuf[512];
+    int result;
+
+    if (parse_flags(conn, n, tokens, 2, MG_FLAGS, &mf) < 0)
+        return -1;
+
+    /* 有効期間の変更を先に行います。*/
+    if (mf.ttl_flag)
+        memcached_touch(key, keysize, ttl_exptime(mf.ttl));
+
+    dbuf = memcached_get(key, keysize, &bytes, &flags, &cas);
+    if (dbuf == NULL) {
+        if (mf.quiet)
+            return 0;
+        return send_status(conn, "EN", "");
+    }
+    get_data_header(dbuf, NULL, &exptime);
+
+    ret_flags(fbuf, sizeof(fbuf), n, tokens, 2, key, cas, flags, bytes, exptime);
+    if (mf.value)
+        return send_value(conn, fbuf, &dbuf[DATABLOCK_HEADER_SIZE], bytes, dbuf);
+    result = send_status(conn, "HD", fbuf);
+    memcached_release(dbuf);
+    return result;
+}
+
+/*
+ * ms のエラー応答を送信します。
+ * <data block> は command_size() で受信済みのため、値がコマンドとして
+ * 処理されないように読み捨ててから応答します。
+ */
+static int ms_error(struct conn_t* conn, int bytes, const char* msg)
+{
+    if (conn_nptr(conn, bytes + 2) == NULL) {
+        conn->rpos += conn->rlen;
+        conn->rlen = 0;
+    }
+    return meta_error(conn, msg);
+}
+
+/* ms <key> <datalen> <flags>*
+ * <data block>
+ */
+static int ms_command(struct conn_t* conn,
+                      int n,
+                      struct token_t* tokens,
+                      const char* key,
+                      int keysize)
+{
+    struct meta_flags_t mf;
+    int bytes;
+    char* data;
+    char* buf;
+    int check_mode = CHECK_NONE;
+    int result;
+    const char* status;
+    int64 cas = 0;
+    uint exptime = 0;
+    char fbuf[512];
+    char keybuf[MAX_MEMCACHED_KEYSIZE];
+    char save[DATABLOCK_HEADER_SIZE];
+
+    if (n < 3 || token_int(tokens[2].value, tokens[2].length, &bytes) < 0)
+        return meta_error(conn, "bad data chunk");
+    if (bytes > MAX_META_DATALEN) {
+        /* <data block> は受信を待っていないため読み捨てられません。*/
+        meta_error(conn, "object too large for cache");
+        return META_CLOSE;
+    }
+    if (keysize > MAX_MEMCACHED_KEYSIZE)
+        return ms_error(conn, bytes, "bad command line format");
+
+    /* <data block> は memcached_ready() で受信済みのため
+       受信バッファにあるものをそのまま使用します。*/
+    data = conn_nptr(conn, bytes + 2);
+    if (data == NULL || memcmp(&data[bytes], "\r\n", 2) != 0)
+        return meta_error(conn, "bad data chunk");
+
+    if (parse_flags(conn, n, tokens, 3, MS_FLAGS, &mf) < 0)
+        return -1;
+
+    switch (mf.mode) {
+        case 'E': case 'e':
+            check_mode = CHECK_ADD;
+            break;
+        case 'R': case 'r':
+            check_mode = CHECK_REPLACE;
+            break;
+        case 'A': case 'a':
+        case 'P': case 'p':
+        case 'S': case 's':
+        case '\0':
+            break;
+        default:
+            return meta_error(conn, "invalid mode for ms");
+    }
+
+    if (mf.mode == 'A' || mf.mode == 'a' || mf.mode == 'P' || mf.mode == 'p') {
+        /* <flags> と有効期間は変更しません。*/
+        result = memcached_update(key, keysize, data, bytes,
+                                  (mf.mode == 'A' || mf.mode == 'a')? UPDATE_APPEND : UPDATE_PREPEND);
+        if (result == STORE_NOT_FOUND)
+            result = STORE_NOT_STORED;
+    } else {
+        /* キーとフラグはヘッダーで上書きされる場合があります。
+           フラグは memcached_datablock_release() で元に戻されます。*/
+        memcpy(keybuf, key, keysize);
+        buf = memcached_datablock(conn, data, bytes, mf.flags, ttl_exptime(mf.ttl), save);
+        if (buf == NULL) {
+            err_write("memcached: ms_command() no memory.");
+            return meta_server_error(conn, "out of memory");
+        }
+        result = memcached_store(keybuf, keysize, buf, DATABLOCK_HEADER_SIZE + bytes,
+                                 mf.cas_flag, mf.cas, check_mode);
+        memcached_datablock_release(buf, data, save);
+        if (check_mode == CHECK_ADD && result == STORE_EXISTS)
+            result = STORE_NOT_STORED;
+        else if (check_mode == CHECK_REPLACE && result == STORE_NOT_FOUND)
+            result = STORE_NOT_STORED;
+    }
+
+    if (result == STORE_TOO_LARGE)
+        return meta_server_error(conn, "object too large for cache");
+    if (result == STORE_NO_MEMORY)
+        return meta_server_error(conn, "out of memory");
+
+    if (result == STORE_STORED) {
+        if (mf.quiet)
+            return 0;
+        status = "HD";
+        /* c が指定された場合は新しい <cas unique> を返します。*/
+        if (has_flag(n, tokens, 3, 'c') && item_info(key, keysize, &cas, &exptime) < 0)
+            cas = 0;
+    } else if (result == STORE_EXISTS) {
+        status = "EX";
+    } else if (result == STORE_NOT_FOUND) {
+        status = "NF";
+    } else {
+        status = "NS";
+    }
+    ret_flags(fbuf, sizeof(fbuf), n, tokens, 3, key, cas, 0, 0, exptime);
+    return send_status(conn, status, fbuf);
+}
+
+/* md <key> <flags>*
+ */
+static int md_command(struct conn_t* conn,
+                      int n,
+                      struct token_t* tokens,
+                      const char* key,
+                      int keysize)
+{
+    struct meta_flags_t mf;
+    const char* status;
+    char fbuf[512];
+
+    if (parse_flags(conn, n, tokens, 2, MD_FLAGS, &mf) < 0)
+        return -1;
+
+    if (mf.cas_flag) {
+        int64 cas;
+        uint exptime;
+
+        if (item_info(key, keysize, &cas, &exptime) < 0)
+            status = "NF";
+        else if (cas != mf.cas)
+            status = "EX";
+        else
+            status = (memcached_delete(key, keysize) == 0)? "HD" : "NF";
+    } else {
+        status = (memcached_delete(key, keysize) == 0)? "HD" : "NF";
+    }
+
+    if (mf.quiet && status[0] != 'E')
+        return 0;
+    ret_flags(fbuf, sizeof(fbuf), n, tokens, 2, key, 0, 0, 0, 0);
+    return send_status(conn, status, fbuf);
+}
+
+/* ma <key> <flags>*
+ */
+static int ma_command(struct conn_t* conn,
+                      int n,
+                      struct token_t* tokens,
+                      const char* key,
+                      int keysize)
+{
+    struct meta_flags_t mf;
+    int mode;
+    uint64 val = 0;
+    int result = STORE_NOT_FOUND;
+    int retry;
+    int64 cas = 0;
+    uint exptime = 0;
+    char fbuf[512];
+
+    if (parse_flags(conn, n, tokens, 2, MA_FLAGS, &mf) < 0)
+        return -1;
+
+    switch (mf.mode) {
+        case 'I': case 'i': case '+': case '\0':
+            mode = MODE_INCR;
+            break;
+        case 'D': case 'd': case '-':
+            mode = MODE_DECR;
+            break;
+        default:
+            return meta_error(conn, "invalid mode for ma");
+    }
+
+    /* 他のスレッドと同時に作成した場合は再実行します。*/
+    for (retry = 0; retry < 3; retry++) {
+        result = memcached_incr(key, keysize, mode, mf.delta, &val);
+        if (result == STORE_NOT_FOUND && mf.vivify_flag) {
+            char buf[DATABLOCK_HEADER_SIZE + sizeof(uint64)];
+
+            set_data_header(buf, 0, ttl_exptime(mf.vivify_ttl));
+            memcpy(&buf[DATABLOCK_HEADER_SIZE], &mf.initial, sizeof(uint64));
+            result = memcached_store(key, keysize, buf, sizeof(buf), 0, 0, CHECK_ADD);
+            val = mf.initial;
+        }
+        if (result != STORE_EXISTS)
+            break;
+    }
+
+    if (result == STORE_BAD_VALUE)
+        return meta_error(conn, "cannot increment or decrement non-numeric value");
+    if (result == STORE_NOT_FOUND) {
+        if (mf.quiet)
+            return 0;
+        ret_flags(fbuf, sizeof(fbuf), n, tokens, 2, key, 0, 0, 0, 0);
+        return send_status(conn, "NF", fbuf);
+    }
+    if (result != STORE_STORED) {
+        ret_flags(fbuf, sizeof(fbuf), n, tokens, 2, key, 0, 0, 0, 0);
+        return send_status(conn, (result == STORE_EXISTS)? "EX" : "NS", fbuf);
+    }
+
+    if (mf.ttl_flag)
+        memcached_touch(key, keysize, ttl_exptime(mf.ttl));
+    if (mf.quiet)
+        return 0;
+
+    if (has_flag(n, tokens, 2, 'c') || has_flag(n, tokens, 2, 't'))
+        item_info(key, keysize, &cas, &exptime);
+    ret_flags(fbuf, sizeof(fbuf), n, tokens, 2, key, cas, 0, 0, exptime);
+    if (mf.value) {
+        char vbuf[32];
+
+        snprintf(vbuf, sizeof(vbuf), "%llu", val);
+        return send_value(conn, fbuf, vbuf, strlen(vbuf), NULL);
+    }
+    return send_status(conn, "HD", fbuf);
+}
+
+/*
+ * メタコマンドを処理します。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー
+ */
+int meta_command(struct conn_t* conn, int n, struct token_t* tokens)
+{
+    const char* cmd = tokens[0].value;
+    const char* key;
+    int keysize;
+
+    if (strcmp(cmd, "mn") == 0)
+        return send_status(conn, "MN", "");
+
+    if (n < 2)
+        return meta_error(conn, "bad command line format");
+    key = tokens[1].value;
+    keysize = tokens[1].length;
+
+    /* ms はキーの長さを <data block> を読み捨ててから確認します。*/
+    if (strcmp(cmd, "ms") == 0)
+        return ms_command(conn, n, tokens, key, keysize);
+    if (keysize > MAX_MEMCACHED_KEYSIZE)
+        return meta_error(conn, "bad command line format");
+
+    if (strcmp(cmd, "mg") == 0)
+        return mg_command(conn, n, tokens, key, keysize);
+    if (strcmp(cmd, "md") == 0)
+        return md_command(conn, n, tokens, key, keysize);
+    if (strcmp(cmd, "ma") == 0)
+        return ma_command(conn, n, tokens, key, keysize);
+    return meta_error(conn, "bad command line format");
+}
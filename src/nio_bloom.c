@@ -0,0 +1,243 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * キーの存在判定フィルタ(counting Bloom filter)
+ *
+ * データベースに保存されているすべてのキーを登録しておき、
+ * 存在しないキーの get や add ではデータベースを参照せずに
+ * 存在しないと判定します。
+ *
+ * カウンタは 4bit で、32bit のワードに 8 個ずつ格納します。
+ * キーの 64bit ハッシュ値から double hashing で BLOOM_HASHES 個の
+ * カウンタを選び、登録で加算、削除で減算します。すべてのカウンタが
+ * 0 でなければ「存在する可能性がある」、0 があれば「存在しない」です。
+ * カウンタの更新は CAS で行い、ロックは使用しません。
+ *
+ * 誤って「存在しない」と判定しないように次の順序で更新します。
+ *   ・登録はデータベースに書き込む前に行います。
+ *   ・削除はデータベースから削除できた場合のみ、削除した後に行います。
+ * 上書きでカウンタが増え続けないように、登録はデータベースにない
+ * キーだけ行います。存在の確認から書き込み・削除までは chunk_lock() で
+ * キーごとに排他するため、同じキーの登録と削除が前後することはありません。
+ * 上限(15)に達したカウンタは減算しません(他のキーと共有するカウンタが
+ * 上限に達すると、そのカウンタは flush_all または再起動まで残ります)。
+ *
+ * フィルタは起動時にデータベースの全キーをカーソルで走査して作成します。
+ * カウンタ数は nio.bloom_keys の BLOOM_COUNTERS_PER_KEY 倍以上の
+ * ２のべき乗で、予定のキー数で誤判定の確率は約 1% です。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nio_server.h"
+
+#ifdef _WIN32
+#define CAS32(var, old, n)      (InterlockedCompareExchange((volatile LONG*)&(var), (LONG)(n), (LONG)(old)) == (LONG)(old))
+#else
+#define CAS32(var, old, n)      __sync_bool_compare_and_swap(&(var), (old), (n))
+#endif
+
+#define BLOOM_HASHES            7       /* キーごとのカウンタ数 */
+#define BLOOM_COUNTERS_PER_KEY  10      /* 予定のキー数あたりのカウンタ数 */
+#define BLOOM_COUNTER_MAX       15      /* カウンタの上限 */
+
+static volatile uint* bloom_words = NULL;   /* カウンタ(4bit x 8) */
+static uint64 bloom_mask;                   /* カウンタ数 - 1 */
+static int64 bloom_bytes;                   /* bloom_words のサイズ */
+
+/* FNV-1a(64bit) */
+static uint64 key_hash64(const char* key, int keysize)
+{
+    uint64 h = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < keysize; i++) {
+        h ^= (uchar)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * カウンタに delta(1 または -1)を加えます。
+ * 上限に達したカウンタは変更しません。
+ */
+static void counter_add(uint64 index, int delta)
+{
+    volatile uint* word = &bloom_words[index >> 3];
+    int shift = (int)(index & 7) * 4;
+
+    while (1) {
+        uint old = *word;
+        uint c = (old >> shift) & 0xf;
+        uint n;
+
+        if (c == BLOOM_COUNTER_MAX || (delta < 0 && c == 0))
+            return;
+        if (delta > 0)
+            n = old + (1U << shift);
+        else
+            n = old - (1U << shift);
+        if (CAS32(*word, old, n))
+            return;
+    }
+}
+
+static void key_add(const char* key, int keysize, int delta)
+{
+    uint64 h = key_hash64(key, keysize);
+    uint64 h2 = (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++)
+        counter_add((h + i * h2) & bloom_mask, delta);
+}
+
+/*
+ * データベースの全キーを登録します。
+ */
+static int load_keys(struct nio_t* nio)
+{
+    struct nio_cursor_t* cur;
+    int64 count = 0;
+
+    cur = nio_cursor_open(nio);
+    if (cur == NULL)
+        return 0;   /* データがありません */
+
+    while (1) {
+        int keysize;
+        char key[MAX_MEMCACHED_KEYSIZE+1];
+
+        keysize = nio_cursor_key(cur, key, sizeof(key));
+        if (keysize < 1 || keysize > (int)sizeof(key)) {
+            err_write("bloom_initialize: nio_cursor_key error.");
+            nio_cursor_close(cur);
+            return -1;
+        }
+        key_add(key, keysize, 1);
+        count++;
+        if (nio_cursor_next(cur) != 0)
+            break;
+    }
+    nio_cursor_close(cur);
+    TRACE("bloom filter: %lld keys loaded.\n", count);
+    return 0;
+}
+
+/*
+ * フィルタを作成してデータベースのキーを登録します。
+ *
+ * keys: 予定のキー数
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー
+ */
+int bloom_initialize(struct nio_t* nio, int keys)
+{
+    uint64 n = 8;
+
+    while (n < (uint64)keys * BLOOM_COUNTERS_PER_KEY)
+        n <<= 1;
+    bloom_bytes = (int64)(n / 8 * sizeof(uint));
+    bloom_words = (volatile uint*)calloc((size_t)(n / 8), sizeof(uint));
+    if (bloom_words == NULL) {
+        err_write("bloom_initialize: no memory size=%lld.", bloom_bytes);
+        return -1;
+    }
+    bloom_mask = n - 1;
+
+    if (load_keys(nio) < 0) {
+        bloom_finalize();
+        return -1;
+    }
+    return 0;
+}
+
+void bloom_finalize()
+{
+    if (bloom_words) {
+        free((void*)bloom_words);
+        bloom_words = NULL;
+    }
+}
+
+/*
+ * キーを登録します。データベースに書き込む前に呼び出します。
+ */
+void bloom_add(const char* key, int keysize)
+{
+    key_add(key, keysize, 1);
+}
+
+/*
+ * キーの登録を取り消します。
+ * データベースから削除できた場合のみ、削除した後に呼び出します。
+ */
+void bloom_remove(const char* key, int keysize)
+{
+    key_add(key, keysize, -1);
+}
+
+/*
+ * キーが存在する可能性があるかを判定します。
+ *
+ * 戻り値
+ *  0: 存在しない
+ *  1: 存在する可能性がある
+ */
+int bloom_maybe(const char* key, int keysize)
+{
+    uint64 h = key_hash64(key, keysize);
+    uint64 h2 = (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        uint64 index = (h + i * h2) & bloom_mask;
+
+        if (((bloom_words[index >> 3] >> ((index & 7) * 4)) & 0xf) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * すべてのキーの登録を取り消します(flush_all)。
+ */
+void bloom_clear()
+{
+    memset((void*)bloom_words, 0, (size_t)bloom_bytes);
+}
+
+/*
+ * フィルタのサイズ(バイト数)を返します。
+ */
+int64 bloom_size()
+{
+    return bloom_bytes;
+}
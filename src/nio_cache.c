@@ -0,0 +1,497 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * ホットオブジェクトキャッシュ
+ *
+ * データベース(nestalib)から読み込んだデータブロックをメモリに保持して、
+ * 頻繁に参照されるキーの get ではデータベースを参照しないようにします。
+ *
+ * キャッシュはキーのハッシュ値で CACHE_SHARDS 個のシャードに分割され、
+ * シャードごとのロックで排他制御を行います。各シャードは nio.cache_size を
+ * シャード数で割ったサイズまでの項目を保持します。
+ *
+ * 追い出しは CLOCK で行います。参照された項目は参照ビットが立てられ、
+ * 針が通過するときに参照ビットが落ちていた項目が追い出されます。
+ * 新しい項目の追加で追い出しが必要な場合は TinyLFU で判定します。
+ * シャードごとにキーの参照頻度を count-min sketch で数えておき、
+ * 追加する項目の頻度が追い出される項目の頻度より高い場合のみ追加します。
+ * １回だけ参照されるキーが頻繁に参照されるキーを追い出すことはありません。
+ * 頻度は一定回数ごとに半分にして、古い参照の影響を減らします。
+ *
+ * 項目は参照カウントを持ち、get の呼び出し元には項目のデータが
+ * そのまま返されます(コピーは行いません)。呼び出し元は送信後に
+ * cache_release() で解放します。キャッシュから外された項目は
+ * 参照がなくなった時点で解放されます。
+ *
+ * データベースを更新したときは cache_remove() で項目を無効にします。
+ * シャードは無効化の世代番号を持ち、データベースを読み込んでから
+ * キャッシュに追加するまでの間に無効化された場合は追加しません。
+ * 古いデータがキャッシュに残ることはありません。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include "nio_server.h"
+
+#define CACHE_SHARDS        32          /* シャード数(２のべき乗) */
+#define CACHE_BUCKETS_MIN   1024        /* シャードのハッシュ表の初期サイズ */
+#define CACHE_ITEM_RATIO    4           /* 項目の最大サイズ(シャードのサイズに対する比) */
+#define CACHE_SKETCH_SIZE   8192        /* count-min sketch のカウンタ数(２のべき乗) */
+#define CACHE_SKETCH_DEPTH  4           /* count-min sketch の行数 */
+#define CACHE_FREQ_MAX      15          /* 頻度の最大値 */
+
+struct cache_item_t {
+    struct cache_item_t* hnext;         /* ハッシュ表の次の項目 */
+    struct cache_item_t* prev;          /* CLOCK のリング */
+    struct cache_item_t* next;
+    volatile int64 refcnt;              /* 参照カウント(キャッシュの参照を含む) */
+    int64 cas;
+    uint hash;
+    int keysize;
+    int dsize;
+    int visited;                        /* CLOCK の参照ビット */
+    char data[1];                       /* データブロック(dsize) + キー(keysize) */
+};
+
+struct cache_shard_t {
+    CS_DEF(lock);
+    struct cache_item_t** buckets;      /* ハッシュ表 */
+    uint mask;                          /* ハッシュ表のサイズ - 1 */
+    struct cache_item_t* hand;          /* CLOCK の針 */
+    int64 bytes;                        /* 保持している項目のサイズ */
+    int64 items;                        /* 保持している項目数 */
+    uint gen;                           /* 無効化の世代番号 */
+    int samples;                        /* 頻度を半分にするまでの参照数 */
+    uchar sketch[CACHE_SKETCH_SIZE];    /* 参照頻度 */
+    int64 hits;
+    int64 misses;
+    int64 evictions;
+    int64 rejects;
+};
+
+static struct cache_shard_t* cache_shards = NULL;
+static int64 shard_capacity;            /* シャードの最大サイズ */
+
+#define ITEM_CHARGE(item)   ((int64)sizeof(struct cache_item_t) + (item)->dsize + (item)->keysize)
+#define ITEM_KEY(item)      (&(item)->data[(item)->dsize])
+#define DATA_ITEM(data)     ((struct cache_item_t*)((char*)(data) - offsetof(struct cache_item_t, data)))
+
+/* FNV-1a */
+static uint key_hash(const char* key, int keysize)
+{
+    uint h = 2166136261U;
+    int i;
+
+    for (i = 0; i < keysize; i++) {
+        h ^= (uchar)key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static struct cache_shard_t* get_shard(uint hash)
+{
+    return &cache_shards[hash & (CACHE_SHARDS - 1)];
+}
+
+/*
+ * count-min sketch の i 行目のカウンタの位置を求めます。
+ */
+static uint sketch_index(uint hash, int i)
+{
+    uint h2 = (hash >> 16) | (hash << 16);
+
+    h2 = h2 * 0x9E3779B1U + 1;
+    return (hash + (uint)i * h2) & (CACHE_SKETCH_SIZE - 1);
+}
+
+static void sketch_add(struct cache_shard_t* s, uint hash)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SKETCH_DEPTH; i++) {
+        uchar* c = &s->sketch[sketch_index(hash, i)];
+
+        if (*c < CACHE_FREQ_MAX)
+            (*c)++;
+    }
+    if (--s->samples <= 0) {
+        /* 古い参照の影響を減らすため頻度を半分にします。*/
+        for (i = 0; i < CACHE_SKETCH_SIZE; i++)
+            s->sketch[i] >>= 1;
+        s->samples = CACHE_SKETCH_SIZE * 8;
+    }
+}
+
+static int sketch_freq(struct cache_shard_t* s, uint hash)
+{
+    int freq = CACHE_FREQ_MAX;
+    int i;
+
+    for (i = 0; i < CACHE_SKETCH_DEPTH; i++) {
+        int c = s->sketch[sketch_index(hash, i)];
+
+        if (c < freq)
+            freq = c;
+    }
+    return freq;
+}
+
+static void item_release(struct cache_item_t* item)
+{
+    if (ATOMIC_ADD(item->refcnt, -1) == 1)
+        free(item);
+}
+
+static struct cache_item_t* find_item(struct cache_shard_t* s, uint hash,
+                                      const char* key, int keysize)
+{
+    struct cache_item_t* item;
+
+    for (item = s->buckets[(hash >> 5) & s->mask]; item; item = item->hnext) {
+        if (item->hash == hash && item->keysize == keysize &&
+            memcmp(ITEM_KEY(item), key, keysize) == 0)
+            return item;
+    }
+    return NULL;
+}
+
+/*
+ * ハッシュ表のサイズを２倍にします。
+ * 確保できない場合はそのままのサイズで使用します。
+ */
+static void grow_buckets(struct cache_shard_t* s)
+{
+    uint newmask = (s->mask << 1) | 1;
+    struct cache_item_t** nb;
+    uint i;
+
+    nb = (struct cache_item_t**)calloc((size_t)newmask + 1, sizeof(struct cache_item_t*));
+    if (nb == NULL)
+        return;
+    for (i = 0; i <= s->mask; i++) {
+        struct cache_item_t* item = s->buckets[i];
+
+        while (item) {
+            struct cache_item_t* next = item->hnext;
+            uint idx = (item->hash >> 5) & newmask;
+
+            item->hnext = nb[idx];
+            nb[idx] = item;
+            item = next;
+        }
+    }
+    free(s->buckets);
+    s->buckets = nb;
+    s->mask = newmask;
+}
+
+static void link_item(struct cache_shard_t* s, struct cache_item_t* item)
+{
+    uint idx = (item->hash >> 5) & s->mask;
+
+    item->hnext = s->buckets[idx];
+    s->buckets[idx] = item;
+
+    /* 針の直前(最後に調べられる位置)に追加します。*/
+    if (s->hand == NULL) {
+        item->prev = item->next = item;
+        s->hand = item;
+    } else {
+        item->next = s->hand;
+        item->prev = s->hand->prev;
+        s->hand->prev->next = item;
+        s->hand->prev = item;
+    }
+    item->visited = 0;
+    s->bytes += ITEM_CHARGE(item);
+    s->items++;
+    if (s->items > (int64)s->mask + 1)
+        grow_buckets(s);
+}
+
+/*
+ * 項目をキャッシュから外します。
+ * キャッシュの参照は呼び出し元で解放します。
+ */
+static void unlink_item(struct cache_shard_t* s, struct cache_item_t* item)
+{
+    struct cache_item_t** pp = &s->buckets[(item->hash >> 5) & s->mask];
+
+    while (*pp != item)
+        pp = &(*pp)->hnext;
+    *pp = item->hnext;
+
+    if (item->next == item) {
+        s->hand = NULL;
+    } else {
+        item->prev->next = item->next;
+        item->next->prev = item->prev;
+        if (s->hand == item)
+            s->hand = item->next;
+    }
+    s->bytes -= ITEM_CHARGE(item);
+    s->items--;
+}
+
+/*
+ * CLOCK で追い出す項目を選びます。
+ * 参照ビットが立っている項目はビットを落として次に進みます。
+ */
+static struct cache_item_t* clock_victim(struct cache_shard_t* s)
+{
+    while (s->hand->visited) {
+        s->hand->visited = 0;
+        s->hand = s->hand->next;
+    }
+    return s->hand;
+}
+
+/*
+ * キャッシュを初期化します。
+ *
+ * size_mb: キャッシュのサイズ(MB)
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー
+ */
+int cache_initialize(int size_mb)
+{
+    int i;
+
+    cache_shards = (struct cache_shard_t*)calloc(CACHE_SHARDS, sizeof(struct cache_shard_t));
+    if (cache_shards == NULL) {
+        err_write("cache_initialize: no memory.");
+        return -1;
+    }
+    shard_capacity = (int64)size_mb * 1024 * 1024 / CACHE_SHARDS;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard_t* s = &cache_shards[i];
+
+        s->buckets = (struct cache_item_t**)calloc(CACHE_BUCKETS_MIN, sizeof(struct cache_item_t*));
+        if (s->buckets == NULL) {
+            err_write("cache_initialize: no memory.");
+            while (--i >= 0)
+                free(cache_shards[i].buckets);
+            free(cache_shards);
+            cache_shards = NULL;
+            return -1;
+        }
+        s->mask = CACHE_BUCKETS_MIN - 1;
+        s->samples = CACHE_SKETCH_SIZE * 8;
+        CS_INIT(&s->lock);
+    }
+    return 0;
+}
+
+void cache_finalize()
+{
+    int i;
+
+    if (cache_shards == NULL)
+        return;
+    cache_clear();
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        if (cache_shards[i].buckets)
+            free(cache_shards[i].buckets);
+    }
+    free(cache_shards);
+    cache_shards = NULL;
+}
+
+/*
+ * キーのデータブロックをキャッシュから取得します。
+ * 項目がない場合は gen に無効化の世代番号を設定して NULL を返します。
+ * gen は cache_add() に渡します。
+ *
+ * dsize: データブロックのサイズが設定されます。
+ * cas: <cas unique> が設定されます。
+ *
+ * 戻り値
+ *  データブロック(cache_release() で解放します)
+ *  キャッシュにない場合は NULL
+ */
+char* cache_get(const char* key, int keysize, int* dsize, int64* cas, uint* gen)
+{
+    uint hash = key_hash(key, keysize);
+    struct cache_shard_t* s = get_shard(hash);
+    struct cache_item_t* item;
+
+    CS_START(&s->lock);
+    sketch_add(s, hash);
+    item = find_item(s, hash, key, keysize);
+    if (item == NULL) {
+        s->misses++;
+        *gen = s->gen;
+        CS_END(&s->lock);
+        return NULL;
+    }
+    item->visited = 1;
+    ATOMIC_ADD(item->refcnt, 1);
+    s->hits++;
+    CS_END(&s->lock);
+
+    *dsize = item->dsize;
+    if (cas)
+        *cas = item->cas;
+    return item->data;
+}
+
+/*
+ * データベースから読み込んだデータブロックをコピーした項目を作成して、
+ * 参照頻度から判定してキャッシュに追加します。
+ * cache_get() で世代番号を取得した後にキーが無効化されている場合は
+ * 追加しません。
+ *
+ * 戻り値
+ *  項目のデータブロック(キャッシュに追加されなかった場合も
+ *  cache_release() で解放します)
+ *  メモリが確保できない場合は NULL
+ */
+char* cache_add(const char* key, int keysize, const char* dbuf, int dsize, int64 cas, uint gen)
+{
+    uint hash = key_hash(key, keysize);
+    struct cache_shard_t* s = get_shard(hash);
+    struct cache_item_t* item;
+    int64 charge;
+
+    item = (struct cache_item_t*)malloc(sizeof(struct cache_item_t) + dsize + keysize);
+    if (item == NULL)
+        return NULL;
+    item->refcnt = 1;
+    item->cas = cas;
+    item->hash = hash;
+    item->keysize = keysize;
+    item->dsize = dsize;
+    memcpy(item->data, dbuf, dsize);
+    memcpy(ITEM_KEY(item), key, keysize);
+
+    charge = ITEM_CHARGE(item);
+    if (charge > shard_capacity / CACHE_ITEM_RATIO)
+        return item->data;
+
+    CS_START(&s->lock);
+    if (s->gen != gen || find_item(s, hash, key, keysize)) {
+        /* 更新されたか他のスレッドが追加しています。*/
+        CS_END(&s->lock);
+        return item->data;
+    }
+    if (s->bytes + charge > shard_capacity) {
+        /* 追い出される項目より参照頻度が高い場合のみ追加します。*/
+        if (sketch_freq(s, hash) <= sketch_freq(s, clock_victim(s)->hash)) {
+            s->rejects++;
+            CS_END(&s->lock);
+            return item->data;
+        }
+        while (s->hand && s->bytes + charge > shard_capacity) {
+            struct cache_item_t* victim = clock_victim(s);
+
+            unlink_item(s, victim);
+            item_release(victim);
+            s->evictions++;
+        }
+    }
+    ATOMIC_ADD(item->refcnt, 1);    /* キャッシュの参照 */
+    link_item(s, item);
+    CS_END(&s->lock);
+    return item->data;
+}
+
+/*
+ * cache_get() または cache_add() で取得したデータブロックを解放します。
+ */
+void cache_release(void* data)
+{
+    item_release(DATA_ITEM(data));
+}
+
+/*
+ * キーの項目を無効にします。
+ * データベースを更新した後に呼び出します。
+ */
+void cache_remove(const char* key, int keysize)
+{
+    uint hash = key_hash(key, keysize);
+    struct cache_shard_t* s = get_shard(hash);
+    struct cache_item_t* item;
+
+    CS_START(&s->lock);
+    s->gen++;
+    item = find_item(s, hash, key, keysize);
+    if (item)
+        unlink_item(s, item);
+    CS_END(&s->lock);
+    if (item)
+        item_release(item);
+}
+
+/*
+ * すべての項目を無効にします。
+ */
+void cache_clear()
+{
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard_t* s = &cache_shards[i];
+
+        CS_START(&s->lock);
+        s->gen++;
+        while (s->hand) {
+            struct cache_item_t* item = s->hand;
+
+            unlink_item(s, item);
+            item_release(item);
+        }
+        CS_END(&s->lock);
+    }
+}
+
+/*
+ * キャッシュの統計情報を取得します。
+ */
+void cache_stats(struct cache_stats_t* st)
+{
+    int i;
+
+    memset(st, 0, sizeof(struct cache_stats_t));
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard_t* s = &cache_shards[i];
+
+        CS_START(&s->lock);
+        st->hits += s->hits;
+        st->misses += s->misses;
+        st->items += s->items;
+        st->bytes += s->bytes;
+        st->evictions += s->evictions;
+        st->rejects += s->rejects;
+        CS_END(&s->lock);
+    }
+}
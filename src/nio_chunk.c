@@ -0,0 +1,613 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * 追記用の分割データ
+ *
+ * nio.append_chunks が指定された場合、append と prepend はデータ全体を
+ * 書き直さずに、追加する値を別のレコード(セグメント)として保存します。
+ * キーのレコードにはデータブロックのヘッダーとセグメントの一覧だけを
+ * 保存するため、追記で書き込むのは追加した値と一覧の大きさになります。
+ *
+ * キーのレコード(ヘッダーの先頭バイトに DATA_HEADER_CHUNKED を設定)
+ *  [データブロックのヘッダー][セグメント数][値の合計サイズ]
+ *  [セグメントID][サイズ] ... (セグメント数分、値の順)
+ *
+ * セグメントのレコード
+ *  キー: CHUNK_KEY_PREFIX + セグメントID(64bit)
+ *  値:   データブロックのヘッダー(<flags> と <exptime> は 0) + 値
+ *
+ * セグメントIDは起動時の時刻(マイクロ秒)から始まる連番で、キーに
+ * 依存しないためセグメントのキーは長さが一定です。<flags> と <exptime> は
+ * キーのレコードのみが持ち、touch はキーのレコードだけを更新します。
+ *
+ * CHUNK_MIN_SIZE より小さい値は従来どおり全体を書き直します。
+ * 読み込みではセグメントを順に連結したデータブロックを作成します
+ * (memcached_get() で取得されるデータは連結後のデータです)。
+ *
+ * セグメント数が nio.append_chunks を超えると、キーを圧縮スレッドの
+ * キューに追加します。圧縮スレッドはすべてのセグメントを１つに連結して
+ * 書き直します。キーのレコードは cas で更新するため、圧縮中に更新された
+ * キーは圧縮しません(次の追記で再度キューに追加されます)。
+ * 圧縮が追いつかずにセグメント数が CHUNK_MAX_SEGMENTS に達した場合は、
+ * 追記するときに連結して書き直します。
+ *
+ * 不要になったセグメントは、キーのレコードを更新した後に削除します。
+ * 読み込み中にセグメントが削除された場合は、キーのレコードから
+ * 読み直します。
+ *
+ * キーのレコードを読んでから上書き・削除するまでの間に追記や圧縮で
+ * セグメントが追加されると、そのセグメントは削除されずに残ります。
+ * そのため追記と圧縮によるキーのレコードの更新と、set, delete などの
+ * 読み込みから上書き・削除までは chunk_lock() でキーごとに排他します
+ * (キーのハッシュ値で分割した CHUNK_LOCKS 個のロックを使用します)。
+ * get などの読み込みはロックしません。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nio_server.h"
+
+#define CHUNK_KEY_SIZE          (CHUNK_KEY_PREFIX_SIZE + sizeof(int64))
+
+#define CHUNK_HEAD_SIZE         (DATABLOCK_HEADER_SIZE + sizeof(uint) + sizeof(uint))
+#define CHUNK_ENTRY_SIZE        (sizeof(int64) + sizeof(uint))
+
+#define CHUNK_MAX_SEGMENTS      1024    /* 追記時に連結するセグメント数 */
+#define CHUNK_QUEUE_MAX         65536   /* 圧縮キューの最大件数 */
+#define CHUNK_LOCKS             256     /* キーのロック数(２のべき乗) */
+
+struct chunk_req_t {
+    struct chunk_req_t* next;
+    int keysize;
+    char key[1];
+};
+
+static CS_DEF(queue_lock);
+static CS_DEF(key_locks[CHUNK_LOCKS]);
+static struct chunk_req_t* queue_head = NULL;
+static struct chunk_req_t* queue_tail = NULL;
+static int queue_count = 0;
+
+static volatile int64 chunk_seq;
+static volatile int compactor_stop = 0;
+static volatile int compactor_running = 0;
+
+static void sleep_msec(int msec)
+{
+#ifdef _WIN32
+    Sleep(msec);
+#else
+    usleep(msec * 1000);
+#endif
+}
+
+/* FNV-1a */
+static uint key_hash(const char* key, int keysize)
+{
+    uint h = 2166136261U;
+    int i;
+
+    for (i = 0; i < keysize; i++) {
+        h ^= (uchar)key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+ * キーのセグメントの一覧を更新する処理を排他します。
+ */
+void chunk_lock(const char* key, int keysize)
+{
+    CS_START(&key_locks[key_hash(key, keysize) & (CHUNK_LOCKS - 1)]);
+}
+
+void chunk_unlock(const char* key, int keysize)
+{
+    CS_END(&key_locks[key_hash(key, keysize) & (CHUNK_LOCKS - 1)]);
+}
+
+static void segment_key(char* skey, int64 id)
+{
+    memcpy(skey, CHUNK_KEY_PREFIX, CHUNK_KEY_PREFIX_SIZE);
+    memcpy(&skey[CHUNK_KEY_PREFIX_SIZE], &id, sizeof(int64));
+}
+
+static uint head_count(const char* head)
+{
+    uint count;
+
+    memcpy(&count, &head[DATABLOCK_HEADER_SIZE], sizeof(uint));
+    return count;
+}
+
+static void get_entry(const char* head, uint index, int64* id, uint* bytes)
+{
+    const char* p = &head[CHUNK_HEAD_SIZE + index * CHUNK_ENTRY_SIZE];
+
+    memcpy(id, p, sizeof(int64));
+    memcpy(bytes, p + sizeof(int64), sizeof(uint));
+}
+
+static void set_entry(char* head, uint index, int64 id, uint bytes)
+{
+    char* p = &head[CHUNK_HEAD_SIZE + index * CHUNK_ENTRY_SIZE];
+
+    memcpy(p, &id, sizeof(int64));
+    memcpy(p + sizeof(int64), &bytes, sizeof(uint));
+}
+
+/*
+ * セグメント数 count のキーのレコードを作成します。
+ * ヘッダーの <flags> と <exptime> は src からコピーします。
+ * セグメントの一覧は呼び出し元で設定します。
+ */
+static char* head_alloc(const char* src, uint count, uint total, int* hsize)
+{
+    char* head;
+    uint flags;
+    uint exptime;
+
+    *hsize = (int)(CHUNK_HEAD_SIZE + count * CHUNK_ENTRY_SIZE);
+    head = (char*)malloc(*hsize);
+    if (head == NULL)
+        return NULL;
+    get_data_header(src, &flags, &exptime);
+    set_data_header(head, flags, exptime);
+    head[0] |= DATA_HEADER_CHUNKED;
+    memcpy(&head[DATABLOCK_HEADER_SIZE], &count, sizeof(uint));
+    memcpy(&head[DATABLOCK_HEADER_SIZE+sizeof(uint)], &total, sizeof(uint));
+    return head;
+}
+
+/*
+ * 値をセグメントとして保存します。
+ * buf はデータブロックで、ヘッダーの内容は変更されます。
+ *
+ * 戻り値
+ *  STORE_XXX
+ */
+static int put_segment(int64 id, char* buf, int size)
+{
+    char skey[CHUNK_KEY_SIZE];
+
+    set_data_header(buf, 0, 0);
+    segment_key(skey, id);
+    return nio_put(g_conf->nio_db, skey, CHUNK_KEY_SIZE, buf, size);
+}
+
+static void delete_segment(int64 id)
+{
+    char skey[CHUNK_KEY_SIZE];
+
+    segment_key(skey, id);
+    nio_delete(g_conf->nio_db, skey, CHUNK_KEY_SIZE);
+}
+
+static int64 new_segment_id()
+{
+    return ATOMIC_ADD(chunk_seq, 1);
+}
+
+/*
+ * 分割されたデータの値の合計サイズを返します。
+ */
+int chunk_bytes(const char* head)
+{
+    uint total;
+
+    memcpy(&total, &head[DATABLOCK_HEADER_SIZE+sizeof(uint)], sizeof(uint));
+    return (int)total;
+}
+
+/*
+ * セグメントを連結したデータブロックを作成します。
+ * データブロックの先頭バイトには DATA_HEADER_ALLOCATED が設定されます。
+ *
+ * dsize: データブロックのサイズが設定されます。
+ *
+ * 戻り値
+ *  malloc() で確保したデータブロック
+ *  セグメントがない(他のスレッドが更新した)場合とメモリ不足の場合は NULL
+ */
+char* chunk_load(const char* head, int hsize, int* dsize)
+{
+    uint count = head_count(head);
+    int total = chunk_bytes(head);
+    char* buf;
+    char* p;
+    uint i;
+
+    if (hsize != (int)(CHUNK_HEAD_SIZE + count * CHUNK_ENTRY_SIZE))
+        return NULL;
+    buf = (char*)malloc(DATABLOCK_HEADER_SIZE + total);
+    if (buf == NULL) {
+        err_write("chunk_load: no memory.");
+        return NULL;
+    }
+    memcpy(buf, head, DATABLOCK_HEADER_SIZE);
+    buf[0] = (buf[0] & ~DATA_HEADER_CHUNKED) | DATA_HEADER_ALLOCATED;
+
+    p = &buf[DATABLOCK_HEADER_SIZE];
+    for (i = 0; i < count; i++) {
+        int64 id;
+        uint bytes;
+        char skey[CHUNK_KEY_SIZE];
+        char* sbuf;
+        int ssize;
+
+        get_entry(head, i, &id, &bytes);
+        segment_key(skey, id);
+        sbuf = nio_aget(g_conf->nio_db, skey, CHUNK_KEY_SIZE, &ssize);
+        if (sbuf == NULL) {
+            free(buf);
+            return NULL;
+        }
+        if (ssize != (int)(DATABLOCK_HEADER_SIZE + bytes) ||
+            p + bytes > &buf[DATABLOCK_HEADER_SIZE + total]) {
+            nio_free(g_conf->nio_db, sbuf);
+            free(buf);
+            return NULL;
+        }
+        memcpy(p, &sbuf[DATABLOCK_HEADER_SIZE], bytes);
+        nio_free(g_conf->nio_db, sbuf);
+        p += bytes;
+    }
+    *dsize = (int)(p - buf);
+    return buf;
+}
+
+/*
+ * キーのレコードにあるすべてのセグメントを削除します。
+ * キーのレコードを上書きまたは削除した後に呼び出します。
+ */
+void chunk_remove(const char* head, int hsize)
+{
+    uint count = head_count(head);
+    uint i;
+
+    if (hsize != (int)(CHUNK_HEAD_SIZE + count * CHUNK_ENTRY_SIZE))
+        return;
+    for (i = 0; i < count; i++) {
+        int64 id;
+        uint bytes;
+
+        get_entry(head, i, &id, &bytes);
+        delete_segment(id);
+    }
+}
+
+static void compact_request(const char* key, int keysize)
+{
+    struct chunk_req_t* req;
+
+    if (! compactor_running || queue_count >= CHUNK_QUEUE_MAX)
+        return;
+    req = (struct chunk_req_t*)malloc(sizeof(struct chunk_req_t) + keysize);
+    if (req == NULL) {
+        err_write("chunk: compact_request() no memory.");
+        return;
+    }
+    req->next = NULL;
+    req->keysize = keysize;
+    memcpy(req->key, key, keysize);
+
+    CS_START(&queue_lock);
+    if (queue_tail)
+        queue_tail->next = req;
+    else
+        queue_head = req;
+    queue_tail = req;
+    queue_count++;
+    CS_END(&queue_lock);
+}
+
+/*
+ * すべてのセグメントと追加する値(data が NULL でない場合)を連結して
+ * １つのセグメントとして書き直します。
+ *
+ * 戻り値
+ *  STORE_XXX
+ */
+static int merge(const char* key, int keysize, const char* head, int hsize, int64 cas,
+                 const char* data, int bytes, int mode)
+{
+    char* buf;
+    char* nhead;
+    int dsize;
+    int nsize;
+    int64 id;
+    int result;
+
+    buf = chunk_load(head, hsize, &dsize);
+    if (buf == NULL)
+        return STORE_EXISTS;
+    if (data) {
+        char* tbuf = (char*)realloc(buf, dsize + bytes);
+
+        if (tbuf == NULL) {
+            free(buf);
+            err_write("chunk: merge() no memory.");
+            return STORE_NO_MEMORY;
+        }
+        buf = tbuf;
+        if (mode == UPDATE_PREPEND) {
+            memmove(&buf[DATABLOCK_HEADER_SIZE+bytes],
+                    &buf[DATABLOCK_HEADER_SIZE],
+                    dsize-DATABLOCK_HEADER_SIZE);
+            memcpy(&buf[DATABLOCK_HEADER_SIZE], data, bytes);
+        } else {
+            memcpy(&buf[dsize], data, bytes);
+        }
+        dsize += bytes;
+    }
+
+    nhead = head_alloc(head, 1, dsize - DATABLOCK_HEADER_SIZE, &nsize);
+    if (nhead == NULL) {
+        free(buf);
+        err_write("chunk: merge() no memory.");
+        return STORE_NO_MEMORY;
+    }
+    id = new_segment_id();
+    set_entry(nhead, 0, id, dsize - DATABLOCK_HEADER_SIZE);
+
+    result = put_segment(id, buf, dsize);
+    free(buf);
+    if (result == STORE_STORED) {
+        result = nio_puts(g_conf->nio_db, key, keysize, nhead, nsize, cas);
+        if (result == STORE_STORED)
+            chunk_remove(head, hsize);
+        else
+            delete_segment(id);
+    }
+    free(nhead);
+    return result;
+}
+
+/*
+ * 既存のデータの後方(UPDATE_APPEND)または前方(UPDATE_PREPEND)に
+ * 値をセグメントとして追加します。
+ * 分割されていないデータは既存の値を最初のセグメントにします。
+ *
+ * dbuf: nio_agets() で取得したキーのレコード(内容は変更されます)
+ * cas: dbuf の cas
+ *
+ * nio.append_chunks が指定されている場合は chunk_lock() したキーで
+ * 呼び出します。
+ *
+ * 戻り値
+ *  STORE_XXX
+ */
+int chunk_update(const char* key, int keysize, char* dbuf, int dsize, int64 cas,
+                 const char* data, int bytes, int mode)
+{
+    int chunked = (dbuf[0] & DATA_HEADER_CHUNKED);
+    uint count;
+    uint total;
+    char* head;
+    char* sbuf;
+    int hsize;
+    int64 base_id = 0;
+    int64 id;
+    int result;
+    uint i;
+
+    if (chunked) {
+        count = head_count(dbuf);
+        if (dsize != (int)(CHUNK_HEAD_SIZE + count * CHUNK_ENTRY_SIZE))
+            return STORE_BAD_VALUE;
+        if (count >= CHUNK_MAX_SEGMENTS) {
+            /* 圧縮が追いついていないため連結して書き直します。*/
+            return merge(key, keysize, dbuf, dsize, cas, data, bytes, mode);
+        }
+        total = (uint)chunk_bytes(dbuf);
+        head = head_alloc(dbuf, count + 1, total + bytes, &hsize);
+    } else {
+        count = 1;
+        total = dsize - DATABLOCK_HEADER_SIZE;
+        head = head_alloc(dbuf, count + 1, total + bytes, &hsize);
+    }
+    if (head == NULL) {
+        err_write("chunk: chunk_update() no memory.");
+        return STORE_NO_MEMORY;
+    }
+
+    /* 追加する値をセグメントとして保存します。*/
+    sbuf = (char*)malloc(DATABLOCK_HEADER_SIZE + bytes);
+    if (sbuf == NULL) {
+        free(head);
+        err_write("chunk: chunk_update() no memory.");
+        return STORE_NO_MEMORY;
+    }
+    memcpy(&sbuf[DATABLOCK_HEADER_SIZE], data, bytes);
+    id = new_segment_id();
+    result = put_segment(id, sbuf, DATABLOCK_HEADER_SIZE + bytes);
+    free(sbuf);
+    if (result != STORE_STORED) {
+        free(head);
+        return result;
+    }
+
+    /* セグメントの一覧を作成します。*/
+    i = 0;
+    if (mode == UPDATE_PREPEND)
+        set_entry(head, i++, id, bytes);
+    if (chunked) {
+        memcpy(&head[CHUNK_HEAD_SIZE + i * CHUNK_ENTRY_SIZE],
+               &dbuf[CHUNK_HEAD_SIZE], count * CHUNK_ENTRY_SIZE);
+        i += count;
+    } else {
+        /* 既存の値を最初のセグメントとして保存します。*/
+        base_id = new_segment_id();
+        result = put_segment(base_id, dbuf, dsize);
+        if (result != STORE_STORED) {
+            delete_segment(id);
+            free(head);
+            return result;
+        }
+        set_entry(head, i++, base_id, total);
+    }
+    if (mode != UPDATE_PREPEND)
+        set_entry(head, i++, id, bytes);
+
+    result = nio_puts(g_conf->nio_db, key, keysize, head, hsize, cas);
+    free(head);
+    if (result != STORE_STORED) {
+        delete_segment(id);
+        if (! chunked)
+            delete_segment(base_id);
+        return result;
+    }
+    ATOMIC_ADD(g_stats.chunk_appends, 1);
+
+    /* セグメント数が上限を超えるごとに圧縮を要求します。*/
+    count++;
+    if (g_conf->append_chunks > 0 && count > (uint)g_conf->append_chunks &&
+        (count - g_conf->append_chunks - 1) % g_conf->append_chunks == 0)
+        compact_request(key, keysize);
+    return result;
+}
+
+/*
+ * キーのセグメントを１つに連結します。
+ * 連結中に追記された場合は読み直して再実行します。
+ */
+static void compact(const char* key, int keysize)
+{
+    int retry;
+
+    for (retry = 0; retry < 3; retry++) {
+        char* head;
+        int hsize;
+        int64 cas;
+        int result = STORE_NOT_STORED;
+
+        chunk_lock(key, keysize);
+        head = nio_agets(g_conf->nio_db, key, keysize, &hsize, &cas);
+        if (head == NULL) {
+            chunk_unlock(key, keysize);
+            return;
+        }
+        if ((head[0] & DATA_HEADER_CHUNKED) && head_count(head) > 1)
+            result = merge(key, keysize, head, hsize, cas, NULL, 0, 0);
+        chunk_unlock(key, keysize);
+        nio_free(g_conf->nio_db, head);
+
+        if (result == STORE_STORED) {
+            /* cas が変わるためキャッシュから外します。*/
+            if (g_conf->cache_size > 0)
+                cache_remove(key, keysize);
+            ATOMIC_ADD(g_stats.chunk_compactions, 1);
+        }
+        if (result != STORE_EXISTS)
+            break;
+    }
+}
+
+static void compactor_thread(void* argv)
+{
+    /* argv unuse */
+    while (! compactor_stop && ! g_shutdown_flag) {
+        struct chunk_req_t* req;
+
+        CS_START(&queue_lock);
+        req = queue_head;
+        if (req) {
+            queue_head = req->next;
+            if (queue_head == NULL)
+                queue_tail = NULL;
+            queue_count--;
+        }
+        CS_END(&queue_lock);
+
+        if (req == NULL) {
+            sleep_msec(100);
+            continue;
+        }
+        compact(req->key, req->keysize);
+        free(req);
+    }
+    compactor_running = 0;
+#ifdef _WIN32
+    _endthread();
+#endif
+}
+
+/*
+ * セグメントIDを初期化して、nio.append_chunks が指定されている場合は
+ * 圧縮スレッドを開始します。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー
+ */
+int chunk_open()
+{
+#ifdef _WIN32
+    uintptr_t thread_id;
+#else
+    pthread_t thread_id;
+#endif
+
+    int i;
+
+    chunk_seq = system_time();
+    CS_INIT(&queue_lock);
+    for (i = 0; i < CHUNK_LOCKS; i++)
+        CS_INIT(&key_locks[i]);
+    if (g_conf->append_chunks < 1)
+        return 0;
+
+    compactor_stop = 0;
+    compactor_running = 1;
+#ifdef _WIN32
+    thread_id = _beginthread(compactor_thread, 0, NULL);
+#else
+    pthread_create(&thread_id, NULL, (void*)compactor_thread, NULL);
+    pthread_detach(thread_id);
+#endif
+    return 0;
+}
+
+/*
+ * 圧縮スレッドを停止します。
+ * データベースをクローズする前に呼び出します。
+ */
+void chunk_close()
+{
+    compactor_stop = 1;
+    while (compactor_running)
+        sleep_msec(10);
+
+    while (queue_head) {
+        struct chunk_req_t* req = queue_head;
+
+        queue_head = req->next;
+        free(req);
+    }
+    queue_tail = NULL;
+    queue_count = 0;
+}
@@ -28,13 +28,46 @@
 
 #include "nio_server.h"
 
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
+
+static SOCKET unix_connect(const char* path)
+{
+#ifdef _WIN32
+    return INVALID_SOCKET;
+#else
+    SOCKET sock;
+    struct sockaddr_un sockaddr;
+
+    if (strlen(path) >= sizeof(sockaddr.sun_path))
+        return INVALID_SOCKET;
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    strcpy(sockaddr.sun_path, path);
+    if (connect(sock, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+        SOCKET_CLOSE(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+#endif
+}
+
 static void server_cmd(const char* cmd_str)
 {
-    SOCKET socket;
+    SOCKET socket = INVALID_SOCKET;
     char recvbuf[256];
     int okay_flag = 0;
 
-    socket = sock_connect_server("127.0.0.1", g_conf->port_no);
+    /* Unix ドメインソケットが指定されている場合はそちらを使用します。*/
+    if (g_conf->unix_socket[0])
+        socket = unix_connect(g_conf->unix_socket);
+    if (socket == INVALID_SOCKET)
+        socket = sock_connect_server("127.0.0.1", g_conf->port_no);
     if (socket != INVALID_SOCKET) {
         char cmdline[64];
 
@@ -47,7 +47,20 @@
  * nio.username = string (default is none)
  * nio.port_no = number (default is 11211)
  * nio.backlog = number (default is 100)
+ * nio.unix_socket = path (default is not use)
+ * nio.udp_port = number (default is 0, 0 is not use)
+ * nio.udp_threads = number (default is 1)
+ * nio.udp_bind = address (default is 0.0.0.0)
  * nio.worker_threads = number (default is 4)
+ * nio.reactors = number (default is 0, linux/bsd only)
+ * nio.dispatch_quantum = number (default is 64, 0 is unlimited)
+ * nio.max_connections = number (default is 0, 0 is unlimited)
+ * nio.idle_timeout = seconds (default is 0, 0 is no timeout)
+ * nio.zerocopy_size = bytes (default is 0, 0 is not use, linux only)
+ * nio.cache_size = MB (default is 0, 0 is not use)
+ * nio.bloom_keys = number (default is 0, 0 is not use)
+ * nio.expire_rate = number (default is 0, 0 is not use)
+ * nio.append_chunks = number (default is 0, 0 is not use)
  * nio.error_file = path/file (default is stderr)
  * nio.output_file = path/file (default is stdout)
  * nio.trace_flag = 1 or 0 (default is 0)
@@ -108,8 +121,26 @@ int config(const char* conf_fname)
             g_conf->port_no = (ushort)atoi(value);
         } else if (stricmp(name, "nio.backlog") == 0) {
             g_conf->backlog = atoi(value);
+        } else if (stricmp(name, "nio.unix_socket") == 0) {
+            strncpy(g_conf->unix_socket, value, sizeof(g_conf->unix_socket)-1);
+        } else if (stricmp(name, "nio.udp_port") == 0) {
+            g_conf->udp_port = (ushort)atoi(value);
+        } else if (stricmp(name, "nio.udp_threads") == 0) {
+            g_conf->udp_threads = atoi(value);
+        } else if (stricmp(name, "nio.udp_bind") == 0) {
+            strncpy(g_conf->udp_bind, value, sizeof(g_conf->udp_bind)-1);
         } else if (stricmp(name, "nio.worker_threads") == 0) {
             g_conf->worker_threads = atoi(value);
+        } else if (stricmp(name, "nio.reactors") == 0) {
+            g_conf->reactors = atoi(value);
+        } else if (stricmp(name, "nio.dispatch_quantum") == 0) {
+            g_conf->dispatch_quantum = atoi(value);
+        } else if (stricmp(name, "nio.max_connections") == 0) {
+            g_conf->max_connections = atoi(value);
+        } else if (stricmp(name, "nio.idle_timeout") == 0) {
+            g_conf->idle_timeout = atoi(value);
+        } else if (stricmp(name, "nio.zerocopy_size") == 0) {
+            g_conf->zerocopy_size = atoi(value);
         } else if (stricmp(name, "nio.daemon") == 0) {
             g_conf->daemonize = atoi(value);
         } else if (stricmp(name, "nio.username") == 0) {
@@ -129,6 +160,14 @@ int config(const char* conf_fname)
             g_conf->nio_bucket_num = atoi(value);
         } else if (stricmp(name, "nio.mmap_size") == 0) {
             g_conf->nio_mmap_size = atoi(value);
+        } else if (stricmp(name, "nio.cache_size") == 0) {
+            g_conf->cache_size = atoi(value);
+        } else if (stricmp(name, "nio.bloom_keys") == 0) {
+            g_conf->bloom_keys = atoi(value);
+        } else if (stricmp(name, "nio.expire_rate") == 0) {
+            g_conf->expire_rate = atoi(value);
+        } else if (stricmp(name, "nio.append_chunks") == 0) {
+            g_conf->append_chunks = atoi(value);
         } else if (stricmp(name, CMD_INCLUDE) == 0) {
             /* 他のconfigファイルを再帰処理で読み込みます。*/
             if (config(value) < 0)
@@ -0,0 +1,1202 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * コネクションテーブル
+ *
+ * ソケット(ファイルディスクリプタ)をインデックスとした配列で
+ * コネクション情報を管理します。
+ *
+ * テーブルはチャンク(CONN_CHUNK_SIZE 個のコネクション情報)の
+ * ディレクトリで構成されます。ディレクトリはプロセスが使用できる
+ * ファイルディスクリプタの最大数から初期化時に確保され、チャンクは
+ * そのソケット番号が初めて使用されたときに確保されます。
+ * 一度確保したチャンクは移動しないため、参照時にロックは不要です。
+ * ロックはチャンクを追加するときのみ使用します。
+ *
+ * コネクションは受信バッファを持ち、コマンドの解析はこのバッファから
+ * 行います。受信の待機は行いません。通常のソケットでは到着している
+ * データを conn_recv() で受信し、io_uring のコネクションでは完了通知で
+ * 受信したデータが conn_append() で追加されます。
+ * 応答データは送信待ちバッファに追加され、まとめて送信されます。
+ * 通常のソケットでは conn_flush() が呼び出されたとき、または送信待ちが
+ * CONN_WBUF_FLUSH を超えたときに送信します。
+ * 大きな値は conn_send_ref() でコピーせずに参照として送信待ちに加えられ、
+ * 送信待ちバッファの断片と合わせて sendmsg() でまとめて送信されます。
+ * 参照は送信が終わった時点で解放されます。
+ * nio.zerocopy_size 以上の参照を含む場合は MSG_ZEROCOPY で送信し、
+ * 参照はカーネルからの完了通知(エラーキュー)を受け取るまで保持されます。
+ * 完了通知は次の conn_flush() で受信します。
+ * io_uring のコネクションではリアクターが送信します。
+ *
+ * 受信バッファは最初の受信で CONN_RBUF_MIN のサイズで確保され、
+ * 受信中のコマンドに必要なサイズ(大きな set のデータなど)または
+ * パイプラインでバッファが一杯になった場合にのみ拡張されます。
+ * コマンドの処理後にバッファが空になった時点で、拡張したバッファは
+ * 解放されて次の受信で再び小さなサイズで確保されます。
+ * 送信バッファも CONN_WBUF_KEEP を超えたものは空になった時点で
+ * 解放します。アイドル状態のコネクションが大量にある場合でも
+ * コネクションあたりのメモリは小さなバッファのみになります。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nio_server.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sched.h>
+#endif
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define CONN_ZEROCOPY
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CONN_CHUNK_BITS     10
+#define CONN_CHUNK_SIZE     (1 << CONN_CHUNK_BITS)
+#define CONN_CHUNK_MASK     (CONN_CHUNK_SIZE - 1)
+
+#define CONN_DEFAULT_MAX    65536       /* ソケット番号の最大数(デフォルト) */
+#define CONN_LIMIT_MAX      (1 << 24)   /* ソケット番号の最大数(上限) */
+
+#define CONN_RBUF_MIN       2048        /* 受信バッファの初期サイズ */
+#define CONN_RBUF_MAX       (4*1024*1024)   /* １回に受信する最大サイズ */
+#define CONN_WBUF_FLUSH     65536       /* 送信待ちデータを送信するサイズ */
+#define CONN_WBUF_KEEP      16384       /* 空になっても保持する送信バッファのサイズ */
+#define CONN_REF_MIN        512         /* 参照で送信する最小サイズ */
+#define CONN_IOV_MAX        64          /* １回の sendmsg() の iovec 数 */
+#define CONN_ZC_HOLD_MAX    (8*1024*1024)   /* 完了通知を待つ参照の最大サイズ */
+#define CONN_SEND_WAIT      1000        /* 送信可能を待つ間隔(ミリ秒) */
+#define CONN_SEND_TIMEOUT   5           /* 送信が進まない場合に切断する回数 */
+
+#define TOO_MANY_CONNECTIONS "SERVER_ERROR Too many open connections\r\n"
+
+#ifdef _WIN32
+#define CAS32(var, old, n)      (InterlockedCompareExchange((volatile LONG*)&(var), (LONG)(n), (LONG)(old)) == (LONG)(old))
+#else
+#define CAS32(var, old, n)      __sync_bool_compare_and_swap(&(var), (old), (n))
+#endif
+
+static int conn_chunk_num = 0;              /* ディレクトリのサイズ */
+static struct conn_t* volatile* conn_chunks = NULL; /* チャンクのディレクトリ */
+static CS_DEF(conn_lock);                   /* チャンク追加用のロック */
+
+static int max_sockets()
+{
+    int n = CONN_DEFAULT_MAX;
+
+#ifndef _WIN32
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        if (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > CONN_LIMIT_MAX)
+            n = CONN_LIMIT_MAX;
+        else if ((int)rl.rlim_max > n)
+            n = (int)rl.rlim_max;
+    }
+#endif
+    return n;
+}
+
+static struct conn_t* conn_slot(SOCKET socket, int alloc_flag)
+{
+    int index;
+    struct conn_t* chunk;
+
+    if (socket < 0)
+        return NULL;
+    index = (int)(socket >> CONN_CHUNK_BITS);
+    if (index >= conn_chunk_num)
+        return NULL;
+
+    chunk = conn_chunks[index];
+    if (chunk == NULL) {
+        if (! alloc_flag)
+            return NULL;
+
+        CS_START(&conn_lock);
+        chunk = conn_chunks[index];
+        if (chunk == NULL) {
+            int i;
+
+            chunk = (struct conn_t*)calloc(CONN_CHUNK_SIZE, sizeof(struct conn_t));
+            if (chunk) {
+                for (i = 0; i < CONN_CHUNK_SIZE; i++)
+                    chunk[i].socket = INVALID_SOCKET;
+                /* 初期化が完了してからディレクトリに登録します。*/
+                MEMORY_BARRIER();
+                conn_chunks[index] = chunk;
+            }
+        }
+        CS_END(&conn_lock);
+        if (chunk == NULL) {
+            err_write("conn_slot: no memory.");
+            return NULL;
+        }
+    }
+    return &chunk[socket & CONN_CHUNK_MASK];
+}
+
+/*
+ * コネクションテーブルを初期化します。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: 失敗
+ */
+int conn_initialize()
+{
+    conn_chunk_num = (max_sockets() + CONN_CHUNK_SIZE - 1) >> CONN_CHUNK_BITS;
+    conn_chunks = (struct conn_t* volatile*)calloc(conn_chunk_num, sizeof(struct conn_t*));
+    if (conn_chunks == NULL) {
+        err_write("conn_initialize: no memory.");
+        return -1;
+    }
+    CS_INIT(&conn_lock);
+    return 0;
+}
+
+/*
+ * 送信待ちの参照をすべて解放します。
+ */
+static void release_refs(struct conn_t* conn)
+{
+    int i;
+
+    for (i = 0; i < conn->wiovcnt; i++) {
+        if (conn->wiov[i].release)
+            (*conn->wiov[i].release)(conn->wiov[i].ref);
+    }
+    conn->wiovcnt = 0;
+    conn->wrefbytes = 0;
+}
+
+/*
+ * MSG_ZEROCOPY の送信 id が first から last までの送信の完了を参照に
+ * 反映して、使用したすべての送信が完了した参照を解放します。
+ * 完了通知は順不同で届く場合があるため、範囲外の送信は数えません。
+ * first が -1 の場合はすべての参照を解放します。
+ */
+static void release_zcrefs(struct conn_t* conn, int64 first, int64 last)
+{
+    int i, n = 0;
+
+    for (i = 0; i < conn->zcrefcnt; i++) {
+        struct conn_zcref_t* z = &conn->zcref[i];
+
+        if (first >= 0) {
+            uint id;
+
+            for (id = z->first; ; id++) {
+                if (id - (uint)first <= (uint)last - (uint)first)
+                    z->pending--;
+                if (id == z->seq)
+                    break;
+            }
+        }
+        if (first < 0 || z->pending <= 0) {
+            (*z->release)(z->ref);
+            conn->zcbytes -= z->len;
+        } else {
+            conn->zcref[n++] = *z;
+        }
+    }
+    conn->zcrefcnt = n;
+}
+
+static void free_buffers(struct conn_t* conn)
+{
+    release_refs(conn);
+    if (conn->wiov) {
+        free(conn->wiov);
+        conn->wiov = NULL;
+        conn->wiovsize = 0;
+    }
+    release_zcrefs(conn, -1, -1);
+    if (conn->zcref) {
+        free(conn->zcref);
+        conn->zcref = NULL;
+        conn->zcrefsize = 0;
+    }
+    conn->zerocopy = 0;
+    conn->zcseq = 0;
+    if (conn->rbuf) {
+        free(conn->rbuf);
+        conn->rbuf = NULL;
+    }
+    if (conn->wbuf) {
+        mb_free(conn->wbuf);
+        conn->wbuf = NULL;
+    }
+    if (conn->sbuf) {
+        mb_free(conn->sbuf);
+        conn->sbuf = NULL;
+    }
+    conn->rbufsize = conn->rpos = conn->rlen = 0;
+    conn->spos = 0;
+}
+
+/*
+ * コネクションテーブルを解放します。
+ * オープンされているコネクションのバッファも解放されます。
+ */
+void conn_finalize()
+{
+    int i, j;
+
+    if (conn_chunks == NULL)
+        return;
+    for (i = 0; i < conn_chunk_num; i++) {
+        struct conn_t* chunk = conn_chunks[i];
+
+        if (chunk == NULL)
+            continue;
+        for (j = 0; j < CONN_CHUNK_SIZE; j++)
+            free_buffers(&chunk[j]);
+        free(chunk);
+    }
+    free((void*)conn_chunks);
+    conn_chunks = NULL;
+    conn_chunk_num = 0;
+}
+
+/*
+ * 受け付けたソケットをコネクションテーブルに登録します。
+ * 受信バッファは最初の受信時に作成されます。
+ * I/Oモードは CONN_IO_SOCKET で初期化されます。
+ *
+ * nio.max_connections を超える場合はクライアントにエラーを送信して
+ * 登録しません。ソケットのクローズは呼び出し元で行います。
+ *
+ * socket: クライアントソケット
+ * addr: クライアントのアドレス
+ * sock_event: ソケットを監視する多重I/Oのイベント
+ *
+ * 戻り値
+ *  コネクション情報のポインタ
+ *  エラーの場合は NULL
+ */
+struct conn_t* conn_open(SOCKET socket, struct in_addr addr, void* sock_event)
+{
+    struct conn_t* conn;
+    int64 curr;
+
+    /* 同時に受け付けたスレッドが上限を超えないように加算した値で判定します。*/
+    curr = ATOMIC_ADD(g_stats.curr_connections, 1);
+    if (g_conf->max_connections > 0 && curr >= g_conf->max_connections) {
+        ATOMIC_ADD(g_stats.curr_connections, -1);
+        send(socket, TOO_MANY_CONNECTIONS, sizeof(TOO_MANY_CONNECTIONS)-1, 0);
+        ATOMIC_ADD(g_stats.rejected_connections, 1);
+        return NULL;
+    }
+
+    conn = conn_slot(socket, 1);
+    if (conn == NULL) {
+        ATOMIC_ADD(g_stats.curr_connections, -1);
+        err_write("conn_open: socket=%d out of connection table.", socket);
+        return NULL;
+    }
+    conn->rbuf = NULL;
+    conn->rbufsize = 0;
+    conn->rpos = conn->rlen = 0;
+    conn->need = 0;
+    conn->last_time = current_seconds();
+    conn->local = 0;
+    conn->protocol = CONN_PROTO_NONE;
+    conn->spos = 0;
+    conn->werror = 0;
+    conn->addr = addr;
+    conn->sock_event = sock_event;
+    conn->io_mode = CONN_IO_SOCKET;
+    conn->uring_stat = 0;
+    conn->gen++;
+    /* アイドル監視スレッドが参照するため最後に設定します。*/
+    MEMORY_BARRIER();
+    conn->socket = socket;
+
+    ATOMIC_ADD(g_stats.total_connections, 1);
+    return conn;
+}
+
+/*
+ * ソケットからコネクション情報を取得します。
+ * ロックは使用しません。
+ *
+ * socket: クライアントソケット
+ *
+ * 戻り値
+ *  コネクション情報のポインタ
+ *  登録されていない場合は NULL
+ */
+struct conn_t* conn_get(SOCKET socket)
+{
+    struct conn_t* conn;
+
+    conn = conn_slot(socket, 0);
+    if (conn == NULL || conn->socket != socket)
+        return NULL;
+    return conn;
+}
+
+/*
+ * コネクションをクローズしてテーブルから削除します。
+ * 多重I/Oの監視対象からも外されます。
+ *
+ * io_uring のコネクションで発行中の要求や未送信のデータがある場合は
+ * CONN_URING_CLOSING を設定するだけで、実際のクローズは要求が
+ * 完了した後にリアクターから再度呼び出されたときに行います。
+ *
+ * conn: コネクション情報
+ */
+void conn_close(struct conn_t* conn)
+{
+    SOCKET socket = conn->socket;
+
+    if (socket == INVALID_SOCKET)
+        return;
+    if (conn->io_mode == CONN_IO_URING) {
+        if ((conn->uring_stat & (CONN_URING_RECV|CONN_URING_SEND)) ||
+            (conn->wbuf && conn->wbuf->size > 0)) {
+            conn->uring_stat |= CONN_URING_CLOSING;
+            return;
+        }
+    }
+    if (conn->sock_event)
+        sock_event_delete(conn->sock_event, socket);
+    free_buffers(conn);
+    conn->sock_event = NULL;
+
+    /* ソケット番号が再利用される前にテーブルから外します。*/
+    conn->socket = INVALID_SOCKET;
+    MEMORY_BARRIER();
+    /* アイドル監視スレッドが shutdown() している間はクローズを待ちます。*/
+    while (conn->reaping) {
+#ifdef _WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    }
+    ATOMIC_ADD(g_stats.curr_connections, -1);
+
+    shutdown(socket, 2);  /* 2: RDWR stop */
+    SOCKET_CLOSE(socket);
+}
+
+static int reserve_rbuf(struct conn_t* conn, int size)
+{
+    if (conn->rpos > 0 && conn->rpos + conn->rlen + size > conn->rbufsize) {
+        /* 未処理データを先頭に移動します。*/
+        memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen);
+        conn->rpos = 0;
+    }
+    if (conn->rlen + size > conn->rbufsize) {
+        int newsize = (conn->rbufsize > 0)? conn->rbufsize : CONN_RBUF_MIN;
+        char* tp;
+
+        while (newsize < conn->rlen + size)
+            newsize *= 2;
+        tp = (char*)realloc(conn->rbuf, newsize);
+        if (tp == NULL) {
+            err_write("conn: no memory receive buffer size=%d.", newsize);
+            return -1;
+        }
+        conn->rbuf = tp;
+        conn->rbufsize = newsize;
+    }
+    return 0;
+}
+
+/*
+ * ソケットに到着しているデータを待機せずに受信バッファへ受信します。
+ * 受信バッファが CONN_RBUF_MAX を超えた場合は残りをソケットに残します。
+ *
+ * バッファは受信中のコマンドに必要なサイズ(conn->need)まで、
+ * または空きがなくなった場合に拡張します。
+ *
+ * 戻り値
+ *  受信バッファのデータサイズ
+ *  FIN受信またはエラーの場合は -1
+ */
+int conn_recv(struct conn_t* conn)
+{
+    while (conn->rlen < CONN_RBUF_MAX) {
+        int space;
+        int want = 1;
+        int n;
+
+        if (conn->rlen == 0)
+            conn->rpos = 0;
+        if (conn->need > conn->rlen)
+            want = conn->need - conn->rlen;
+        space = conn->rbufsize - (conn->rpos + conn->rlen);
+        if (space < want) {
+            if (reserve_rbuf(conn, want) < 0)
+                return -1;
+            space = conn->rbufsize - (conn->rpos + conn->rlen);
+        }
+#ifdef _WIN32
+        {
+            u_long avail = 0;
+
+            if (ioctlsocket(conn->socket, FIONREAD, &avail) != 0)
+                return -1;
+            if (avail == 0)
+                break;
+        }
+        n = recv(conn->socket, conn->rbuf + conn->rpos + conn->rlen, space, 0);
+#else
+        n = recv(conn->socket, conn->rbuf + conn->rpos + conn->rlen, space, MSG_DONTWAIT);
+#endif
+        if (n == 0)
+            return -1;  /* FIN受信 */
+        if (n < 0) {
+#ifndef _WIN32
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+#endif
+            return -1;
+        }
+        conn->rlen += n;
+        if (n < space)
+            break;
+    }
+    return conn->rlen;
+}
+
+/*
+ * コマンドの処理後に拡張したバッファを解放します。
+ * 受信バッファは空の場合、送信バッファは送信済みの場合のみ対象です。
+ */
+void conn_shrink(struct conn_t* conn)
+{
+    if (conn->rlen == 0 && conn->rbufsize > CONN_RBUF_MIN) {
+        free(conn->rbuf);
+        conn->rbuf = NULL;
+        conn->rbufsize = conn->rpos = 0;
+    }
+    if (conn->wbuf && conn->wbuf->size == 0 && conn->wbuf->bufsize > CONN_WBUF_KEEP) {
+        mb_free(conn->wbuf);
+        conn->wbuf = NULL;
+    }
+    if (conn->sbuf && ! (conn->uring_stat & CONN_URING_SEND) &&
+        conn->sbuf->size == 0 && conn->sbuf->bufsize > CONN_WBUF_KEEP) {
+        mb_free(conn->sbuf);
+        conn->sbuf = NULL;
+    }
+}
+
+/*
+ * timeout 秒以上コマンドを受信していないコネクションを切断します。
+ * アイドル監視スレッドから呼び出されます。
+ *
+ * コネクションを所有するスレッドと競合しないように、ここでは
+ * shutdown() で受信を終了させるだけで、クローズは所有するスレッドが
+ * FIN受信として通常の手順で行います。
+ * 確認から shutdown() までは conn->reaping を設定して、所有するスレッドが
+ * ソケットをクローズ(番号を再利用)できないようにします。
+ *
+ * 戻り値
+ *  切断したコネクション数
+ */
+int conn_reap(int timeout)
+{
+    int now = current_seconds();
+    int count = 0;
+    int i, j;
+
+    for (i = 0; i < conn_chunk_num; i++) {
+        struct conn_t* chunk = conn_chunks[i];
+
+        if (chunk == NULL)
+            continue;
+        for (j = 0; j < CONN_CHUNK_SIZE; j++) {
+            struct conn_t* conn = &chunk[j];
+            SOCKET socket;
+
+            if (conn->socket == INVALID_SOCKET || now - conn->last_time < timeout)
+                continue;
+            if (! CAS32(conn->reaping, 0, 1))
+                continue;
+            /* conn_close() は reaping が解除されるまでクローズしないため、
+               ここで有効なソケットは shutdown() まで再利用されません。*/
+            socket = conn->socket;
+            if (socket != INVALID_SOCKET && now - conn->last_time >= timeout) {
+                shutdown(socket, 2);  /* 2: RDWR stop */
+                /* 所有するスレッドがクローズするまで再度切断しないようにします。*/
+                conn->last_time = now;
+                count++;
+            }
+            MEMORY_BARRIER();
+            conn->reaping = 0;
+        }
+    }
+    return count;
+}
+
+/*
+ * 受信したデータを受信バッファの最後に追加します。
+ * io_uring のリアクターから使用されます。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: メモリ不足
+ */
+int conn_append(struct conn_t* conn, const char* buf, int size)
+{
+    if (reserve_rbuf(conn, size) < 0)
+        return -1;
+    memcpy(conn->rbuf + conn->rpos + conn->rlen, buf, size);
+    conn->rlen += size;
+    return 0;
+}
+
+/*
+ * p から n バイトの範囲で最初の CRLF を検索します。
+ * SSE2 または AVX2 が使用できる場合は 16バイト(AVX2 は 32バイト)単位で
+ * CR と次のバイトの LF を同時に比較します。
+ *
+ * 戻り値
+ *  CR の位置
+ *  見つからない場合は NULL
+ */
+const char* find_crlf(const char* p, int n)
+{
+    int i = 0;
+
+#if defined(__AVX2__)
+    __m256i cr32 = _mm256_set1_epi8('\r');
+    __m256i lf32 = _mm256_set1_epi8('\n');
+
+    for (; i + 33 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + i + 1));
+        uint mask = (uint)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, cr32), _mm256_cmpeq_epi8(b, lf32)));
+
+        if (mask)
+            return p + i + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i cr16 = _mm_set1_epi8('\r');
+        __m128i lf16 = _mm_set1_epi8('\n');
+
+        for (; i + 17 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(p + i + 1));
+            uint mask = (uint)_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, cr16), _mm_cmpeq_epi8(b, lf16)));
+
+            if (mask)
+                return p + i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < n - 1; i++) {
+        if (p[i] == '\r' && p[i+1] == '\n')
+            return p + i;
+    }
+    return NULL;
+}
+
+/*
+ * 受信バッファから１行(CRLFまで)を取り出します。
+ * 受信バッファにあるデータのみを対象とし、受信の待機は行いません。
+ * 行はコピーせずに受信バッファの CR の位置を NULL終端にして返すため、
+ * 次の受信またはバッファの縮小までの間だけ有効です。
+ *
+ * maxlen: 行の最大長(CRLF は含まない)
+ * len: 行の長さ(CRLF は含まない)が設定されます。
+ *
+ * 戻り値
+ *  行の先頭のポインタ
+ *  maxlen 以内に行末がない場合は NULL(受信バッファは変更されません)
+ */
+char* conn_line(struct conn_t* conn, int maxlen, int* len)
+{
+    char* p;
+    char* cr;
+    int n;
+
+    p = conn->rbuf + conn->rpos;
+    n = conn->rlen;
+    if (n > maxlen + 2)
+        n = maxlen + 2;
+
+    cr = (char*)find_crlf(p, n);
+    if (cr == NULL)
+        return NULL;
+    *len = (int)(cr - p);
+    *cr = '\0';
+    conn->rpos += *len + 2;
+    conn->rlen -= *len + 2;
+    return p;
+}
+
+/*
+ * 受信バッファから指定されたバイト数を取り出します。
+ *
+ * 戻り値
+ *  取り出したバイト数
+ */
+int conn_nchar(struct conn_t* conn, char* buf, int size)
+{
+    int n = conn->rlen;
+
+    if (n > size)
+        n = size;
+    memcpy(buf, conn->rbuf + conn->rpos, n);
+    conn->rpos += n;
+    conn->rlen -= n;
+    return n;
+}
+
+/*
+ * 受信バッファから指定されたバイト数をコピーせずに取り出します。
+ * 返されたポインタは次の受信またはバッファの縮小までの間だけ有効です。
+ *
+ * 戻り値
+ *  取り出したデータの先頭のポインタ
+ *  受信バッファのデータが足りない場合は NULL(受信バッファは変更されません)
+ */
+char* conn_nptr(struct conn_t* conn, int size)
+{
+    char* p;
+
+    if (conn->rlen < size)
+        return NULL;
+    p = conn->rbuf + conn->rpos;
+    conn->rpos += size;
+    conn->rlen -= size;
+    return p;
+}
+
+/*
+ * 受信バッファから 32ビット整数を取り出します。
+ * status にはエラーの場合に -1 が設定されます。
+ */
+int conn_int(struct conn_t* conn, int* status)
+{
+    int n = 0;
+
+    *status = (conn_nchar(conn, (char*)&n, sizeof(n)) == sizeof(n))? 0 : -1;
+    return n;
+}
+
+/*
+ * 受信バッファから 64ビット整数を取り出します。
+ * status にはエラーの場合に -1 が設定されます。
+ */
+int64 conn_int64(struct conn_t* conn, int* status)
+{
+    int64 n = 0;
+
+    *status = (conn_nchar(conn, (char*)&n, sizeof(n)) == sizeof(n))? 0 : -1;
+    return n;
+}
+
+/*
+ * 送信待ちの断片を追加します。
+ */
+static int add_iov(struct conn_t* conn, const char* base, int offset, int len,
+                   void (*release)(void* ref), void* ref)
+{
+    struct conn_iov_t* v;
+
+    if (conn->wiovcnt >= conn->wiovsize) {
+        int newsize = (conn->wiovsize > 0)? conn->wiovsize * 2 : 16;
+        struct conn_iov_t* tp;
+
+        tp = (struct conn_iov_t*)realloc(conn->wiov, sizeof(struct conn_iov_t) * newsize);
+        if (tp == NULL)
+            return -1;
+        conn->wiov = tp;
+        conn->wiovsize = newsize;
+    }
+    v = &conn->wiov[conn->wiovcnt++];
+    v->base = base;
+    v->offset = offset;
+    v->len = len;
+    v->release = release;
+    v->ref = ref;
+    return 0;
+}
+
+/*
+ * 送信待ちバッファのデータを送信します。
+ * io_uring のコネクションでは何もしません(リアクターが送信します)。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: 送信エラー
+ */
+#ifdef CONN_ZEROCOPY
+/*
+ * MSG_ZEROCOPY の完了通知を受信して送信済みの参照を解放します。
+ * wait が真の場合は保持しているサイズが CONN_ZC_HOLD_MAX 以下になるまで
+ * 通知を待ちます。
+ */
+static void reap_zerocopy(struct conn_t* conn, int wait)
+{
+    while (conn->zcrefcnt > 0) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr* cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(conn->socket, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0) {
+            struct pollfd pfd;
+
+            if (errno == EINTR)
+                continue;
+            if (! wait || conn->zcbytes <= CONN_ZC_HOLD_MAX ||
+                (errno != EAGAIN && errno != EWOULDBLOCK))
+                break;
+            /* エラーキューは POLLERR で通知されます。*/
+            pfd.fd = conn->socket;
+            pfd.events = 0;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 1000) < 1)
+                break;
+            continue;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err* ee;
+
+            if (! ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                   (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* ee_info から ee_data までの送信が完了しています。*/
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                ATOMIC_ADD(g_stats.zerocopy_copied, (int64)(ee->ee_data - ee->ee_info + 1));
+            release_zcrefs(conn, ee->ee_info, ee->ee_data);
+        }
+    }
+}
+
+/*
+ * 送信待ちの断片を MSG_ZEROCOPY で送信するかを判定します。
+ * nio.zerocopy_size 以上の参照を含み、ソケットが SO_ZEROCOPY に
+ * 対応している場合に真を返します。完了通知を待つ参照の領域も確保します。
+ */
+static int use_zerocopy(struct conn_t* conn)
+{
+    int i;
+    int refcnt = 0;
+    int large = 0;
+
+    /* ワーカー方式では処理中のコネクションでも完了通知(EPOLLERR)で
+       イベントが発生して別のスレッドに渡されるため、リアクター方式のみで
+       使用します。*/
+    if (g_conf->zerocopy_size < 1 || g_conf->reactors < 1 || conn->zerocopy < 0)
+        return 0;
+    for (i = 0; i < conn->wiovcnt; i++) {
+        if (conn->wiov[i].release) {
+            refcnt++;
+            if (conn->wiov[i].len >= g_conf->zerocopy_size)
+                large = 1;
+        }
+    }
+    if (! large)
+        return 0;
+
+    if (conn->zerocopy == 0) {
+        int on = 1;
+
+        /* Unix ドメインソケットや古いカーネルでは失敗します。*/
+        if (setsockopt(conn->socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+            conn->zerocopy = -1;
+            return 0;
+        }
+        conn->zerocopy = 1;
+    }
+    if (conn->zcrefcnt + refcnt > conn->zcrefsize) {
+        int newsize = conn->zcrefcnt + refcnt + 16;
+        struct conn_zcref_t* tp;
+
+        tp = (struct conn_zcref_t*)realloc(conn->zcref, sizeof(struct conn_zcref_t) * newsize);
+        if (tp == NULL)
+            return 0;
+        conn->zcref = tp;
+        conn->zcrefsize = newsize;
+    }
+    return 1;
+}
+
+/*
+ * 送信待ちの参照を MSG_ZEROCOPY の完了通知を待つ参照に移します。
+ * 参照は送信 id が first から last までの送信で使用されています。
+ * 領域は use_zerocopy() で確保されています。
+ */
+static void hold_refs(struct conn_t* conn, uint first, uint last)
+{
+    int i;
+
+    for (i = 0; i < conn->wiovcnt; i++) {
+        struct conn_iov_t* v = &conn->wiov[i];
+
+        if (v->release) {
+            struct conn_zcref_t* z = &conn->zcref[conn->zcrefcnt++];
+
+            z->first = first;
+            z->seq = last;
+            z->pending = (int)(last - first) + 1;
+            z->len = v->len;
+            z->release = v->release;
+            z->ref = v->ref;
+            conn->zcbytes += v->len;
+        }
+    }
+    conn->wiovcnt = 0;
+    conn->wrefbytes = 0;
+}
+#endif
+
+#ifndef _WIN32
+/*
+ * ソケットが送信可能になるまで CONN_SEND_WAIT ミリ秒待ちます。
+ * 受信しないクライアントでスレッドが止まらないように、送信が進まないまま
+ * CONN_SEND_TIMEOUT 回待った場合はエラーにします。
+ * stalls は送信が進んだ時点で呼び出し元が 0 に戻します。
+ *
+ * 戻り値
+ *  0: 再送信する
+ * -1: タイムアウト
+ */
+static int wait_send(struct conn_t* conn, int* stalls)
+{
+    struct pollfd pfd;
+
+    pfd.fd = conn->socket;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, CONN_SEND_WAIT) == 0 && ++(*stalls) >= CONN_SEND_TIMEOUT) {
+        err_write("conn: socket=%d send timeout.", conn->socket);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * データを送信します。
+ * 送信でスレッドが止まらないように MSG_DONTWAIT を指定します。
+ *
+ * 戻り値
+ *  送信したバイト数
+ *  エラーの場合は -1
+ */
+static int send_nowait(struct conn_t* conn, const char* buf, int size)
+{
+#ifdef _WIN32
+    return send_data(conn->socket, buf, size);
+#else
+    int flags = MSG_DONTWAIT;
+    int stalls = 0;
+    int len = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    while (len < size) {
+        ssize_t n;
+
+        n = send(conn->socket, buf + len, size - len, flags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (wait_send(conn, &stalls) == 0)
+                    continue;
+            }
+            conn->werror = 1;
+            return -1;
+        }
+        len += (int)n;
+        stalls = 0;
+    }
+    return len;
+#endif
+}
+
+#ifndef _WIN32
+/*
+ * 送信待ちの断片(wiov)を sendmsg() で送信します。
+ * 送信が終わった参照は解放されます。
+ * MSG_ZEROCOPY で送信した場合は完了通知を受け取るまで保持します。
+ * 送信待ちバッファは送信後に再利用するため、MSG_ZEROCOPY は参照の断片のみを
+ * まとめた sendmsg() に指定します。
+ * 送信が進まずにタイムアウトした場合はエラーになり、残りの断片は破棄されます。
+ */
+static int flush_iov(struct conn_t* conn)
+{
+    struct iovec iov[CONN_IOV_MAX];
+    struct msghdr msg;
+    int i = 0;          /* 送信中の断片 */
+    int off = 0;        /* 送信中の断片の送信済みサイズ */
+    int result = 0;
+    int flags = MSG_DONTWAIT;
+    int zc = 0;         /* MSG_ZEROCOPY を使用する */
+    int zc_sent = 0;    /* MSG_ZEROCOPY で送信した回数 */
+    int stalls = 0;     /* 送信が進まずに待った回数 */
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+#ifdef CONN_ZEROCOPY
+    zc = use_zerocopy(conn);
+#endif
+
+    while (i < conn->wiovcnt) {
+        int cnt;
+        int is_ref = (conn->wiov[i].release != NULL);
+        int sflags = flags;
+        ssize_t n;
+
+        for (cnt = 0; cnt < CONN_IOV_MAX && i + cnt < conn->wiovcnt; cnt++) {
+            struct conn_iov_t* v = &conn->wiov[i + cnt];
+            const char* base = (v->base)? v->base : conn->wbuf->buf + v->offset;
+            int skip = (cnt == 0)? off : 0;
+
+            /* MSG_ZEROCOPY では参照と送信待ちバッファを分けて送信します。*/
+            if (zc && (v->release != NULL) != is_ref)
+                break;
+
+            iov[cnt].iov_base = (void*)(base + skip);
+            iov[cnt].iov_len = v->len - skip;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+#ifdef CONN_ZEROCOPY
+        if (zc && is_ref)
+            sflags |= MSG_ZEROCOPY;
+#endif
+#ifdef MSG_MORE
+        /* 分けて送信する断片が残っている場合は Nagle で後の断片が
+           遅延しないように最後の sendmsg() までまとめます。*/
+        if (i + cnt < conn->wiovcnt)
+            sflags |= MSG_MORE;
+#endif
+        n = sendmsg(conn->socket, &msg, sflags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+#ifdef CONN_ZEROCOPY
+            if (errno == ENOBUFS && (sflags & MSG_ZEROCOPY)) {
+                /* optmem の上限に達したため通常の送信に切り替えます。*/
+                zc = 0;
+                continue;
+            }
+#endif
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (wait_send(conn, &stalls) == 0)
+                    continue;
+            }
+            conn->werror = 1;
+            result = -1;
+            break;
+        }
+#ifdef CONN_ZEROCOPY
+        if ((sflags & MSG_ZEROCOPY) && n > 0) {
+            /* 送信 id はソケットごとに 0 から順に割り当てられます。*/
+            conn->zcseq++;
+            zc_sent++;
+        }
+#endif
+        /* 送信したサイズだけ断片を進めます。*/
+        if (n > 0)
+            stalls = 0;
+        while (n > 0) {
+            int rest = conn->wiov[i].len - off;
+
+            if (n >= rest) {
+                n -= rest;
+                i++;
+                off = 0;
+            } else {
+                off += (int)n;
+                n = 0;
+            }
+        }
+    }
+#ifdef CONN_ZEROCOPY
+    if (zc_sent > 0) {
+        ATOMIC_ADD(g_stats.zerocopy_sends, (int64)zc_sent);
+        hold_refs(conn, conn->zcseq - zc_sent, conn->zcseq - 1);
+        if (conn->zcbytes > CONN_ZC_HOLD_MAX)
+            reap_zerocopy(conn, 1);
+    }
+#endif
+    release_refs(conn);
+    if (conn->wbuf)
+        mb_reset(conn->wbuf);
+    return result;
+}
+#endif
+
+int conn_flush(struct conn_t* conn)
+{
+    int result = 0;
+
+    if (conn->io_mode == CONN_IO_URING)
+        return 0;
+    if (conn->werror) {
+        /* 送信できなくなったコネクションのデータは破棄します。*/
+        release_refs(conn);
+        if (conn->wbuf)
+            mb_reset(conn->wbuf);
+        return -1;
+    }
+#ifdef CONN_ZEROCOPY
+    /* 完了通知が届いている参照を解放します(POLLERR の解除を兼ねます)。*/
+    if (conn->zcrefcnt > 0)
+        reap_zerocopy(conn, 0);
+#endif
+#ifndef _WIN32
+    if (conn->wiovcnt > 0)
+        return flush_iov(conn);
+#endif
+    if (conn->wbuf == NULL || conn->wbuf->size < 1)
+        return 0;
+    if (send_nowait(conn, conn->wbuf->buf, conn->wbuf->size) < 0)
+        result = -1;
+    mb_reset(conn->wbuf);
+    return result;
+}
+
+/*
+ * 応答データを送信待ちバッファに追加します。
+ * 通常のソケットで送信待ちが CONN_WBUF_FLUSH を超える場合は送信します。
+ *
+ * 戻り値
+ *  追加したバイト数
+ *  エラーの場合は -1
+ */
+int conn_send(struct conn_t* conn, const void* buf, int size)
+{
+    if (conn->io_mode != CONN_IO_URING) {
+        int pending = ((conn->wbuf)? conn->wbuf->size : 0) + conn->wrefbytes;
+
+        if (conn->werror)
+            return -1;
+        if (pending + size > CONN_WBUF_FLUSH) {
+            if (conn_flush(conn) < 0)
+                return -1;
+            if (size >= CONN_WBUF_FLUSH) {
+                /* 大きなデータはコピーせずに送信します。*/
+                return send_nowait(conn, (const char*)buf, size);
+            }
+        }
+    }
+
+    if (conn->wbuf == NULL) {
+        conn->wbuf = mb_alloc(BUF_SIZE);
+        if (conn->wbuf == NULL) {
+            err_write("conn_send: no memory.");
+            return -1;
+        }
+    }
+    if (mb_append(conn->wbuf, (const char*)buf, size) < 0) {
+        err_write("conn_send: no memory.");
+        return -1;
+    }
+    if (conn->wiovcnt > 0) {
+        /* 参照の後に追加されたデータは送信待ちバッファの断片とします。*/
+        struct conn_iov_t* last = &conn->wiov[conn->wiovcnt-1];
+
+        if (last->base == NULL) {
+            last->len += size;
+        } else if (add_iov(conn, NULL, conn->wbuf->size - size, size, NULL, NULL) < 0) {
+            err_write("conn_send: no memory.");
+            return -1;
+        }
+    }
+    return size;
+}
+
+/*
+ * 応答データをコピーせずに参照として送信待ちに追加します。
+ * 送信が終わった時点(またはエラーの場合)に release(ref) が呼び出されます。
+ * 小さなデータと io_uring のコネクションではコピーして直ちに解放します。
+ *
+ * 戻り値
+ *  追加したバイト数
+ *  エラーの場合は -1
+ */
+int conn_send_ref(struct conn_t* conn, const void* buf, int size,
+                  void (*release)(void* ref), void* ref)
+{
+    int result;
+
+#ifndef _WIN32
+    if (conn->io_mode != CONN_IO_URING && size >= CONN_REF_MIN) {
+        int pending = ((conn->wbuf)? conn->wbuf->size : 0) + conn->wrefbytes;
+
+        if (conn->werror || (pending + size > CONN_WBUF_FLUSH && pending > 0)) {
+            if (conn_flush(conn) < 0) {
+                (*release)(ref);
+                return -1;
+            }
+        }
+        if (conn->wiovcnt == 0 && conn->wbuf && conn->wbuf->size > 0) {
+            /* 送信待ちバッファのデータを先頭の断片にします。*/
+            if (add_iov(conn, NULL, 0, conn->wbuf->size, NULL, NULL) < 0) {
+                (*release)(ref);
+                return -1;
+            }
+        }
+        if (add_iov(conn, (const char*)buf, 0, size, release, ref) < 0) {
+            err_write("conn_send_ref: no memory.");
+            (*release)(ref);
+            return -1;
+        }
+        conn->wrefbytes += size;
+        return size;
+    }
+#endif
+    result = conn_send(conn, buf, size);
+    (*release)(ref);
+    return result;
+}
@@ -0,0 +1,595 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * 有効期限切れデータのバックグラウンド削除
+ *
+ * 有効期限を指定して保存されたキーをタイマーホイールに登録しておき、
+ * 掃除スレッドが期限を過ぎたキーをデータベースから削除します。
+ * 読み込まれないまま期限が切れたデータもファイルに残らなくなります。
+ *
+ * タイマーホイールは１秒単位の EXPIRE_SLOTS 個のスロットで構成され、
+ * キーは期限を過ぎる時刻(有効期限 + 1秒) % EXPIRE_SLOTS のスロットに
+ * 追加されます。
+ * スロットごとにロックを持つため、登録で他のスロットと競合しません。
+ * 掃除スレッドは１秒ごとに経過した時刻のスロットを調べて、期限を
+ * 過ぎたキーを取り出します。EXPIRE_SLOTS 秒より先の期限のキーは
+ * スロットに残り、ホイールが一周したときに再び調べられます。
+ *
+ * キーごとに登録した有効期限はキーの索引に保持して、１つのキーは
+ * １つの期限でのみ登録します。同じ期限か後の期限で保存し直した場合は
+ * 登録しません(上書きを繰り返すキーで項目が増え続けないようにします)。
+ * 登録した期限に掃除スレッドがデータベースの有効期限を確認して、
+ * 延長されていた場合はその期限で登録し直します。前の期限で保存した
+ * 場合は索引の期限を変更してスロットに追加します。スロットに残った
+ * 古い期限の項目は索引の期限と一致しないため処理されません。
+ * 索引はキーのハッシュ値で EXPIRE_STRIPES 個に分割して、それぞれが
+ * ロックと拡張可能なハッシュ表を持ちます。
+ *
+ * 取り出したキーは１秒あたり nio.expire_rate 件までを削除して、
+ * 残りは次の周期に回します(大量の期限切れでデータベースへの負荷が
+ * 集中しないようにします)。削除の前にはデータベースの有効期限を
+ * 確認するため、touch などで期限が延長されたキーや上書きされたキーは
+ * 削除されません。
+ *
+ * 起動時にデータベースにあるキーはホイールに登録されていないため、
+ * 掃除スレッドがカーソルで全キーを走査して登録します(期限切れのキーは
+ * その場で削除します)。走査は１秒あたり nio.expire_rate の
+ * EXPIRE_SCAN_FACTOR 倍のキーまでです。
+ * flush_all はデータベースを作り直すため、expire_pause() で掃除を
+ * 止めてカーソルを閉じてから行います。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nio_server.h"
+
+#define EXPIRE_SLOTS        4096        /* スロット数(２のべき乗) */
+#define EXPIRE_SCAN_FACTOR  10          /* 起動時の走査の削除に対する倍率 */
+#define EXPIRE_STRIPES      256         /* キーの索引の分割数(２のべき乗) */
+#define EXPIRE_TABLE_INIT   64          /* 分割ごとのハッシュ表の初期サイズ */
+
+/* スロットの項目 */
+struct expire_entry_t {
+    struct expire_entry_t* next;
+    uint exptime;                       /* 登録時の有効期限 */
+    int keysize;
+    char key[1];
+};
+
+struct expire_slot_t {
+    CS_DEF(lock);
+    struct expire_entry_t* head;
+};
+
+/* キーの索引の項目 */
+struct expire_key_t {
+    struct expire_key_t* next;
+    uint hash;
+    uint exptime;                       /* スロットに登録した有効期限 */
+    int keysize;
+    char key[1];
+};
+
+struct expire_stripe_t {
+    CS_DEF(lock);
+    struct expire_key_t** table;
+    int size;                           /* ハッシュ表のサイズ(２のべき乗) */
+    int count;
+};
+
+static struct expire_slot_t* wheel = NULL;
+static struct expire_stripe_t* stripes = NULL;
+static volatile uint wheel_time;        /* 処理済みの時刻 */
+static volatile int sweeper_stop = 0;
+static volatile int sweeper_running = 0;
+
+static CS_DEF(sweep_lock);              /* 掃除と flush_all の排他 */
+static struct nio_cursor_t* scan_cursor = NULL;
+
+static void sleep_msec(int msec)
+{
+#ifdef _WIN32
+    Sleep(msec);
+#else
+    usleep(msec * 1000);
+#endif
+}
+
+/* FNV-1a */
+static uint key_hash(const char* key, int keysize)
+{
+    uint h = 2166136261U;
+    int i;
+
+    for (i = 0; i < keysize; i++) {
+        h ^= (uchar)key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static struct expire_stripe_t* get_stripe(uint hash)
+{
+    return &stripes[hash & (EXPIRE_STRIPES - 1)];
+}
+
+/*
+ * 索引からキーを検索します。
+ *
+ * 戻り値
+ *  キーの項目を指すポインタの位置(ない場合は NULL を指します)
+ */
+static struct expire_key_t** find_key(struct expire_stripe_t* st, uint hash,
+                                      const char* key, int keysize)
+{
+    struct expire_key_t** pp;
+
+    /* 下位ビットは分割の選択に使用しているため上位ビットを使用します。*/
+    pp = &st->table[(hash >> 8) & (st->size - 1)];
+    while (*pp) {
+        struct expire_key_t* k = *pp;
+
+        if (k->hash == hash && k->keysize == keysize &&
+            memcmp(k->key, key, keysize) == 0)
+            break;
+        pp = &k->next;
+    }
+    return pp;
+}
+
+/*
+ * 項目数がハッシュ表のサイズを超えた場合は２倍に拡張します。
+ * 拡張できない場合はそのまま使用します。
+ */
+static void grow_table(struct expire_stripe_t* st)
+{
+    struct expire_key_t** table;
+    int size = st->size * 2;
+    int i;
+
+    table = (struct expire_key_t**)calloc(size, sizeof(struct expire_key_t*));
+    if (table == NULL)
+        return;
+    for (i = 0; i < st->size; i++) {
+        struct expire_key_t* k = st->table[i];
+
+        while (k) {
+            struct expire_key_t* next = k->next;
+            int index = (k->hash >> 8) & (size - 1);
+
+            k->next = table[index];
+            table[index] = k;
+            k = next;
+        }
+    }
+    free(st->table);
+    st->table = table;
+    st->size = size;
+}
+
+/*
+ * キーの項目をスロットに追加します。
+ */
+static void push_entry(const char* key, int keysize, uint exptime)
+{
+    struct expire_entry_t* e;
+    struct expire_slot_t* slot;
+    uint due;
+
+    e = (struct expire_entry_t*)malloc(sizeof(struct expire_entry_t) + keysize);
+    if (e == NULL) {
+        err_write("expire_add: no memory.");
+        return;
+    }
+    e->exptime = exptime;
+    e->keysize = keysize;
+    memcpy(e->key, key, keysize);
+
+    /* 期限を過ぎる時刻が処理済みの場合は次の周期で処理します。*/
+    due = exptime + 1;
+    if (due <= wheel_time)
+        due = wheel_time + 1;
+    slot = &wheel[due & (EXPIRE_SLOTS - 1)];
+    CS_START(&slot->lock);
+    e->next = slot->head;
+    slot->head = e;
+    CS_END(&slot->lock);
+}
+
+/*
+ * キーを有効期限のスロットに登録します。
+ * 有効期限を指定してデータを保存した後に呼び出します。
+ * 同じ期限か前の期限で登録済みのキーは登録しません。
+ */
+void expire_add(const char* key, int keysize, uint exptime)
+{
+    struct expire_stripe_t* st;
+    struct expire_key_t** pp;
+    uint hash;
+
+    if (wheel == NULL || exptime == 0)
+        return;
+
+    hash = key_hash(key, keysize);
+    st = get_stripe(hash);
+    CS_START(&st->lock);
+    pp = find_key(st, hash, key, keysize);
+    if (*pp) {
+        if ((*pp)->exptime <= exptime) {
+            /* 登録済みの期限で確認して登録し直します。*/
+            CS_END(&st->lock);
+            return;
+        }
+        (*pp)->exptime = exptime;
+    } else {
+        struct expire_key_t* k;
+
+        k = (struct expire_key_t*)malloc(sizeof(struct expire_key_t) + keysize);
+        if (k == NULL) {
+            CS_END(&st->lock);
+            err_write("expire_add: no memory.");
+            return;
+        }
+        k->hash = hash;
+        k->exptime = exptime;
+        k->keysize = keysize;
+        memcpy(k->key, key, keysize);
+        k->next = *pp;
+        *pp = k;
+        if (++st->count > st->size)
+            grow_table(st);
+        ATOMIC_ADD(g_stats.expire_index_items, 1);
+    }
+    CS_END(&st->lock);
+    push_entry(key, keysize, exptime);
+}
+
+/*
+ * スロットの項目が索引に登録されている期限と一致するかを判定します。
+ */
+static int is_registered(const char* key, int keysize, uint exptime)
+{
+    struct expire_stripe_t* st;
+    struct expire_key_t** pp;
+    uint hash;
+    int result;
+
+    hash = key_hash(key, keysize);
+    st = get_stripe(hash);
+    CS_START(&st->lock);
+    pp = find_key(st, hash, key, keysize);
+    result = (*pp && (*pp)->exptime == exptime);
+    CS_END(&st->lock);
+    return result;
+}
+
+/*
+ * 登録した期限(old_exptime)で確認したキーの索引を更新します。
+ * データベースの有効期限(exptime)が延長されている場合は
+ * その期限で登録し直し、それ以外の場合は索引から削除します。
+ * 確認中に他のスレッドが前の期限で登録した場合は何もしません。
+ */
+static void update_key(const char* key, int keysize, uint old_exptime, uint exptime)
+{
+    struct expire_stripe_t* st;
+    struct expire_key_t** pp;
+    uint hash;
+    int requeue = 0;
+
+    hash = key_hash(key, keysize);
+    st = get_stripe(hash);
+    CS_START(&st->lock);
+    pp = find_key(st, hash, key, keysize);
+    if (*pp && (*pp)->exptime == old_exptime) {
+        if (exptime > old_exptime) {
+            (*pp)->exptime = exptime;
+            requeue = 1;
+        } else {
+            struct expire_key_t* k = *pp;
+
+            *pp = k->next;
+            free(k);
+            st->count--;
+            ATOMIC_ADD(g_stats.expire_index_items, -1);
+        }
+    }
+    CS_END(&st->lock);
+    if (requeue)
+        push_entry(key, keysize, exptime);
+}
+
+/*
+ * スロットから期限を過ぎたキーを取り出して pending に追加します。
+ */
+static struct expire_entry_t* collect_slot(struct expire_slot_t* slot, uint now,
+                                           struct expire_entry_t* pending)
+{
+    struct expire_entry_t** pp;
+
+    CS_START(&slot->lock);
+    pp = &slot->head;
+    while (*pp) {
+        struct expire_entry_t* e = *pp;
+
+        if (e->exptime < now) {
+            *pp = e->next;
+            e->next = pending;
+            pending = e;
+        } else {
+            pp = &e->next;
+        }
+    }
+    CS_END(&slot->lock);
+    return pending;
+}
+
+/*
+ * 取り出したキーを limit 件まで削除します。
+ *
+ * 戻り値
+ *  残りのキー
+ */
+static struct expire_entry_t* sweep(struct expire_entry_t* pending, int limit)
+{
+    while (pending && limit > 0) {
+        struct expire_entry_t* e = pending;
+        uint exptime;
+        int bytes;
+
+        pending = e->next;
+        /* 前の期限で登録し直されたキーの古い項目は処理しません。*/
+        if (is_registered(e->key, e->keysize, e->exptime)) {
+            if (memcached_expire(e->key, e->keysize, &exptime, &bytes)) {
+                ATOMIC_ADD(g_stats.expired_reclaimed, 1);
+                ATOMIC_ADD(g_stats.expired_reclaimed_bytes, (int64)bytes);
+                exptime = 0;
+            }
+            update_key(e->key, e->keysize, e->exptime, exptime);
+            limit--;
+        }
+        free(e);
+    }
+    return pending;
+}
+
+/*
+ * 起動時にデータベースにあるキーを limit 件まで登録します。
+ *
+ * 戻り値
+ *  0: 継続
+ *  1: 終了
+ */
+static int scan_keys(struct nio_cursor_t* cur, int limit)
+{
+    while (limit-- > 0) {
+        char key[MAX_MEMCACHED_KEYSIZE+1];
+        int keysize;
+        int done;
+        uint exptime;
+        int bytes;
+
+        keysize = nio_cursor_key(cur, key, sizeof(key));
+        if (keysize < 1 || keysize > (int)sizeof(key))
+            return 1;
+        /* キーが削除される場合があるため先にカーソルを進めます。*/
+        done = nio_cursor_next(cur);
+
+        if (memcached_expire(key, keysize, &exptime, &bytes)) {
+            ATOMIC_ADD(g_stats.expired_reclaimed, 1);
+            ATOMIC_ADD(g_stats.expired_reclaimed_bytes, (int64)bytes);
+        } else if (exptime > 0) {
+            expire_add(key, keysize, exptime);
+        }
+        if (done)
+            return 1;
+    }
+    return 0;
+}
+
+static void sweeper_thread(void* argv)
+{
+    struct expire_entry_t* pending = NULL;
+
+    /* argv unuse */
+    CS_START(&sweep_lock);
+    scan_cursor = nio_cursor_open(g_conf->nio_db);
+    CS_END(&sweep_lock);
+
+    while (! sweeper_stop && ! g_shutdown_flag) {
+        uint now;
+        int i;
+
+        /* 停止要求に早く応じるため短い間隔で確認します。*/
+        for (i = 0; i < 10 && ! sweeper_stop; i++)
+            sleep_msec(100);
+        if (sweeper_stop)
+            break;
+
+        CS_START(&sweep_lock);
+        now = (uint)current_seconds();
+        if (now - wheel_time > EXPIRE_SLOTS)
+            wheel_time = now - EXPIRE_SLOTS;
+        while (wheel_time < now) {
+            wheel_time++;
+            pending = collect_slot(&wheel[wheel_time & (EXPIRE_SLOTS - 1)], now, pending);
+        }
+        pending = sweep(pending, g_conf->expire_rate);
+
+        if (scan_cursor && scan_keys(scan_cursor, g_conf->expire_rate * EXPIRE_SCAN_FACTOR)) {
+            nio_cursor_close(scan_cursor);
+            scan_cursor = NULL;
+        }
+        CS_END(&sweep_lock);
+    }
+
+    CS_START(&sweep_lock);
+    if (scan_cursor) {
+        nio_cursor_close(scan_cursor);
+        scan_cursor = NULL;
+    }
+    CS_END(&sweep_lock);
+    while (pending) {
+        struct expire_entry_t* e = pending;
+
+        pending = e->next;
+        free(e);
+    }
+    sweeper_running = 0;
+#ifdef _WIN32
+    _endthread();
+#endif
+}
+
+/*
+ * 掃除を止めて起動時の走査のカーソルを閉じます。
+ * データベースを作り直す(flush_all)前に呼び出して、作り直した後に
+ * expire_resume() を呼び出します。
+ * 作り直したデータベースは走査しません。
+ */
+void expire_pause()
+{
+    if (wheel == NULL)
+        return;
+    CS_START(&sweep_lock);
+    if (scan_cursor) {
+        nio_cursor_close(scan_cursor);
+        scan_cursor = NULL;
+    }
+}
+
+void expire_resume()
+{
+    if (wheel == NULL)
+        return;
+    CS_END(&sweep_lock);
+}
+
+/*
+ * タイマーホイールとキーの索引を作成して掃除スレッドを開始します。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー
+ */
+int expire_open()
+{
+    int i;
+#ifdef _WIN32
+    uintptr_t thread_id;
+#else
+    pthread_t thread_id;
+#endif
+
+    stripes = (struct expire_stripe_t*)calloc(EXPIRE_STRIPES, sizeof(struct expire_stripe_t));
+    if (stripes == NULL) {
+        err_write("expire_open: no memory.");
+        return -1;
+    }
+    for (i = 0; i < EXPIRE_STRIPES; i++) {
+        stripes[i].table = (struct expire_key_t**)calloc(EXPIRE_TABLE_INIT,
+                                                         sizeof(struct expire_key_t*));
+        if (stripes[i].table == NULL) {
+            err_write("expire_open: no memory.");
+            while (--i >= 0)
+                free(stripes[i].table);
+            free(stripes);
+            stripes = NULL;
+            return -1;
+        }
+        stripes[i].size = EXPIRE_TABLE_INIT;
+        CS_INIT(&stripes[i].lock);
+    }
+
+    wheel = (struct expire_slot_t*)calloc(EXPIRE_SLOTS, sizeof(struct expire_slot_t));
+    if (wheel == NULL) {
+        err_write("expire_open: no memory.");
+        for (i = 0; i < EXPIRE_STRIPES; i++)
+            free(stripes[i].table);
+        free(stripes);
+        stripes = NULL;
+        return -1;
+    }
+    for (i = 0; i < EXPIRE_SLOTS; i++)
+        CS_INIT(&wheel[i].lock);
+    CS_INIT(&sweep_lock);
+    wheel_time = (uint)current_seconds();
+
+    sweeper_stop = 0;
+    sweeper_running = 1;
+#ifdef _WIN32
+    thread_id = _beginthread(sweeper_thread, 0, NULL);
+#else
+    pthread_create(&thread_id, NULL, (void*)sweeper_thread, NULL);
+    pthread_detach(thread_id);
+#endif
+    return 0;
+}
+
+/*
+ * 掃除スレッドを停止してタイマーホイールとキーの索引を解放します。
+ * データベースをクローズする前に呼び出します。
+ */
+void expire_close()
+{
+    int i;
+
+    if (wheel == NULL)
+        return;
+    sweeper_stop = 1;
+    while (sweeper_running)
+        sleep_msec(10);
+
+    for (i = 0; i < EXPIRE_SLOTS; i++) {
+        struct expire_entry_t* e = wheel[i].head;
+
+        while (e) {
+            struct expire_entry_t* next = e->next;
+
+            free(e);
+            e = next;
+        }
+    }
+    free(wheel);
+    wheel = NULL;
+
+    for (i = 0; i < EXPIRE_STRIPES; i++) {
+        int j;
+
+        for (j = 0; j < stripes[i].size; j++) {
+            struct expire_key_t* k = stripes[i].table[j];
+
+            while (k) {
+                struct expire_key_t* next = k->next;
+
+                free(k);
+                k = next;
+            }
+        }
+        free(stripes[i].table);
+    }
+    free(stripes);
+    stripes = NULL;
+}
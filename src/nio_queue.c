@@ -0,0 +1,298 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * ディスパッチキュー
+ *
+ * イベントループからワーカースレッドへコネクションを渡すための
+ * 固定長のリングバッファです。複数のスレッドが同時に追加(push)と
+ * 取り出し(pop)を行うことができ、ロックは使用しません。
+ *
+ * 各セルはシーケンス番号を持ち、追加位置(enqueue_pos)または
+ * 取り出し位置(dequeue_pos)とシーケンス番号の差からセルが
+ * 使用可能かを判定します。位置の更新は CAS で行います。
+ * (Dmitry Vyukov の bounded MPMC queue)
+ *
+ * セルはあらかじめ確保されているため、リクエストごとのメモリの
+ * 確保と解放は行いません。
+ *
+ * キューが空のとき、ワーカースレッドはしばらくスピンして待機し、
+ * それでもデータが入らない場合は条件変数で休止します。
+ * 追加したスレッドは休止しているスレッドがいる場合のみ通知します。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nio_server.h"
+
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+#ifdef _WIN32
+#define LOAD_ACQUIRE(var)       (var)
+#define STORE_RELEASE(var, n)   ((var) = (n))
+#define CAS(var, old, n)        (InterlockedCompareExchange64(&(var), (n), (old)) == (old))
+#define CPU_RELAX()             YieldProcessor()
+#else
+#define LOAD_ACQUIRE(var)       __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(var, n)   __atomic_store_n(&(var), (n), __ATOMIC_RELEASE)
+#define CAS(var, old, n)        __sync_bool_compare_and_swap(&(var), (old), (n))
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_RELAX()             __asm__ __volatile__("pause")
+#else
+#define CPU_RELAX()             __asm__ __volatile__("" ::: "memory")
+#endif
+#endif
+
+#define DQ_CACHE_LINE   64          /* キャッシュラインのサイズ */
+#define DQ_SPIN_COUNT   2000        /* 休止するまでのスピン回数 */
+
+struct dq_cell_t {
+    volatile int64 seq;             /* シーケンス番号 */
+    struct conn_t* conn;
+    uint gen;                       /* 追加時の conn->gen */
+};
+
+struct dispatch_queue_t {
+    struct dq_cell_t* cells;
+    int64 mask;                     /* セル数 - 1 */
+    char pad1[DQ_CACHE_LINE];
+    volatile int64 enqueue_pos;     /* 追加位置 */
+    char pad2[DQ_CACHE_LINE];
+    volatile int64 dequeue_pos;     /* 取り出し位置 */
+    char pad3[DQ_CACHE_LINE];
+    volatile int64 sleepers;        /* 休止しているスレッド数 */
+#ifdef _WIN32
+    HANDLE cond;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+};
+
+/*
+ * ディスパッチキューを作成します。
+ * セル数は size 以上の２のべき乗になります。
+ *
+ * 戻り値
+ *  ディスパッチキューのポインタ
+ *  エラーの場合は NULL
+ */
+struct dispatch_queue_t* dq_initialize(int size)
+{
+    struct dispatch_queue_t* dq;
+    int64 n = 2;
+    int64 i;
+
+    while (n < size)
+        n <<= 1;
+
+    dq = (struct dispatch_queue_t*)calloc(1, sizeof(struct dispatch_queue_t));
+    if (dq == NULL) {
+        err_write("dq_initialize: no memory.");
+        return NULL;
+    }
+    dq->cells = (struct dq_cell_t*)malloc(sizeof(struct dq_cell_t) * (size_t)n);
+    if (dq->cells == NULL) {
+        err_write("dq_initialize: no memory size=%d.", (int)n);
+        free(dq);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        dq->cells[i].seq = i;
+        dq->cells[i].conn = NULL;
+        dq->cells[i].gen = 0;
+    }
+    dq->mask = n - 1;
+#ifdef _WIN32
+    dq->cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&dq->mutex, NULL);
+    pthread_cond_init(&dq->cond, NULL);
+#endif
+    return dq;
+}
+
+void dq_finalize(struct dispatch_queue_t* dq)
+{
+    if (dq == NULL)
+        return;
+    /* 休止しているワーカースレッドが参照しているため解放しません。
+       (プロセスの終了時に解放されます)*/
+    if (dq->sleepers > 0)
+        return;
+#ifdef _WIN32
+    CloseHandle(dq->cond);
+#else
+    pthread_cond_destroy(&dq->cond);
+    pthread_mutex_destroy(&dq->mutex);
+#endif
+    free(dq->cells);
+    free(dq);
+}
+
+static int try_push(struct dispatch_queue_t* dq, struct conn_t* conn, uint gen)
+{
+    struct dq_cell_t* cell;
+    int64 pos = dq->enqueue_pos;
+
+    for (;;) {
+        int64 dif;
+
+        cell = &dq->cells[pos & dq->mask];
+        dif = LOAD_ACQUIRE(cell->seq) - pos;
+        if (dif == 0) {
+            if (CAS(dq->enqueue_pos, pos, pos + 1))
+                break;
+            pos = dq->enqueue_pos;
+        } else if (dif < 0) {
+            return -1;  /* full */
+        } else {
+            pos = dq->enqueue_pos;
+        }
+    }
+    cell->conn = conn;
+    cell->gen = gen;
+    STORE_RELEASE(cell->seq, pos + 1);
+    return 0;
+}
+
+static int try_pop(struct dispatch_queue_t* dq, struct conn_t** conn, uint* gen)
+{
+    struct dq_cell_t* cell;
+    int64 pos = dq->dequeue_pos;
+
+    for (;;) {
+        int64 dif;
+
+        cell = &dq->cells[pos & dq->mask];
+        dif = LOAD_ACQUIRE(cell->seq) - (pos + 1);
+        if (dif == 0) {
+            if (CAS(dq->dequeue_pos, pos, pos + 1))
+                break;
+            pos = dq->dequeue_pos;
+        } else if (dif < 0) {
+            return -1;  /* empty */
+        } else {
+            pos = dq->dequeue_pos;
+        }
+    }
+    *conn = cell->conn;
+    *gen = cell->gen;
+    STORE_RELEASE(cell->seq, pos + dq->mask + 1);
+    return 0;
+}
+
+static int is_empty(struct dispatch_queue_t* dq)
+{
+    int64 pos = dq->dequeue_pos;
+
+    return (LOAD_ACQUIRE(dq->cells[pos & dq->mask].seq) - (pos + 1) < 0);
+}
+
+/*
+ * コネクションをキューに追加します。
+ * キューが満杯の場合は空きができるまで待機します。
+ *
+ * 戻り値
+ *  0: 成功
+ */
+int dq_push(struct dispatch_queue_t* dq, struct conn_t* conn, uint gen)
+{
+    while (try_push(dq, conn, gen) < 0) {
+#ifdef _WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    }
+
+    /* 休止しているスレッドがいる場合のみ通知します。
+       休止する側は sleepers を増やしてからキューを確認するため、
+       どちらかが必ず相手の更新を参照します。*/
+    MEMORY_BARRIER();
+    if (dq->sleepers > 0) {
+#ifdef _WIN32
+        SetEvent(dq->cond);
+#else
+        pthread_mutex_lock(&dq->mutex);
+        pthread_cond_signal(&dq->cond);
+        pthread_mutex_unlock(&dq->mutex);
+#endif
+    }
+    return 0;
+}
+
+/*
+ * キューからコネクションを取り出します。
+ * キューが空の場合はデータが追加されるまで待機します。
+ *
+ * gen: 追加時の conn->gen が設定されます。
+ *
+ * 戻り値
+ *  コネクションのポインタ
+ */
+struct conn_t* dq_pop(struct dispatch_queue_t* dq, uint* gen)
+{
+    struct conn_t* conn;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < DQ_SPIN_COUNT; i++) {
+            if (try_pop(dq, &conn, gen) == 0)
+                return conn;
+            CPU_RELAX();
+        }
+
+        /* スピンしてもデータが入らないので休止します。*/
+#ifdef _WIN32
+        ATOMIC_ADD(dq->sleepers, 1);
+        MEMORY_BARRIER();
+        if (is_empty(dq))
+            WaitForSingleObject(dq->cond, INFINITE);
+        ATOMIC_ADD(dq->sleepers, -1);
+#else
+        pthread_mutex_lock(&dq->mutex);
+        ATOMIC_ADD(dq->sleepers, 1);
+        MEMORY_BARRIER();
+        while (is_empty(dq))
+            pthread_cond_wait(&dq->cond, &dq->mutex);
+        ATOMIC_ADD(dq->sleepers, -1);
+        pthread_mutex_unlock(&dq->mutex);
+#endif
+    }
+}
+
+/*
+ * キューに入っているコネクションの数を返します。
+ */
+int dq_depth(struct dispatch_queue_t* dq)
+{
+    int64 n = dq->enqueue_pos - dq->dequeue_pos;
+
+    return (n > 0)? (int)n : 0;
+}
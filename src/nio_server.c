@@ -35,105 +35,844 @@
  * 1. listenソケットを監視対象に登録します。
  * 2. 多重I/Oで受信したソケットが listenソケットであれば
  *    accept にてクライアントソケット取得して監視対象に登録します。
+ *    listenソケットはノンブロッキングモードで、１回の通知で
+ *    キューに溜まっているすべての接続を受け付けます。
  * 3. 多重I/Oで受信したソケットがクライアントソケットであれば
  *    スレッドキューに登録してワーカスレッドで処理します。
  * 4. ワーカスレッド内でソケットのクローズが行われた場合は
  *    監視対象から外します。
+ *
+ * リアクター方式(nio.reactors に 1 以上を指定)
+ *
+ * 指定された数のリアクタースレッドを起動します。
+ * 各リアクターは SO_REUSEPORT を指定した専用の listenソケットと
+ * 多重I/Oのイベントを持ち、accept からコマンドの処理と応答までを
+ * 自スレッド内で行います。スレッド間でのリクエストの受け渡しは
+ * 行わないため、ワーカスレッドとキューは使用しません。
+ * 接続の各リアクターへの振り分けはカーネルが行います。
+ * nio.dispatch_quantum のコマンド数を処理したコネクションは保留リストに
+ * 追加され、待機解除用のパイプで他のコネクションのイベントの後に
+ * 処理を再開します。
+ *
+ * nio.unix_socket が指定された場合は Unix ドメインソケットの listenソケットを
+ * 作成して TCP の listenソケットと同じイベントループで受け付けます。
+ * リアクター方式では最初のリアクターが受け付けます。
+ * このソケットから受け付けたコネクションはローカル(conn->local)として
+ * 扱われます。
+ *
+ * configure --enable-io-uring で作成した場合、リアクターは多重I/Oの
+ * 代わりに io_uring で accept・受信・送信を行います(nio_uring.c)。
+ * カーネルが対応していない場合は多重I/Oで処理します。
+ *
+ * nio.udp_port が指定された場合は UDP のスレッドを起動して get, gets を
+ * 処理します(nio_udp.c)。UDP はどちらの方式でも同じ処理になります。
+ *
+ * nio.idle_timeout が指定された場合はアイドル監視スレッドを起動して
+ * １秒ごとにコネクションテーブルを調べ、タイムアウトしたコネクションを
+ * shutdown() します。クローズは各方式の FIN受信の処理で行われます。
+ *
+ * fd が不足して accept() ができない場合は、起動時に確保した予備の fd を
+ * 解放して接続を受け付け、直ちにクローズします。接続が listenキューに
+ * 残ったままイベントが通知され続けることを防ぎます。
+ *
+ * 時刻スレッドは 100ミリ秒ごとに現在時刻(秒)を g_current_time に設定
+ * します。有効期限の計算や判定、アイドル時間の記録はこの値を参照して、
+ * リクエストやキーごとに時刻を取得しないようにしています。
  */
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#if defined(HAVE_ACCEPT4) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "nio_server.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
+
+#if defined(SO_REUSEPORT) && !defined(_WIN32)
+#define USE_REACTOR
+#endif
+
+#define ACCEPT_BATCH    256     /* まとめて登録するコネクション数 */
+#define CLOCK_INTERVAL_MSEC 100 /* 時刻を更新する間隔(ミリ秒) */
+#define ACCEPT_ERROR_INTERVAL 10    /* accept() のエラーを出力する間隔(秒) */
+
+#ifndef _WIN32
+/* fd 不足時に接続を拒否するための予備の fd */
+static int reserve_fd = -1;
+static CS_DEF(reserve_lock);
+#endif
+static int64 accept_error_time = 0;     /* accept() のエラーを出力した時刻 */
+
+/* サーバー起動時の listenキューの統計値(/proc/net/netstat) */
+static int64 base_listen_overflows = 0;
+static int64 base_listen_drops = 0;
+
+#ifdef USE_REACTOR
+/* リアクター */
+struct reactor_t {
+    int no;                     /* リアクター番号 */
+    SOCKET listen_socket;       /* SO_REUSEPORT の listenソケット */
+    void* sock_event;           /* 多重I/Oのイベント */
+    int wakeup_fd[2];           /* 待機解除用のパイプ */
+    pthread_t thread_id;        /* スレッドID */
+    struct thread_args_t* pending;  /* 処理を保留しているコネクション */
+    int pending_signaled;       /* パイプに通知済み */
+};
+
+static struct reactor_t* reactors = NULL;
+static __thread struct reactor_t* cur_reactor = NULL;
+static int use_uring = 0;
+#endif
+
 static int is_shutdown()
 {
     return g_shutdown_flag;
 }
 
-static int sock_event_cb(SOCKET socket)
+static int set_nonblocking(SOCKET socket)
 {
-    int n;
-    struct sockaddr_in sockaddr;
+#ifdef _WIN32
+    u_long on = 1;
 
-    if (socket == g_listen_socket) {
-        SOCKET client_socket;
-        char sockkey[16];
-        struct sock_buf_t* sockbuf;
+    return ioctlsocket(socket, FIONBIO, &on);
+#else
+    int flags;
 
-        n = sizeof(struct sockaddr);
-        client_socket = accept(g_listen_socket, (struct sockaddr*)&sockaddr, (socklen_t*)&n);
-        if (client_socket < 0)
-            return 0;
-        if (g_shutdown_flag) {
-            SOCKET_CLOSE(client_socket);
-            return -1;
-        }
+    flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
 
-        if (g_trace_mode) {
-            char ip_addr[256];
+static SOCKET accept_socket(SOCKET listen_socket, struct sockaddr_in* sockaddr)
+{
+    socklen_t n = sizeof(struct sockaddr_in);
+    SOCKET socket;
 
-            mt_inet_ntoa(sockaddr.sin_addr, ip_addr);
-            TRACE("connect from %s, socket=%d ... \n", ip_addr, client_socket);
-        }
-        if (sock_event_add(g_sock_event, client_socket) < 0) {
-            SOCKET_CLOSE(client_socket);
-            return -1;
+#ifdef HAVE_ACCEPT4
+    socket = accept4(listen_socket, (struct sockaddr*)sockaddr, &n, SOCK_CLOEXEC);
+#else
+    socket = accept(listen_socket, (struct sockaddr*)sockaddr, &n);
+#ifndef _WIN32
+    if (socket >= 0)
+        fcntl(socket, F_SETFD, FD_CLOEXEC);
+#endif
+#endif
+    return socket;
+}
+
+/*
+ * Unix ドメインソケットの listenソケットを作成します。
+ * 既に存在するソケットファイルは削除されます。
+ *
+ * 戻り値
+ *  listenソケット
+ *  エラーの場合は INVALID_SOCKET
+ */
+SOCKET unix_listen(const char* path, int backlog)
+{
+#ifdef _WIN32
+    err_write("unix_listen: unix domain socket is not supported.");
+    return INVALID_SOCKET;
+#else
+    SOCKET sock;
+    struct sockaddr_un sockaddr;
+
+    if (strlen(path) >= sizeof(sockaddr.sun_path)) {
+        err_write("unix_listen: path too long: %s", path);
+        return INVALID_SOCKET;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        err_write("unix_listen: socket() error: %s", strerror(errno));
+        return INVALID_SOCKET;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    strcpy(sockaddr.sun_path, path);
+
+    /* 前回の実行で残ったソケットファイルを削除します。*/
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+        err_write("unix_listen: bind() error path=%s: %s", path, strerror(errno));
+        SOCKET_CLOSE(sock);
+        return INVALID_SOCKET;
+    }
+    if (listen(sock, backlog) < 0) {
+        err_write("unix_listen: listen() error: %s", strerror(errno));
+        SOCKET_CLOSE(sock);
+        unlink(path);
+        return INVALID_SOCKET;
+    }
+    if (set_nonblocking(sock) < 0) {
+        err_write("unix_listen: set_nonblocking() error: %s", strerror(errno));
+        SOCKET_CLOSE(sock);
+        unlink(path);
+        return INVALID_SOCKET;
+    }
+    return sock;
+#endif
+}
+
+static void reserve_open()
+{
+#ifndef _WIN32
+    CS_INIT(&reserve_lock);
+    reserve_fd = open("/dev/null", O_RDONLY);
+    if (reserve_fd >= 0)
+        fcntl(reserve_fd, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+/*
+ * accept() のエラーを処理します。
+ * fd が不足している場合(EMFILE, ENFILE)は予備の fd を解放して接続を
+ * １つ受け付けて直ちにクローズします。
+ * エラーの出力は ACCEPT_ERROR_INTERVAL 秒に１回までです。
+ *
+ * listen_socket: listenソケット
+ * err: エラー番号
+ *
+ * 戻り値
+ *  1: 接続を拒否した(続けて受け付ける)
+ *  0: 受け付けを終了する
+ */
+int accept_error(SOCKET listen_socket, int err)
+{
+    int shed = 0;
+    int64 now = current_seconds();
+    int64 last = accept_error_time;
+
+    ATOMIC_ADD(g_stats.accept_errors, 1);
+#ifndef _WIN32
+    if (err == EMFILE || err == ENFILE) {
+        CS_START(&reserve_lock);
+        if (reserve_fd >= 0) {
+            SOCKET socket;
+
+            close(reserve_fd);
+            socket = accept(listen_socket, NULL, NULL);
+            if (socket >= 0) {
+                SOCKET_CLOSE(socket);
+                shed = 1;
+            }
         }
-        /* ソケットバッファを作成します。*/
-        sockbuf = sockbuf_alloc(client_socket);
-        if (sockbuf == NULL) {
-            err_write("sock_event_cb: sockbuf_alloc no memory");
-            SOCKET_CLOSE(client_socket);
-            return -1;
+        /* 他のスレッドに取られた場合は次のエラーで再度確保します。*/
+        reserve_fd = open("/dev/null", O_RDONLY);
+        if (reserve_fd >= 0)
+            fcntl(reserve_fd, F_SETFD, FD_CLOEXEC);
+        CS_END(&reserve_lock);
+        if (shed)
+            ATOMIC_ADD(g_stats.rejected_connections, 1);
+    }
+#endif
+    if (now - last >= ACCEPT_ERROR_INTERVAL && ATOMIC_CAS(accept_error_time, last, now)) {
+        err_write("accept() error: %s (accept_errors=%lld)",
+                  strerror(err), (long long)g_stats.accept_errors);
+    }
+    return shed;
+}
+
+/*
+ * 統計値 var を n が大きい場合に更新します。
+ */
+void stats_max(int64* var, int64 n)
+{
+    int64 cur;
+
+    while ((cur = *(volatile int64*)var) < n) {
+        if (ATOMIC_CAS(*var, cur, n))
+            break;
+    }
+}
+
+static void register_client(SOCKET client_socket, struct in_addr addr, int local, void* sock_event)
+{
+    struct conn_t* conn;
+
+    if (g_trace_mode) {
+        char ip_addr[256];
+
+        mt_inet_ntoa(addr, ip_addr);
+        TRACE("connect from %s, socket=%d ... \n", ip_addr, client_socket);
+    }
+    /* コネクションテーブルに登録します。*/
+    conn = conn_open(client_socket, addr, sock_event);
+    if (conn == NULL) {
+        SOCKET_CLOSE(client_socket);
+        return;
+    }
+    conn->local = local;
+    if (sock_event_add(sock_event, client_socket) < 0)
+        conn_close(conn);
+}
+
+static int accept_clients(SOCKET listen_socket, void* sock_event)
+{
+    SOCKET sockets[ACCEPT_BATCH];
+    struct sockaddr_in addrs[ACCEPT_BATCH];
+    int total = 0;
+    int end_flag = 0;
+    int local = (listen_socket == g_unix_socket);
+
+    /* listenキューが空になるまで受け付けます。*/
+    while (! end_flag) {
+        int n = 0;
+        int i;
+
+        while (n < ACCEPT_BATCH) {
+            SOCKET client_socket;
+
+            client_socket = accept_socket(listen_socket, &addrs[n]);
+            if (client_socket < 0) {
+#ifndef _WIN32
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    /* EMFILE, ENFILE, ENOBUFS など */
+                    if (accept_error(listen_socket, errno))
+                        continue;
+                }
+#endif
+                end_flag = 1;
+                break;
+            }
+            if (local) {
+                /* Unix ドメインソケットはループバックのアドレスとします。*/
+                addrs[n].sin_family = AF_INET;
+                addrs[n].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            }
+            sockets[n++] = client_socket;
         }
-        snprintf(sockkey, sizeof(sockkey), "%d", client_socket);
-        if (hash_put(g_sockbuf_hash, sockkey, sockbuf) < 0) {
-            err_write("sock_event_cb: hsh_put failed");
-            SOCKET_CLOSE(client_socket);
+
+        if (g_shutdown_flag) {
+            for (i = 0; i < n; i++)
+                SOCKET_CLOSE(sockets[i]);
             return -1;
         }
-    } else {
-        n = sizeof(struct sockaddr);
-        getpeername(socket, (struct sockaddr*)&sockaddr, (socklen_t*)&n);
 
-        /* リクエスト処理中はイベント通知を無効にします。*/
-        sock_event_disable(g_sock_event, socket);
-        /* リクエストを処理します。*/
-        memcached_request(socket, sockaddr);
+        /* 受け付けたソケットをまとめて登録します。*/
+        for (i = 0; i < n; i++)
+            register_client(sockets[i], addrs[i].sin_addr, local, sock_event);
+        total += n;
+    }
+
+    stats_max(&g_stats.accept_batch_max, total);
+    return 0;
+}
+
+static int sock_event_cb(SOCKET socket)
+{
+    struct conn_t* conn;
+
+    if (socket == g_listen_socket)
+        return accept_clients(g_listen_socket, g_sock_event);
+    if (socket == g_unix_socket)
+        return accept_clients(g_unix_socket, g_sock_event);
+
+    conn = conn_get(socket);
+    if (conn == NULL) {
+        err_write("sock_event_cb: not found connection socket=%d", socket);
+        return 0;
     }
+
+    /* リクエスト処理中はイベント通知を無効にします。*/
+    sock_event_disable(g_sock_event, socket);
+    /* リクエストを処理します。*/
+    memcached_request(conn);
     return 0;
 }
 
+static void reaper_thread(void* argv)
+{
+    /* argv unuse */
+    while (! g_shutdown_flag) {
+        int n;
+
+#ifdef _WIN32
+        Sleep(1000);
+#else
+        sleep(1);
+#endif
+        n = conn_reap(g_conf->idle_timeout);
+        if (n > 0)
+            ATOMIC_ADD(g_stats.idle_closed, n);
+    }
+#ifdef _WIN32
+    _endthread();
+#endif
+}
+
+static void reaper_open()
+{
+#ifdef _WIN32
+    uintptr_t thread_id;
+#else
+    pthread_t thread_id;
+#endif
+
+    if (g_conf->idle_timeout < 1)
+        return;
+#ifdef _WIN32
+    thread_id = _beginthread(reaper_thread, 0, NULL);
+#else
+    pthread_create(&thread_id, NULL, (void*)reaper_thread, NULL);
+    pthread_detach(thread_id);
+#endif
+}
+
+/*
+ * 現在時刻(秒)を g_current_time に定期的に設定します。
+ * 有効期限の判定などはキーごとに時刻を取得せずにこの値を参照します。
+ */
+static void clock_thread(void* argv)
+{
+    /* argv unuse */
+    while (! g_shutdown_flag) {
+#ifdef _WIN32
+        Sleep(CLOCK_INTERVAL_MSEC);
+#else
+        usleep(CLOCK_INTERVAL_MSEC * 1000);
+#endif
+        g_current_time = system_seconds();
+    }
+#ifdef _WIN32
+    _endthread();
+#endif
+}
+
+static void clock_open()
+{
+#ifdef _WIN32
+    uintptr_t thread_id;
+#else
+    pthread_t thread_id;
+#endif
+
+    g_current_time = system_seconds();
+#ifdef _WIN32
+    thread_id = _beginthread(clock_thread, 0, NULL);
+#else
+    pthread_create(&thread_id, NULL, (void*)clock_thread, NULL);
+    pthread_detach(thread_id);
+#endif
+}
+
 static int sock_init()
 {
+    if (set_nonblocking(g_listen_socket) < 0) {
+        err_write("nio_server: set_nonblocking() error: %s", strerror(errno));
+        return -1;
+    }
     g_sock_event = sock_event_create();
     if (g_sock_event == NULL)
         return -1;
     if (sock_event_add(g_sock_event, g_listen_socket) < 0)
         return -1;
-    g_sockbuf_hash = hash_initialize(1031);
-    if (g_sockbuf_hash == NULL) {
-        err_write("nio_server: hash_initialize failure.");
-        return -1;
+    if (g_unix_socket != INVALID_SOCKET) {
+        if (sock_event_add(g_sock_event, g_unix_socket) < 0)
+            return -1;
     }
+    if (conn_initialize() < 0)
+        return -1;
+    reaper_open();
     return 0;
 }
 
 static void sock_final()
 {
-    if (g_sockbuf_hash)
-        hash_finalize(g_sockbuf_hash);
+    conn_finalize();
     if (g_sock_event)
         sock_event_close(g_sock_event);
 }
 
+#ifdef USE_REACTOR
+static SOCKET reuseport_listen(ushort port, int backlog)
+{
+    SOCKET sock;
+    int on = 1;
+    struct sockaddr_in sockaddr;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        err_write("reuseport_listen: socket() error: %s", strerror(errno));
+        return INVALID_SOCKET;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        err_write("reuseport_listen: setsockopt() error: %s", strerror(errno));
+        SOCKET_CLOSE(sock);
+        return INVALID_SOCKET;
+    }
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    sockaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+        err_write("reuseport_listen: bind() error port=%d: %s", port, strerror(errno));
+        SOCKET_CLOSE(sock);
+        return INVALID_SOCKET;
+    }
+    if (listen(sock, backlog) < 0) {
+        err_write("reuseport_listen: listen() error: %s", strerror(errno));
+        SOCKET_CLOSE(sock);
+        return INVALID_SOCKET;
+    }
+    if (set_nonblocking(sock) < 0) {
+        err_write("reuseport_listen: set_nonblocking() error: %s", strerror(errno));
+        SOCKET_CLOSE(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+static void reactor_defer(struct reactor_t* r, struct conn_t* conn)
+{
+    struct thread_args_t* th_args;
+    const char dummy = 0x30;
+
+    th_args = (struct thread_args_t*)malloc(sizeof(struct thread_args_t));
+    if (th_args == NULL) {
+        err_write("reactor_defer: no memory.");
+        return;
+    }
+    th_args->conn = conn;
+    th_args->gen = conn->gen;
+    th_args->next = r->pending;
+    r->pending = th_args;
+
+    if (! r->pending_signaled) {
+        /* 他のイベントの後で再開するためにパイプに通知します。*/
+        write(r->wakeup_fd[1], &dummy, sizeof(dummy));
+        r->pending_signaled = 1;
+    }
+}
+
+static void reactor_resume(struct reactor_t* r)
+{
+    struct thread_args_t* list = NULL;
+
+    /* 保留した順に処理するためにリストを反転します。*/
+    while (r->pending) {
+        struct thread_args_t* p = r->pending;
+
+        r->pending = p->next;
+        p->next = list;
+        list = p;
+    }
+    r->pending_signaled = 0;
+
+    while (list) {
+        struct thread_args_t* p = list;
+        struct conn_t* conn = p->conn;
+
+        list = p->next;
+        /* 保留中にクローズされたコネクションは無視します。*/
+        if (conn->socket != INVALID_SOCKET && conn->gen == p->gen) {
+            if (memcached_process(conn) > 0)
+                reactor_defer(r, conn);
+        }
+        free(p);
+    }
+}
+
+static int reactor_event_cb(SOCKET socket)
+{
+    struct reactor_t* r = cur_reactor;
+    struct conn_t* conn;
+
+    if (socket == r->wakeup_fd[0]) {
+        char dummy;
+
+        /* 待機解除の通知を読み捨てます。*/
+        read(r->wakeup_fd[0], &dummy, sizeof(dummy));
+        if (r->pending)
+            reactor_resume(r);
+        return 0;
+    }
+    if (socket == r->listen_socket)
+        return accept_clients(r->listen_socket, r->sock_event);
+    if (socket == g_unix_socket)
+        return accept_clients(g_unix_socket, r->sock_event);
+
+    conn = conn_get(socket);
+    if (conn == NULL) {
+        err_write("reactor_event_cb: not found connection socket=%d", socket);
+        return 0;
+    }
+    /* 自スレッドでリクエストを処理します。*/
+    if (memcached_process(conn) > 0)
+        reactor_defer(r, conn);
+    return 0;
+}
+
+static void* reactor_thread(void* argv)
+{
+    struct reactor_t* r = (struct reactor_t*)argv;
+
+    cur_reactor = r;
+    if (use_uring) {
+        /* リングが作成できない場合は多重I/Oで処理します。*/
+        if (uring_loop(r->listen_socket,
+                       (r->no == 0)? g_unix_socket : INVALID_SOCKET,
+                       r->wakeup_fd[0]) == 0)
+            return NULL;
+    }
+    sock_event_loop(r->sock_event, reactor_event_cb, is_shutdown);
+    return NULL;
+}
+
+static int reactor_init(struct reactor_t* r, int no)
+{
+    r->no = no;
+    r->listen_socket = INVALID_SOCKET;
+    r->wakeup_fd[0] = r->wakeup_fd[1] = -1;
+
+    r->listen_socket = reuseport_listen(g_conf->port_no, g_conf->backlog);
+    if (r->listen_socket == INVALID_SOCKET)
+        return -1;
+    if (pipe(r->wakeup_fd) < 0) {
+        err_write("reactor_init: pipe() error: %s", strerror(errno));
+        return -1;
+    }
+    r->sock_event = sock_event_create();
+    if (r->sock_event == NULL)
+        return -1;
+    if (sock_event_add(r->sock_event, r->listen_socket) < 0)
+        return -1;
+    if (sock_event_add(r->sock_event, r->wakeup_fd[0]) < 0)
+        return -1;
+    /* Unix ドメインソケットは最初のリアクターで受け付けます。*/
+    if (no == 0 && g_unix_socket != INVALID_SOCKET) {
+        if (sock_event_add(r->sock_event, g_unix_socket) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void reactor_final(struct reactor_t* r)
+{
+    while (r->pending) {
+        struct thread_args_t* p = r->pending;
+
+        r->pending = p->next;
+        free(p);
+    }
+    if (r->sock_event)
+        sock_event_close(r->sock_event);
+    if (r->listen_socket != INVALID_SOCKET) {
+        shutdown(r->listen_socket, 2);  /* 2: RDWR stop */
+        SOCKET_CLOSE(r->listen_socket);
+    }
+    if (r->wakeup_fd[0] >= 0)
+        close(r->wakeup_fd[0]);
+    if (r->wakeup_fd[1] >= 0)
+        close(r->wakeup_fd[1]);
+}
+
+static void reactor_server()
+{
+    int i;
+    int started = 0;
+
+    reactors = (struct reactor_t*)calloc(g_conf->reactors, sizeof(struct reactor_t));
+    if (reactors == NULL) {
+        err_write("nio_server: no memory.");
+        return;
+    }
+    if (conn_initialize() < 0)
+        goto final;
+    reaper_open();
+
+#ifdef HAVE_IO_URING
+    use_uring = uring_available();
+    if (! use_uring)
+        err_write("nio_server: io_uring is not available, use epoll.");
+    TRACE("reactor I/O: %s\n", use_uring? "io_uring" : "epoll");
+#endif
+
+    for (i = 0; i < g_conf->reactors; i++) {
+        if (reactor_init(&reactors[i], i) < 0)
+            goto final;
+    }
+    for (i = 0; i < g_conf->reactors; i++) {
+        if (pthread_create(&reactors[i].thread_id, NULL, reactor_thread, &reactors[i]) != 0) {
+            err_write("nio_server: pthread_create() error: %s", strerror(errno));
+            g_shutdown_flag = 1;
+            reactor_wakeup();
+            break;
+        }
+        started++;
+    }
+
+    /* すべてのリアクターが終了するまで待機します。*/
+    for (i = 0; i < started; i++)
+        pthread_join(reactors[i].thread_id, NULL);
+
+final:
+    for (i = 0; i < g_conf->reactors; i++)
+        reactor_final(&reactors[i]);
+    conn_finalize();
+    free(reactors);
+    reactors = NULL;
+}
+#endif
+
+#ifdef __linux__
+static int proc_netstat(int64* overflows, int64* drops)
+{
+    FILE* fp;
+    char names[4096];
+    char values[4096];
+    int found = 0;
+
+    *overflows = *drops = 0;
+    fp = fopen("/proc/net/netstat", "r");
+    if (fp == NULL)
+        return -1;
+
+    /* "TcpExt: name ..." と "TcpExt: value ..." の２行で構成されます。*/
+    while (fgets(names, sizeof(names), fp) != NULL) {
+        char *np, *vp;
+        char *nsave, *vsave;
+
+        if (fgets(values, sizeof(values), fp) == NULL)
+            break;
+        if (strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+
+        np = strtok_r(names, " \n", &nsave);
+        vp = strtok_r(values, " \n", &vsave);
+        while (np && vp) {
+            if (strcmp(np, "ListenOverflows") == 0) {
+                *overflows = atoi64(vp);
+                found++;
+            } else if (strcmp(np, "ListenDrops") == 0) {
+                *drops = atoi64(vp);
+                found++;
+            }
+            np = strtok_r(NULL, " \n", &nsave);
+            vp = strtok_r(NULL, " \n", &vsave);
+        }
+        break;
+    }
+    fclose(fp);
+    return (found > 0)? 0 : -1;
+}
+
+static void listen_queue(SOCKET socket, int* qlen, int* qmax)
+{
+    struct tcp_info ti;
+    socklen_t n = sizeof(ti);
+
+    if (socket == INVALID_SOCKET)
+        return;
+    /* listenソケットでは tcpi_unacked が現在の acceptキューの長さ、
+       tcpi_sacked が backlog になります。*/
+    if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &ti, &n) == 0) {
+        *qlen += ti.tcpi_unacked;
+        *qmax += ti.tcpi_sacked;
+    }
+}
+#endif
+
+/*
+ * listenキューの統計情報を取得します。
+ * オーバーフロー数はシステム全体の値で、サーバー起動後の増分になります。
+ * Linux 以外では 0 が設定されます。
+ *
+ * overflows: acceptキューが溢れた回数
+ * drops: 破棄された接続要求の数
+ * qlen: 現在の acceptキューの長さ(全 listenソケットの合計)
+ * qmax: acceptキューの最大長(全 listenソケットの合計)
+ */
+void listen_stats(int64* overflows, int64* drops, int* qlen, int* qmax)
+{
+    *overflows = *drops = 0;
+    *qlen = *qmax = 0;
+
+#ifdef __linux__
+    if (proc_netstat(overflows, drops) == 0) {
+        *overflows -= base_listen_overflows;
+        *drops -= base_listen_drops;
+    }
+
+    listen_queue(g_listen_socket, qlen, qmax);
+#ifdef USE_REACTOR
+    if (reactors) {
+        int i;
+
+        for (i = 0; i < g_conf->reactors; i++)
+            listen_queue(reactors[i].listen_socket, qlen, qmax);
+    }
+#endif
+#endif
+}
+
+/*
+ * すべてのリアクターの多重I/Oの待機を解除します。
+ * シャットダウン時に使用します。
+ */
+void reactor_wakeup()
+{
+#ifdef USE_REACTOR
+    int i;
+    const char dummy = 0x30;
+
+    if (reactors == NULL)
+        return;
+    for (i = 0; i < g_conf->reactors; i++) {
+        if (reactors[i].wakeup_fd[1] >= 0)
+            write(reactors[i].wakeup_fd[1], &dummy, sizeof(dummy));
+    }
+#endif
+}
+
 void nio_server()
 {
     g_start_time = system_time();
+    clock_open();
+    reserve_open();
+#ifdef __linux__
+    proc_netstat(&base_listen_overflows, &base_listen_drops);
+#endif
+
+#ifndef USE_REACTOR
+    if (g_conf->reactors > 0) {
+        err_write("nio_server: reactors is not supported, use worker threads.");
+        g_conf->reactors = 0;
+    }
+#endif
 
     if (memcached_open() < 0)
         return;
+    if (udp_server() < 0) {
+        memcached_close();
+        return;
+    }
+
+#ifdef USE_REACTOR
+    if (g_conf->reactors > 0) {
+        reactor_server();
+        memcached_close();
+        return;
+    }
+#endif
+
     if (sock_init() < 0)
         goto final;
     if (memcached_worker_open() < 0)
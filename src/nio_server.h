@@ -33,15 +33,172 @@
 #define DEFAULT_PORT            11211   /* memcached listen port */
 #define DEFAULT_BACKLOG         100     /* listen backlog number */
 #define DEFAULT_WORKER_THREADS  4       /* worker threads number */
+#define DEFAULT_REACTORS        0       /* reactor threads number(0 is not use) */
+#define DEFAULT_DISPATCH_QUANTUM 64     /* commands processed per dispatch */
+#define DISPATCH_QUEUE_SIZE     65536   /* cells of the dispatch queue */
+#define DEFAULT_MAX_CONNECTIONS 0       /* max connections(0 is unlimited) */
+#define DEFAULT_IDLE_TIMEOUT    0       /* idle timeout seconds(0 is not use) */
+#define DEFAULT_UDP_PORT        0       /* udp port number(0 is not use) */
+#define DEFAULT_UDP_THREADS     1       /* udp thread number */
+#define DEFAULT_UDP_BIND        "0.0.0.0"   /* udp bind address */
 #define DEFAULT_BUCKET_NUM      1000000 /* hash bucket size */
+#define DEFAULT_ZEROCOPY_SIZE   0       /* min value size sent by MSG_ZEROCOPY(0 is not use) */
+#define DEFAULT_CACHE_SIZE      0       /* hot object cache size(MB, 0 is not use) */
+#define DEFAULT_BLOOM_KEYS      0       /* expected keys of the bloom filter(0 is not use) */
+#define DEFAULT_EXPIRE_RATE     0       /* expired items deleted per second(0 is not use) */
+#define DEFAULT_APPEND_CHUNKS   0       /* segments of appended data before compaction(0 is not use) */
 
 #define STATUS_CMD          "__/status/__"
 #define SHUTDOWN_CMD        "__/shutdown/__"
 
+/* protocol of connection(detected by the first byte) */
+#define CONN_PROTO_NONE     0
+#define CONN_PROTO_TEXT     1
+#define CONN_PROTO_BINARY   2
+
+#define PROTOCOL_BINARY_REQ 0x80    /* binary protocol request magic */
+
+/* connection I/O mode */
+#define CONN_IO_SOCKET      0           /* recv()/send() */
+#define CONN_IO_URING       1           /* io_uring completion */
+
+/* submitted io_uring requests of connection */
+#define CONN_URING_RECV     0x01        /* multishot recv is armed */
+#define CONN_URING_SEND     0x02        /* send is in flight */
+#define CONN_URING_CLOSING  0x04        /* close after requests completed */
+#define CONN_URING_SHUT     0x08        /* shutdown() was called */
+#define CONN_URING_DEFER    0x10        /* in the pending list */
+
+/* connection */
+/* send segment of a connection */
+struct conn_iov_t {
+    const char* base;                   /* referenced data(NULL is the offset of wbuf) */
+    int offset;                         /* offset of wbuf */
+    int len;                            /* segment size */
+    void (*release)(void* ref);         /* called after the segment was sent */
+    void* ref;
+};
+
+/* reference waiting for the MSG_ZEROCOPY completion */
+struct conn_zcref_t {
+    uint first;                         /* first zerocopy send id using the reference */
+    uint seq;                           /* last zerocopy send id using the reference */
+    int pending;                        /* number of sends not completed */
+    int len;
+    void (*release)(void* ref);
+    void* ref;
+};
+
+struct conn_t {
+    SOCKET socket;                      /* client socket(INVALID_SOCKET is unused) */
+    struct in_addr addr;                /* client address */
+    void* sock_event;                   /* socket event of owner */
+    int io_mode;                        /* CONN_IO_SOCKET or CONN_IO_URING */
+    char* rbuf;                         /* receive buffer */
+    int rbufsize;                       /* receive buffer size */
+    int rpos;                           /* start position of unprocessed data */
+    int rlen;                           /* unprocessed data size */
+    int need;                           /* data size needed by parked command */
+    int last_time;                      /* last request time(seconds) */
+    int local;                          /* accepted from the unix domain socket */
+    int protocol;                       /* CONN_PROTO_XXX */
+    struct membuf_t* wbuf;              /* pending send data */
+    struct conn_iov_t* wiov;            /* pending send segments(wbuf and references) */
+    int wiovcnt;                        /* number of wiov in use */
+    int wiovsize;                       /* allocated number of wiov */
+    int wrefbytes;                      /* bytes referenced by wiov */
+    int werror;                         /* send failed(later sends are discarded) */
+    int zerocopy;                       /* SO_ZEROCOPY(0 is unknown, 1 is enabled, -1 is unsupported) */
+    struct conn_zcref_t* zcref;         /* references waiting for zerocopy completion */
+    int zcrefcnt;                       /* number of zcref in use */
+    int zcrefsize;                      /* allocated number of zcref */
+    int zcbytes;                        /* bytes referenced by zcref */
+    uint zcseq;                         /* next zerocopy send id */
+    struct membuf_t* sbuf;              /* sending data(io_uring) */
+    int spos;                           /* sent size of sbuf(io_uring) */
+    uint gen;                           /* reuse generation of socket number */
+    volatile int reaping;               /* idle reaper is using the socket(1) */
+    int uring_stat;                     /* CONN_URING_XXX flags */
+};
+
+/* server statistics */
+struct nio_stats_t {
+    int64 curr_connections;             /* current connections */
+    int64 total_connections;            /* total accepted connections */
+    int64 accept_errors;                /* accept() errors(EMFILE etc.) */
+    int64 accept_batch_max;             /* max connections accepted at one event */
+    int64 dispatch_yields;              /* dispatches ended by the quantum */
+    int64 rejected_connections;         /* connections over max_connections */
+    int64 idle_closed;                  /* connections closed by idle_timeout */
+    int64 udp_requests;                 /* udp requests processed */
+    int64 udp_errors;                   /* malformed udp requests and send errors */
+    int64 zerocopy_sends;               /* sendmsg() calls with MSG_ZEROCOPY */
+    int64 zerocopy_copied;              /* zerocopy sends the kernel copied anyway */
+    int64 expired_reclaimed;            /* expired items deleted by the sweeper */
+    int64 expired_reclaimed_bytes;      /* data bytes deleted by the sweeper */
+    int64 expire_index_items;           /* keys in the expiry index */
+    int64 chunk_appends;                /* append/prepend stored as a segment */
+    int64 chunk_compactions;            /* chunked data compacted into one segment */
+};
+
+/* hot object cache statistics */
+struct cache_stats_t {
+    int64 hits;
+    int64 misses;
+    int64 items;                        /* cached items */
+    int64 bytes;                        /* bytes of cached items */
+    int64 evictions;                    /* items evicted by CLOCK */
+    int64 rejects;                      /* items not admitted by frequency */
+};
+
+/* memcached data block */
+#define DATABLOCK_HEADER_SIZE   (sizeof(uchar)+sizeof(uint)+sizeof(uint))
+
+/* the first byte of the data block header */
+#define DATA_HEADER_CHUNKED     0x80    /* data is stored as segments(nio_chunk.c) */
+#define DATA_HEADER_ALLOCATED   0x40    /* segments joined by malloc() */
+
+#define CHUNK_MIN_SIZE          4096    /* smallest data block appended as a segment */
+#define CHUNK_KEY_PREFIX        "\001chunk\001"    /* key prefix of the segments */
+#define CHUNK_KEY_PREFIX_SIZE   ((int)sizeof(CHUNK_KEY_PREFIX) - 1)
+
+#define MAX_MEMCACHED_KEYSIZE   250
+#define MAX_MEMCACHED_DATASIZE  (1*1024*1024+DATABLOCK_HEADER_SIZE)   /* 1MB + data block header */
+#define MAX_META_DATALEN        (MAX_MEMCACHED_DATASIZE-DATABLOCK_HEADER_SIZE)  /* <datalen> of ms */
+
+#define META_CLOSE      -2      /* meta_command() result to close the connection */
+
+#define CHECK_NONE      0
+#define CHECK_ADD       1
+#define CHECK_REPLACE   2
+
+#define UPDATE_APPEND   1
+#define UPDATE_PREPEND  2
+
+#define MODE_INCR       1
+#define MODE_DECR       2
+
+#define STORE_STORED     0
+#define STORE_NOT_STORED -1
+#define STORE_EXISTS     -2
+#define STORE_NOT_FOUND  -3
+#define STORE_TOO_LARGE  -4
+#define STORE_NO_MEMORY  -5
+#define STORE_BAD_VALUE  -6
+
+/* command line token */
+#define MAX_TOKENS      24
+
+struct token_t {
+    char* value;                        /* NULL terminated in the command line */
+    int length;
+};
+
 /* thread argument */
 struct thread_args_t {
-    SOCKET socket;
-    struct sockaddr_in sockaddr;
+    struct conn_t* conn;
+    uint gen;                           /* conn->gen when requested */
+    struct thread_args_t* next;         /* next of the pending list */
 };
 
 /* program configuration */
@@ -50,11 +207,24 @@ struct nio_conf_t {
     char username[256];                 /* execute as username(Linux/MacOSX only) */
     ushort port_no;                     /* listen port number */
     int backlog;                        /* listen backlog number */
+    char unix_socket[MAX_PATH+1];       /* unix domain socket path(empty is not use) */
+    ushort udp_port;                    /* udp port number(0 is not use) */
+    char udp_bind[64];                  /* udp bind address */
+    int udp_threads;                    /* udp thread number */
     int worker_threads;                 /* worker thread number */
+    int reactors;                       /* reactor thread number(SO_REUSEPORT) */
+    int dispatch_quantum;               /* commands per dispatch(0 is unlimited) */
+    int max_connections;                /* max connections(0 is unlimited) */
+    int idle_timeout;                   /* idle seconds to close(0 is no timeout) */
+    int zerocopy_size;                  /* min value size sent by MSG_ZEROCOPY(0 is not use) */
     char nio_path[MAX_PATH+1];          /* nestaIO database file path */
     struct nio_t* nio_db;               /* nestaIO database object */
     int nio_bucket_num;                 /* nestaIO bucket number */
     int nio_mmap_size;                  /* nestaIO mmap size(MB) */
+    int cache_size;                     /* hot object cache size(MB, 0 is not use) */
+    int bloom_keys;                     /* expected keys of the bloom filter(0 is not use) */
+    int expire_rate;                    /* expired items deleted per second(0 is not use) */
+    int append_chunks;                  /* segments of appended data before compaction(0 is not use) */
     char error_file[MAX_PATH+1];        /* error file name */
     char output_file[MAX_PATH+1];       /* output file name */
 };
@@ -65,6 +235,16 @@ struct nio_conf_t {
         fprintf(stdout, fmt, __VA_ARGS__); \
     }
 
+#ifdef _WIN32
+#define MEMORY_BARRIER()    MemoryBarrier()
+#define ATOMIC_ADD(var, n)  InterlockedExchangeAdd64(&(var), (n))
+#define ATOMIC_CAS(var, old, n) (InterlockedCompareExchange64(&(var), (n), (old)) == (old))
+#else
+#define MEMORY_BARRIER()    __sync_synchronize()
+#define ATOMIC_ADD(var, n)  __sync_fetch_and_add(&(var), (n))
+#define ATOMIC_CAS(var, old, n) __sync_bool_compare_and_swap(&(var), (old), (n))
+#endif
+
 #ifdef _WIN32
 #define get_abspath(abs_path, path, maxlen) \
     _fullpath(abs_path, path, maxlen)
@@ -84,6 +264,16 @@ struct nio_conf_t* g_conf;  /* read only configure data */
 #endif
 SOCKET g_listen_socket;     /* listen socket */
 
+#ifndef _MAIN
+    extern
+#endif
+SOCKET g_unix_socket;       /* unix domain socket listener */
+
+#ifndef _MAIN
+    extern
+#endif
+SOCKET g_udp_socket;        /* udp socket */
+
 #ifndef _MAIN
     extern
 #endif
@@ -97,13 +287,21 @@ int g_trace_mode;           /* not zero is trace mode */
 #ifndef _MAIN
     extern
 #endif
-struct queue_t* g_queue;    /* request queue */
+struct dispatch_queue_t* g_queue;   /* request queue */
 
 #ifndef _MAIN
     extern
 #endif
 int64 g_start_time;         /* start time of server */
 
+#ifndef _MAIN
+    extern
+#endif
+volatile int g_current_time;    /* coarse clock updated by the clock thread(seconds) */
+
+/* current time in seconds without a system call */
+#define current_seconds()   (g_current_time)
+
 
 #ifndef _MAIN
     extern
@@ -113,7 +311,7 @@ void* g_sock_event;         /* socket event */
 #ifndef _MAIN
     extern
 #endif
-struct hash_t* g_sockbuf_hash;
+struct nio_stats_t g_stats; /* server statistics */
 
 /* prototypes */
 #ifdef __cplusplus
@@ -125,17 +323,125 @@ int config(const char* conf_fname);
 
 /* nio_server.c */
 void nio_server(void);
+void reactor_wakeup(void);
+void listen_stats(int64* overflows, int64* drops, int* qlen, int* qmax);
+SOCKET unix_listen(const char* path, int backlog);
+int accept_error(SOCKET listen_socket, int err);
+void stats_max(int64* var, int64 n);
+
+/* nio_conn.c */
+int conn_initialize(void);
+void conn_finalize(void);
+struct conn_t* conn_open(SOCKET socket, struct in_addr addr, void* sock_event);
+struct conn_t* conn_get(SOCKET socket);
+void conn_close(struct conn_t* conn);
+int conn_append(struct conn_t* conn, const char* buf, int size);
+int conn_recv(struct conn_t* conn);
+const char* find_crlf(const char* p, int n);
+char* conn_line(struct conn_t* conn, int maxlen, int* len);
+int conn_nchar(struct conn_t* conn, char* buf, int size);
+char* conn_nptr(struct conn_t* conn, int size);
+int conn_int(struct conn_t* conn, int* status);
+int64 conn_int64(struct conn_t* conn, int* status);
+int conn_send(struct conn_t* conn, const void* buf, int size);
+int conn_send_ref(struct conn_t* conn, const void* buf, int size,
+                  void (*release)(void* ref), void* ref);
+int conn_flush(struct conn_t* conn);
+void conn_shrink(struct conn_t* conn);
+int conn_reap(int timeout);
+
+/* nio_uring.c */
+int uring_available(void);
+int uring_loop(SOCKET listen_socket, SOCKET unix_socket, int wakeup_fd);
+
+/* nio_udp.c */
+SOCKET udp_listen(const char* addr, ushort port);
+int udp_server(void);
+
+/* nio_queue.c */
+struct dispatch_queue_t* dq_initialize(int size);
+void dq_finalize(struct dispatch_queue_t* dq);
+int dq_push(struct dispatch_queue_t* dq, struct conn_t* conn, uint gen);
+struct conn_t* dq_pop(struct dispatch_queue_t* dq, uint* gen);
+int dq_depth(struct dispatch_queue_t* dq);
+
+/* nio_cache.c */
+int cache_initialize(int size_mb);
+void cache_finalize(void);
+char* cache_get(const char* key, int keysize, int* dsize, int64* cas, uint* gen);
+char* cache_add(const char* key, int keysize, const char* dbuf, int dsize, int64 cas, uint gen);
+void cache_release(void* data);
+void cache_remove(const char* key, int keysize);
+void cache_clear(void);
+void cache_stats(struct cache_stats_t* st);
+
+/* nio_bloom.c */
+int bloom_initialize(struct nio_t* nio, int keys);
+void bloom_finalize(void);
+void bloom_add(const char* key, int keysize);
+void bloom_remove(const char* key, int keysize);
+int bloom_maybe(const char* key, int keysize);
+void bloom_clear(void);
+int64 bloom_size(void);
+
+/* nio_expire.c */
+int expire_open(void);
+void expire_close(void);
+void expire_add(const char* key, int keysize, uint exptime);
+void expire_pause(void);
+void expire_resume(void);
+
+/* nio_chunk.c */
+int chunk_open(void);
+void chunk_close(void);
+void chunk_lock(const char* key, int keysize);
+void chunk_unlock(const char* key, int keysize);
+int chunk_bytes(const char* head);
+char* chunk_load(const char* head, int hsize, int* dsize);
+void chunk_remove(const char* head, int hsize);
+int chunk_update(const char* key, int keysize, char* dbuf, int dsize, int64 cas,
+                 const char* data, int bytes, int mode);
 
 /* nio_command.c */
 void stop_server(void);
 void status_server(void);
 
 /* memcached.c */
-int memcached_request(SOCKET socket, struct sockaddr_in sockaddr);
+int memcached_request(struct conn_t* conn);
+int memcached_process(struct conn_t* conn);
+int memcached_ready(struct conn_t* conn);
+void set_data_header(char* buf, uint flags, uint exptime);
+void get_data_header(const char* buf, uint* flags, uint* exptime);
+char* memcached_datablock(struct conn_t* conn, char* data, int bytes,
+                          uint flags, uint exptime, char* save);
+void memcached_datablock_release(char* buf, char* data, const char* save);
+int tokenize(char* line, struct token_t* tokens, int max_tokens, char** rest);
+int token_uint64(const char* s, int len, uint64* n);
+int token_uint(const char* s, int len, uint* n);
+int token_int(const char* s, int len, int* n);
+char* memcached_get(const char* key, int keysize, int* bytes, uint* flags, int64* cas);
+void memcached_release(void* dbuf);
+int memcached_delete(const char* key, int keysize);
+int memcached_expire(const char* key, int keysize, uint* exptime, int* bytes);
+int memcached_store(const char* key, int keysize, const char* buf, int bufsize,
+                    int cas_flag, int64 cas, int check_mode);
+int memcached_update(const char* key, int keysize, const char* data, int bytes, int mode);
+int memcached_incr(const char* key, int keysize, int mode, uint64 delta, uint64* val);
+int memcached_touch(const char* key, int keysize, uint exptime);
+int memcached_flush(void);
+void memcached_stats(struct membuf_t* mb);
+int memcached_udp_command(char* cmdline, struct membuf_t* mb, int max_keys, int max_reply);
 int memcached_worker_open(void);
 int memcached_open(void);
 void memcached_close(void);
 
+/* memcached_meta.c */
+int meta_command(struct conn_t* conn, int n, struct token_t* tokens);
+
+/* memcached_binary.c */
+int binary_command_size(const char* p, int n);
+int binary_command(struct conn_t* conn);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,429 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * UDP プロトコル
+ *
+ * nio.udp_port が指定された場合に UDP で get と gets を処理します。
+ * 小さなデータを大量に取得する場合に、コネクションの管理や
+ * イベント通知の切り替えを行わずに処理することができます。
+ *
+ * 各データグラムの先頭には 8バイトのフレームヘッダーが付きます。
+ * 数値はすべてネットワークバイトオーダーです。
+ *
+ * +----------+----------+----------+----------+
+ * |request id|sequence  |total     |reserved  |
+ * |   (2)    |   (2)    |   (2)    |   (2)    |
+ * +----------+----------+----------+----------+
+ *
+ * リクエストは１つのデータグラムに収まる必要があります(total は 1)。
+ * 送信元を偽装した要求による増幅を抑えるため、１つの要求のキーは
+ * UDP_MAX_KEYS まで、応答は UDP_MAX_REPLY_DATAGRAMS のデータグラムまでで、
+ * 超える場合はエラーを応答します。
+ * 応答は UDP_MAX_PAYLOAD ごとに分割され、request id はリクエストと
+ * 同じ値、sequence は 0 からの連番、total は分割数になります。
+ * データグラムの順序はクライアントで sequence により並べ替えます。
+ *
+ * nio.udp_threads の数のスレッドが同じソケットから受信します。
+ * 受信は recvmmsg() で複数のデータグラムをまとめて行い、応答も
+ * sendmmsg() でまとめて送信します。
+ * recvmmsg()/sendmmsg() がないシステムでは１データグラムずつ処理します。
+ *
+ * 受信タイムアウトを１秒に設定して、シャットダウンを検出します。
+ * ソケットは nio.udp_bind のアドレスにバインドします。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if (defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "nio_server.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#define UDP_HEADER_SIZE     8
+#define UDP_MAX_PAYLOAD     1400    /* フレームヘッダーを含むデータグラムのサイズ */
+#define UDP_RECV_SIZE       8192    /* 受信するデータグラムの最大サイズ */
+#define UDP_RECV_BATCH      32      /* まとめて受信するデータグラムの数 */
+#define UDP_SEND_BATCH      64      /* まとめて送信するデータグラムの数 */
+#define UDP_MAX_KEYS        16      /* １つの要求のキーの最大数 */
+#define UDP_MAX_REPLY_DATAGRAMS 8   /* １つの応答のデータグラムの最大数 */
+#define UDP_MAX_REPLY       (UDP_MAX_REPLY_DATAGRAMS * (UDP_MAX_PAYLOAD - UDP_HEADER_SIZE))
+
+#ifndef _WIN32
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+#define udp_msg_t mmsghdr
+#else
+struct udp_msg_t {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+/* スレッドごとの作業領域 */
+struct udp_worker_t {
+    /* 受信 */
+    struct udp_msg_t rmsgs[UDP_RECV_BATCH];
+    struct iovec riov[UDP_RECV_BATCH];
+    struct sockaddr_in raddr[UDP_RECV_BATCH];
+    char rbuf[UDP_RECV_BATCH][UDP_RECV_SIZE+1];
+    struct membuf_t* reply[UDP_RECV_BATCH];     /* 応答データ */
+
+    /* 送信 */
+    int scount;
+    struct udp_msg_t smsgs[UDP_SEND_BATCH];
+    struct iovec siov[UDP_SEND_BATCH][2];
+    uchar shdr[UDP_SEND_BATCH][UDP_HEADER_SIZE];
+};
+#endif
+
+/*
+ * UDP のソケットを作成します。
+ *
+ * addr: バインドする IPv4 アドレス
+ * port: ポート番号
+ *
+ * 戻り値
+ *  ソケット
+ *  エラーの場合は INVALID_SOCKET
+ */
+SOCKET udp_listen(const char* addr, ushort port)
+{
+#ifdef _WIN32
+    err_write("udp_listen: udp is not supported.");
+    return INVALID_SOCKET;
+#else
+    SOCKET sock;
+    int on = 1;
+    struct sockaddr_in sockaddr;
+    struct timeval tv;
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &sockaddr.sin_addr) != 1) {
+        err_write("udp_listen: invalid bind address: %s", addr);
+        return INVALID_SOCKET;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == INVALID_SOCKET) {
+        err_write("udp_listen: socket() error: %s", strerror(errno));
+        return INVALID_SOCKET;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    /* シャットダウンを検出するために受信タイムアウトを設定します。*/
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        err_write("udp_listen: setsockopt() error: %s", strerror(errno));
+        SOCKET_CLOSE(sock);
+        return INVALID_SOCKET;
+    }
+
+    if (bind(sock, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+        err_write("udp_listen: bind() error %s:%d: %s", addr, port, strerror(errno));
+        SOCKET_CLOSE(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+#endif
+}
+
+#ifndef _WIN32
+static int recv_batch(struct udp_worker_t* w)
+{
+    int i;
+
+#ifdef HAVE_RECVMMSG
+    for (i = 0; i < UDP_RECV_BATCH; i++) {
+        w->rmsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        w->rmsgs[i].msg_hdr.msg_flags = 0;
+    }
+    /* 最初のデータグラムを待機し、以降は受信済みのものだけを取り出します。*/
+    return recvmmsg(g_udp_socket, w->rmsgs, UDP_RECV_BATCH, MSG_WAITFORONE, NULL);
+#else
+    ssize_t len;
+
+    i = 0;
+    w->rmsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    w->rmsgs[i].msg_hdr.msg_flags = 0;
+    len = recvmsg(g_udp_socket, &w->rmsgs[i].msg_hdr, 0);
+    if (len < 0)
+        return -1;
+    w->rmsgs[i].msg_len = (unsigned int)len;
+    return 1;
+#endif
+}
+
+static void send_flush(struct udp_worker_t* w)
+{
+    int sent = 0;
+
+    while (sent < w->scount) {
+        int n;
+
+#ifdef HAVE_SENDMMSG
+        n = sendmmsg(g_udp_socket, &w->smsgs[sent], w->scount - sent, 0);
+#else
+        n = (sendmsg(g_udp_socket, &w->smsgs[sent].msg_hdr, 0) < 0)? -1 : 1;
+#endif
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* 送信できなかったデータグラムは破棄します。*/
+            ATOMIC_ADD(g_stats.udp_errors, 1);
+            break;
+        }
+        sent += n;
+    }
+    w->scount = 0;
+}
+
+/*
+ * 応答データをデータグラムに分割して送信キューに追加します。
+ * 応答データの内容は送信されるまで参照されます。
+ */
+static void send_reply(struct udp_worker_t* w,
+                       const uchar* reqhdr,
+                       struct sockaddr_in* addr,
+                       struct membuf_t* mb)
+{
+    int chunk = UDP_MAX_PAYLOAD - UDP_HEADER_SIZE;
+    int total;
+    int seq;
+
+    total = (mb->size + chunk - 1) / chunk;
+    if (total > 0xffff) {
+        /* sequence で表せないため送信しません。*/
+        ATOMIC_ADD(g_stats.udp_errors, 1);
+        return;
+    }
+
+    for (seq = 0; seq < total; seq++) {
+        struct msghdr* mh;
+        uchar* hdr;
+        int offset = seq * chunk;
+        int len = (mb->size - offset < chunk)? mb->size - offset : chunk;
+
+        if (w->scount >= UDP_SEND_BATCH)
+            send_flush(w);
+
+        hdr = w->shdr[w->scount];
+        hdr[0] = reqhdr[0];     /* request id */
+        hdr[1] = reqhdr[1];
+        hdr[2] = (uchar)(seq >> 8);
+        hdr[3] = (uchar)seq;
+        hdr[4] = (uchar)(total >> 8);
+        hdr[5] = (uchar)total;
+        hdr[6] = 0;
+        hdr[7] = 0;
+
+        w->siov[w->scount][0].iov_base = hdr;
+        w->siov[w->scount][0].iov_len = UDP_HEADER_SIZE;
+        w->siov[w->scount][1].iov_base = mb->buf + offset;
+        w->siov[w->scount][1].iov_len = len;
+
+        mh = &w->smsgs[w->scount].msg_hdr;
+        memset(mh, 0, sizeof(struct msghdr));
+        mh->msg_name = addr;
+        mh->msg_namelen = sizeof(struct sockaddr_in);
+        mh->msg_iov = w->siov[w->scount];
+        mh->msg_iovlen = 2;
+        w->scount++;
+    }
+}
+
+/*
+ * 受信したデータグラムを処理して応答を mb に編集します。
+ *
+ * 戻り値
+ *  0: 応答を送信する
+ * -1: 応答しない
+ */
+static int udp_request(struct udp_worker_t* w, int i, struct membuf_t* mb)
+{
+    struct udp_msg_t* m = &w->rmsgs[i];
+    uchar* p = (uchar*)w->rbuf[i];
+    char* line;
+    char* eol;
+    int len = (int)m->msg_len;
+
+    if (len < UDP_HEADER_SIZE || (m->msg_hdr.msg_flags & MSG_TRUNC)) {
+        ATOMIC_ADD(g_stats.udp_errors, 1);
+        return -1;
+    }
+    /* 複数のデータグラムに分割されたリクエストには対応していません。*/
+    if (((p[4] << 8) | p[5]) != 1) {
+        ATOMIC_ADD(g_stats.udp_errors, 1);
+        return -1;
+    }
+
+    line = (char*)p + UDP_HEADER_SIZE;
+    line[len - UDP_HEADER_SIZE] = '\0';
+    eol = strchr(line, '\n');
+    if (eol == NULL) {
+        ATOMIC_ADD(g_stats.udp_errors, 1);
+        return -1;
+    }
+    if (eol > line && *(eol-1) == '\r')
+        eol--;
+    *eol = '\0';
+
+    TRACE("udp request command: %s ...\n", line);
+    ATOMIC_ADD(g_stats.udp_requests, 1);
+
+    switch (memcached_udp_command(line, mb, UDP_MAX_KEYS, UDP_MAX_REPLY)) {
+        case 0:
+            break;
+        case 1:
+            /* キー数または応答サイズの制限を超えました。*/
+            ATOMIC_ADD(g_stats.udp_errors, 1);
+            break;
+        default: {
+            const char* msg = "SERVER_ERROR no memory.\r\n";
+
+            mb->size = 0;
+            mb_append(mb, msg, strlen(msg));
+            break;
+        }
+    }
+    return 0;
+}
+
+static void udp_thread(void* argv)
+{
+    struct udp_worker_t* w = (struct udp_worker_t*)argv;
+
+    while (! g_shutdown_flag) {
+        int n;
+        int i;
+
+        n = recv_batch(w);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;   /* タイムアウト */
+            if (g_shutdown_flag)
+                break;
+            err_write("udp_thread: recv error: %s", strerror(errno));
+            continue;
+        }
+
+        /* 応答データは送信するまで保持します。*/
+        for (i = 0; i < n; i++) {
+            w->reply[i]->size = 0;
+            if (udp_request(w, i, w->reply[i]) == 0)
+                send_reply(w, (uchar*)w->rbuf[i], &w->raddr[i], w->reply[i]);
+        }
+        send_flush(w);
+
+        /* 大きな応答で拡張されたバッファを解放します。*/
+        for (i = 0; i < n; i++) {
+            if (w->reply[i]->bufsize > UDP_RECV_SIZE) {
+                mb_free(w->reply[i]);
+                w->reply[i] = mb_alloc(UDP_MAX_PAYLOAD);
+                if (w->reply[i] == NULL) {
+                    err_write("udp_thread: no memory.");
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static struct udp_worker_t* udp_worker_alloc()
+{
+    struct udp_worker_t* w;
+    int i;
+
+    w = (struct udp_worker_t*)calloc(1, sizeof(struct udp_worker_t));
+    if (w == NULL)
+        return NULL;
+
+    for (i = 0; i < UDP_RECV_BATCH; i++) {
+        struct msghdr* mh = &w->rmsgs[i].msg_hdr;
+
+        w->riov[i].iov_base = w->rbuf[i];
+        w->riov[i].iov_len = UDP_RECV_SIZE;
+        mh->msg_name = &w->raddr[i];
+        mh->msg_namelen = sizeof(struct sockaddr_in);
+        mh->msg_iov = &w->riov[i];
+        mh->msg_iovlen = 1;
+
+        w->reply[i] = mb_alloc(UDP_MAX_PAYLOAD);
+        if (w->reply[i] == NULL) {
+            while (--i >= 0)
+                mb_free(w->reply[i]);
+            free(w);
+            return NULL;
+        }
+    }
+    return w;
+}
+#endif
+
+/*
+ * UDP のスレッドを起動します。
+ * UDP を使用しない場合は何もしません。
+ *
+ * 戻り値
+ *  0: 成功
+ * -1: エラー
+ */
+int udp_server()
+{
+#ifndef _WIN32
+    int i;
+
+    if (g_udp_socket == INVALID_SOCKET)
+        return 0;
+
+    for (i = 0; i < g_conf->udp_threads; i++) {
+        struct udp_worker_t* w;
+        pthread_t thread_id;
+
+        /* 作業領域はプロセスの終了まで保持します。*/
+        w = udp_worker_alloc();
+        if (w == NULL) {
+            err_write("udp_server: no memory.");
+            return -1;
+        }
+        if (pthread_create(&thread_id, NULL, (void*)udp_thread, w) != 0) {
+            err_write("udp_server: pthread_create() error: %s", strerror(errno));
+            return -1;
+        }
+        pthread_detach(thread_id);
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,730 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2010-2011 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * io_uring によるリアクターの I/O
+ *
+ * configure --enable-io-uring で有効になります(Linux のみ)。
+ * liburing は使用せず、システムコールを直接使用します。
+ *
+ * 各リアクターは専用のリングを持ち、以下の要求を発行します。
+ *
+ * 1. listenソケットに multishot accept を発行します。
+ *    １回の要求で接続のたびに完了通知が返されます。
+ *    fd が不足している場合は listenキューが空でもエラーになるため、
+ *    接続を拒否できなかったときは listenソケットの poll を発行して
+ *    次の接続が届いてから accept を再発行します。
+ * 2. 受け付けたソケットに multishot recv を発行します。
+ *    受信バッファはカーネルに登録したバッファリング(provided buffers)
+ *    から選択され、コネクションの受信バッファにコピーした後に
+ *    すぐにリングへ戻されます。
+ * 3. 受信バッファにコマンドが揃っていれば処理して、応答データは
+ *    コネクションの送信待ちバッファに追加されます。
+ *    送信中の要求がなければ送信待ちバッファを send で発行します。
+ *
+ * nio.dispatch_quantum のコマンド数を処理したコネクションは保留リストに
+ * 追加され、完了通知をひととおり処理した後に再開します。
+ * 保留中のコネクションがある間はリングで待機しません。
+ *
+ * コネクションのクローズは発行中の要求がすべて完了してから行います。
+ * 完了通知はソケット番号と再利用世代で識別するため、
+ * クローズ後に届いた古い完了通知は無視されます。
+ *
+ * カーネルが multishot recv や provided buffers に対応していない場合は
+ * uring_available() が 0 を返し、多重I/O(epoll)で処理します。
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nio_server.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/types.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES       4096    /* 投入キューのエントリ数 */
+#define URING_BUF_COUNT     512     /* 受信バッファの数(2のべき乗) */
+#define URING_BUF_SIZE      8192    /* 受信バッファのサイズ */
+#define URING_BUF_GROUP     1       /* 受信バッファのグループID */
+
+/* 要求の種類(user_data の下位3ビット) */
+#define UD_ACCEPT   1
+#define UD_WAKEUP   2
+#define UD_RECV     3
+#define UD_SEND     4
+#define UD_LISTEN   5
+
+#define UD_MAKE(type, fd, gen)  (((__u64)(gen) << 32) | ((__u64)(fd) << 3) | (type))
+#define UD_TYPE(ud)             ((int)((ud) & 0x07))
+#define UD_FD(ud)               ((int)(((ud) >> 3) & 0x1fffffff))
+#define UD_GEN(ud)              ((uint)((ud) >> 32))
+
+struct uring_t {
+    int fd;                         /* リングのファイルディスクリプタ */
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_local_tail;         /* 未発行分を含む tail */
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+
+    struct io_uring_buf_ring* br;   /* 受信バッファのリング */
+    size_t br_len;
+    char* bufs;                     /* 受信バッファ */
+    unsigned short br_tail;
+
+    SOCKET listen_socket;
+    SOCKET unix_socket;
+    int wakeup_fd;
+    struct thread_args_t* pending;  /* 処理を保留しているコネクション */
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_close(struct uring_t* u)
+{
+    if (u->bufs)
+        free(u->bufs);
+    if (u->br)
+        munmap(u->br, u->br_len);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ptr && u->cq_ptr != u->sq_ptr)
+        munmap(u->cq_ptr, u->cq_len);
+    if (u->sq_ptr)
+        munmap(u->sq_ptr, u->sq_len);
+    if (u->fd >= 0)
+        close(u->fd);
+    memset(u, 0, sizeof(struct uring_t));
+    u->fd = -1;
+}
+
+static void buf_recycle(struct uring_t* u, int bid)
+{
+    struct io_uring_buf* b;
+
+    /* bufs[0].resv は tail と重なるため、個別に設定します。*/
+    b = &u->br->bufs[u->br_tail & (URING_BUF_COUNT - 1)];
+    b->addr = (__u64)(unsigned long)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = (__u16)bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int ring_open(struct uring_t* u, unsigned entries)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    int i;
+
+    memset(u, 0, sizeof(struct uring_t));
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_io_uring_setup(entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_entries = p.sq_entries;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len)
+            u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        u->sq_ptr = NULL;
+        goto error;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            u->cq_ptr = NULL;
+            goto error;
+        }
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_len, PROT_READ|PROT_WRITE,
+                                         MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto error;
+    }
+    u->sq_head = (unsigned*)((char*)u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned*)((char*)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned*)((char*)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((char*)u->sq_ptr + p.sq_off.array);
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned*)((char*)u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned*)((char*)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned*)((char*)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((char*)u->cq_ptr + p.cq_off.cqes);
+
+    /* 受信バッファのリングを登録します(provided buffers)。*/
+    u->br_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    u->br = (struct io_uring_buf_ring*)mmap(NULL, u->br_len, PROT_READ|PROT_WRITE,
+                                            MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        goto error;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64)(unsigned long)u->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto error;
+
+    u->bufs = (char*)malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (u->bufs == NULL)
+        goto error;
+    for (i = 0; i < URING_BUF_COUNT; i++)
+        buf_recycle(u, i);
+    return 0;
+
+error:
+    ring_close(u);
+    return -1;
+}
+
+/*
+ * 投入キューの要求を発行します。
+ * getevents が真の場合は完了通知も取得します。完了通知の一部は
+ * カーネルに入ったときに作成されるため、待機しない場合(wait_nr = 0)でも
+ * 新しい完了通知を取得するには getevents を指定します。
+ */
+static int ring_submit(struct uring_t* u, unsigned wait_nr, int getevents)
+{
+    unsigned to_submit;
+    int n;
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && ! getevents)
+        return 0;
+    n = sys_io_uring_enter(u->fd, to_submit, wait_nr, getevents? IORING_ENTER_GETEVENTS : 0);
+    if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        err_write("uring: io_uring_enter() error: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe* ring_sqe(struct uring_t* u)
+{
+    struct io_uring_sqe* sqe;
+    unsigned idx;
+
+    if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        /* 投入キューが一杯のため、先に発行します。*/
+        ring_submit(u, 0, 0);
+        if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+            return NULL;
+    }
+    idx = u->sq_local_tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    return sqe;
+}
+
+static int prep_accept(struct uring_t* u, SOCKET listen_socket)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = ring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD_MAKE(UD_ACCEPT, listen_socket, 0);
+    return 0;
+}
+
+static int prep_listen(struct uring_t* u, SOCKET listen_socket)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = ring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = listen_socket;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UD_MAKE(UD_LISTEN, listen_socket, 0);
+    return 0;
+}
+
+static int prep_wakeup(struct uring_t* u)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = ring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = u->wakeup_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UD_MAKE(UD_WAKEUP, 0, 0);
+    return 0;
+}
+
+static int prep_recv(struct uring_t* u, struct conn_t* conn)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = ring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = UD_MAKE(UD_RECV, conn->socket, conn->gen);
+    conn->uring_stat |= CONN_URING_RECV;
+    return 0;
+}
+
+static int prep_send(struct uring_t* u, struct conn_t* conn)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = ring_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->socket;
+    sqe->addr = (__u64)(unsigned long)(conn->sbuf->buf + conn->spos);
+    sqe->len = conn->sbuf->size - conn->spos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = UD_MAKE(UD_SEND, conn->socket, conn->gen);
+    conn->uring_stat |= CONN_URING_SEND;
+    return 0;
+}
+
+/*
+ * コネクションの次の要求を発行します。
+ * クローズ中のコネクションは送信が終わると shutdown() で受信を終了させ、
+ * すべての要求が完了した時点でクローズします。
+ */
+static void conn_submit(struct uring_t* u, struct conn_t* conn)
+{
+    if (conn->socket == INVALID_SOCKET)
+        return;
+
+    if (! (conn->uring_stat & CONN_URING_SEND) && conn->wbuf && conn->wbuf->size > 0) {
+        struct membuf_t* mb;
+
+        /* 送信待ちバッファを送信中に切り替えます。*/
+        mb = conn->sbuf;
+        conn->sbuf = conn->wbuf;
+        conn->wbuf = mb;
+        conn->spos = 0;
+        if (prep_send(u, conn) < 0) {
+            mb_reset(conn->sbuf);
+            conn->uring_stat |= CONN_URING_CLOSING;
+        }
+    }
+
+    if (conn->uring_stat & CONN_URING_CLOSING) {
+        if (conn->uring_stat & CONN_URING_SEND)
+            return;
+        if (conn->uring_stat & CONN_URING_RECV) {
+            if (! (conn->uring_stat & CONN_URING_SHUT)) {
+                /* 受信を終了させます。*/
+                shutdown(conn->socket, SHUT_RDWR);
+                conn->uring_stat |= CONN_URING_SHUT;
+            }
+            return;
+        }
+        conn_close(conn);
+        return;
+    }
+
+    if (! (conn->uring_stat & CONN_URING_RECV)) {
+        if (prep_recv(u, conn) < 0) {
+            conn->uring_stat |= CONN_URING_CLOSING;
+            conn_close(conn);
+        }
+    }
+}
+
+static void conn_defer(struct uring_t* u, struct conn_t* conn)
+{
+    struct thread_args_t* th_args;
+
+    th_args = (struct thread_args_t*)malloc(sizeof(struct thread_args_t));
+    if (th_args == NULL) {
+        err_write("uring: no memory.");
+        return;
+    }
+    th_args->conn = conn;
+    th_args->gen = conn->gen;
+    th_args->next = u->pending;
+    u->pending = th_args;
+    conn->uring_stat |= CONN_URING_DEFER;
+}
+
+static void conn_resume(struct uring_t* u)
+{
+    struct thread_args_t* list = NULL;
+
+    /* 保留した順に処理するためにリストを反転します。*/
+    while (u->pending) {
+        struct thread_args_t* p = u->pending;
+
+        u->pending = p->next;
+        p->next = list;
+        list = p;
+    }
+
+    while (list) {
+        struct thread_args_t* p = list;
+        struct conn_t* conn = p->conn;
+
+        list = p->next;
+        if (conn->gen == p->gen)
+            conn->uring_stat &= ~CONN_URING_DEFER;
+        /* 保留中にクローズされたコネクションは無視します。*/
+        if (conn->socket != INVALID_SOCKET && conn->gen == p->gen &&
+            ! (conn->uring_stat & CONN_URING_CLOSING)) {
+            if (memcached_process(conn) > 0)
+                conn_defer(u, conn);
+            conn_submit(u, conn);
+        }
+        free(p);
+    }
+}
+
+static int accept_complete(struct uring_t* u, struct io_uring_cqe* cqe)
+{
+    SOCKET socket = cqe->res;
+    SOCKET listen_socket = UD_FD(cqe->user_data);
+    int local = (listen_socket == u->unix_socket);
+    struct sockaddr_in sockaddr;
+    socklen_t n = sizeof(sockaddr);
+    struct conn_t* conn;
+    int shed = 0;
+
+    if (socket < 0) {
+        if (socket != -EAGAIN && socket != -EINTR && socket != -ECONNABORTED) {
+            /* fd 不足の場合は listenキューの接続を１つ拒否します。*/
+            shed = accept_error(listen_socket, -socket);
+        }
+    }
+    if (! (cqe->flags & IORING_CQE_F_MORE)) {
+        /* multishot が終了したため再度発行します。*/
+        if ((socket == -EMFILE || socket == -ENFILE) && ! shed)
+            prep_listen(u, listen_socket);
+        else
+            prep_accept(u, listen_socket);
+    }
+    if (socket < 0)
+        return 0;
+    if (g_shutdown_flag) {
+        SOCKET_CLOSE(socket);
+        return 0;
+    }
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    if (local) {
+        /* Unix ドメインソケットはループバックのアドレスとします。*/
+        sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    } else {
+        getpeername(socket, (struct sockaddr*)&sockaddr, &n);
+    }
+    if (g_trace_mode) {
+        char ip_addr[256];
+
+        mt_inet_ntoa(sockaddr.sin_addr, ip_addr);
+        TRACE("connect from %s, socket=%d ... \n", ip_addr, socket);
+    }
+
+    /* コネクションテーブルに登録します。*/
+    conn = conn_open(socket, sockaddr.sin_addr, NULL);
+    if (conn == NULL) {
+        SOCKET_CLOSE(socket);
+        return 0;
+    }
+    conn->io_mode = CONN_IO_URING;
+    conn->local = local;
+    conn_submit(u, conn);
+    return 1;
+}
+
+static void recv_complete(struct uring_t* u, struct io_uring_cqe* cqe)
+{
+    struct conn_t* conn;
+    int bid = -1;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    conn = conn_get(UD_FD(cqe->user_data));
+    if (conn == NULL || conn->gen != UD_GEN(cqe->user_data)) {
+        /* クローズ済みのコネクション */
+        if (bid >= 0)
+            buf_recycle(u, bid);
+        return;
+    }
+    if (! (cqe->flags & IORING_CQE_F_MORE))
+        conn->uring_stat &= ~CONN_URING_RECV;
+
+    if (cqe->res > 0 && bid >= 0) {
+        int result = 0;
+
+        if (! (conn->uring_stat & CONN_URING_CLOSING))
+            result = conn_append(conn, u->bufs + (size_t)bid * URING_BUF_SIZE, cqe->res);
+        buf_recycle(u, bid);
+        if (result < 0)
+            conn_close(conn);
+        else if (! (conn->uring_stat & (CONN_URING_CLOSING | CONN_URING_DEFER))) {
+            /* 保留中のコネクションは受信データの追加だけ行い、
+               処理は conn_resume() に任せます。*/
+            if (memcached_process(conn) > 0)
+                conn_defer(u, conn);
+        }
+    } else {
+        if (bid >= 0)
+            buf_recycle(u, bid);
+        /* -ENOBUFS は受信バッファの不足のため再度発行します。*/
+        if (cqe->res != -ENOBUFS)
+            conn_close(conn);
+    }
+    conn_submit(u, conn);
+}
+
+static void send_complete(struct uring_t* u, struct io_uring_cqe* cqe)
+{
+    struct conn_t* conn;
+
+    conn = conn_get(UD_FD(cqe->user_data));
+    if (conn == NULL || conn->gen != UD_GEN(cqe->user_data))
+        return;
+    conn->uring_stat &= ~CONN_URING_SEND;
+
+    if (cqe->res < 0) {
+        /* 送信エラーのため未送信のデータは破棄します。*/
+        mb_reset(conn->sbuf);
+        if (conn->wbuf)
+            mb_reset(conn->wbuf);
+        conn_close(conn);
+    } else {
+        conn->spos += cqe->res;
+        if (conn->spos < conn->sbuf->size) {
+            /* 残りを送信します。*/
+            if (prep_send(u, conn) == 0)
+                return;
+            conn->uring_stat |= CONN_URING_CLOSING;
+        }
+        mb_reset(conn->sbuf);
+        conn->spos = 0;
+        conn_shrink(conn);
+    }
+    conn_submit(u, conn);
+}
+
+/*
+ * カーネルが必要な機能に対応しているか調べます。
+ * ソケットペアに multishot recv を発行して確認します。
+ *
+ * 戻り値
+ *  1: 使用可能
+ *  0: 使用不可
+ */
+int uring_available()
+{
+    static int available = -1;
+    struct uring_t u;
+    struct io_uring_sqe* sqe;
+    int sv[2];
+
+    if (available >= 0)
+        return available;
+    available = 0;
+
+    if (ring_open(&u, 8) < 0)
+        return 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        ring_close(&u);
+        return 0;
+    }
+    sqe = ring_sqe(&u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    if (write(sv[1], "x", 1) == 1 && ring_submit(&u, 1, 1) == 0) {
+        unsigned head = *u.cq_head;
+
+        if (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &u.cqes[head & *u.cq_mask];
+
+            if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE))
+                available = 1;
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+    ring_close(&u);
+    return available;
+}
+
+/*
+ * io_uring でリアクターのイベントループを実行します。
+ * シャットダウンされるまで戻りません。
+ *
+ * listen_socket: SO_REUSEPORT の listenソケット
+ * unix_socket: Unix ドメインソケットの listenソケット(INVALID_SOCKET は使用しない)
+ * wakeup_fd: 待機解除用パイプの読み込み側
+ *
+ * 戻り値
+ *  0: 正常終了
+ * -1: リングが作成できなかった(多重I/Oで処理する必要があります)
+ */
+int uring_loop(SOCKET listen_socket, SOCKET unix_socket, int wakeup_fd)
+{
+    struct uring_t u;
+
+    if (ring_open(&u, URING_ENTRIES) < 0) {
+        err_write("uring: ring setup error: %s", strerror(errno));
+        return -1;
+    }
+    u.listen_socket = listen_socket;
+    u.unix_socket = unix_socket;
+    u.wakeup_fd = wakeup_fd;
+    prep_accept(&u, listen_socket);
+    if (unix_socket != INVALID_SOCKET)
+        prep_accept(&u, unix_socket);
+    prep_wakeup(&u);
+
+    while (! g_shutdown_flag) {
+        unsigned head, tail;
+        int accepts = 0;
+
+        /* 保留中のコネクションがある場合は待機しません。*/
+        if (ring_submit(&u, (u.pending)? 0 : 1, 1) < 0)
+            break;
+
+        head = *u.cq_head;
+        tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &u.cqes[head & *u.cq_mask];
+
+            switch (UD_TYPE(cqe->user_data)) {
+                case UD_ACCEPT:
+                    accepts += accept_complete(&u, cqe);
+                    break;
+                case UD_LISTEN:
+                    /* 接続が届いたため accept を再発行します。*/
+                    prep_accept(&u, UD_FD(cqe->user_data));
+                    break;
+                case UD_WAKEUP: {
+                    char dummy;
+
+                    /* 待機解除の通知を読み捨てます。*/
+                    read(wakeup_fd, &dummy, sizeof(dummy));
+                    prep_wakeup(&u);
+                    break;
+                }
+                case UD_RECV:
+                    recv_complete(&u, cqe);
+                    break;
+                case UD_SEND:
+                    send_complete(&u, cqe);
+                    break;
+            }
+            head++;
+            __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+            if (head == tail)
+                tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+        }
+        stats_max(&g_stats.accept_batch_max, accepts);
+
+        if (u.pending)
+            conn_resume(&u);
+    }
+    /* シャットダウンの応答など未発行の要求を発行します。*/
+    ring_submit(&u, 0, 0);
+    while (u.pending) {
+        struct thread_args_t* p = u.pending;
+
+        u.pending = p->next;
+        free(p);
+    }
+    ring_close(&u);
+    return 0;
+}
+
+#else
+
+int uring_available()
+{
+    return 0;
+}
+
+int uring_loop(SOCKET listen_socket, SOCKET unix_socket, int wakeup_fd)
+{
+    return -1;
+}
+
+#endif  /* HAVE_IO_URING */